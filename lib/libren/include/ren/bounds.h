@@ -0,0 +1,135 @@
+#ifndef REN_BOUNDS_H_
+#define REN_BOUNDS_H_
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "ren/typedefs.h"
+#include "ren/vec.h"
+namespace ren {
+// Axis aligned bounding box. A default constructed box is empty, i.e., it
+// contains nothing and its union with any other box is the other box.
+struct Bounds3 {
+  Vec3 min;
+  Vec3 max;
+  Bounds3()
+      : min(std::numeric_limits<Real>::infinity()),
+        max(-std::numeric_limits<Real>::infinity()) {}
+  Bounds3(const Vec3 &p) : min(p), max(p) {}
+  Bounds3(const Vec3 &a, const Vec3 &b) {
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(a[i], b[i]);
+      max[i] = std::max(a[i], b[i]);
+    }
+  }
+
+  // Grow the box to contain \p b.
+  void Expand(const Bounds3 &b) {
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(min[i], b.min[i]);
+      max[i] = std::max(max[i], b.max[i]);
+    }
+  }
+
+  // Grow the box to contain \p p.
+  void Expand(const Vec3 &p) {
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(min[i], p[i]);
+      max[i] = std::max(max[i], p[i]);
+    }
+  }
+
+  Vec3 Diagonal() const { return max - min; }
+
+  Vec3 Centroid() const { return (min + max) * Real(0.5); }
+
+  bool IsEmpty() const {
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+  }
+
+  // @return true if the box is non empty and all its corners are finite
+  bool IsFinite() const {
+    for (int i = 0; i < 3; ++i) {
+      if (!std::isfinite(min[i]) || !std::isfinite(max[i])) {
+        return false;
+      }
+    }
+    return !IsEmpty();
+  }
+
+  Real SurfaceArea() const {
+    if (IsEmpty()) {
+      return 0;
+    }
+    auto d = Diagonal();
+    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+  }
+
+  // @return the axis with the largest extent
+  int MaxExtent() const {
+    auto d = Diagonal();
+    if (d.x > d.y && d.x > d.z) {
+      return 0;
+    }
+    return d.y > d.z ? 1 : 2;
+  }
+
+  // Test for intersection with a ray using the slab method.
+  // @param origin the origin of the ray
+  // @param inv_dir the component wise inverse of the ray direction
+  // @param dir_is_neg for each axis, 1 if the ray direction is negative
+  // @param tmax the maximum distance along the ray
+  // @return true if the ray overlaps the box in [0, \p tmax]
+  bool IntersectP(const Vec3 &origin, const Vec3 &inv_dir,
+                  const int dir_is_neg[3], Real tmax) const {
+    const Vec3 *b = &min;
+    Real t0 = (b[dir_is_neg[0]].x - origin.x) * inv_dir.x;
+    Real t1 = (b[1 - dir_is_neg[0]].x - origin.x) * inv_dir.x;
+    Real ty0 = (b[dir_is_neg[1]].y - origin.y) * inv_dir.y;
+    Real ty1 = (b[1 - dir_is_neg[1]].y - origin.y) * inv_dir.y;
+    if (t0 > ty1 || ty0 > t1) {
+      return false;
+    }
+    if (ty0 > t0) t0 = ty0;
+    if (ty1 < t1) t1 = ty1;
+    Real tz0 = (b[dir_is_neg[2]].z - origin.z) * inv_dir.z;
+    Real tz1 = (b[1 - dir_is_neg[2]].z - origin.z) * inv_dir.z;
+    if (t0 > tz1 || tz0 > t1) {
+      return false;
+    }
+    if (tz0 > t0) t0 = tz0;
+    if (tz1 < t1) t1 = tz1;
+    return t0 <= tmax && t1 >= 0;
+  }
+};
+
+inline Bounds3 Union(const Bounds3 &a, const Bounds3 &b) {
+  Bounds3 res;
+  for (int i = 0; i < 3; ++i) {
+    res.min[i] = std::min(a.min[i], b.min[i]);
+    res.max[i] = std::max(a.max[i], b.max[i]);
+  }
+  return res;
+}
+
+inline Bounds3 Union(const Bounds3 &a, const Vec3 &p) {
+  Bounds3 res;
+  for (int i = 0; i < 3; ++i) {
+    res.min[i] = std::min(a.min[i], p[i]);
+    res.max[i] = std::max(a.max[i], p[i]);
+  }
+  return res;
+}
+
+// @return the position of \p p relative to the corners of \p b, i.e., (0,0,0)
+// at the minimum corner and (1,1,1) at the maximum one
+inline Vec3 Offset(const Bounds3 &b, const Vec3 &p) {
+  Vec3 o = p - b.min;
+  for (int i = 0; i < 3; ++i) {
+    if (b.max[i] > b.min[i]) {
+      o[i] /= b.max[i] - b.min[i];
+    }
+  }
+  return o;
+}
+}  // namespace ren
+#endif  // REN_BOUNDS_H_
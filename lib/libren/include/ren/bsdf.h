@@ -45,6 +45,7 @@ class Bsdf {
   // @return the value of evaluating the BSDF with the given parameters
   virtual Vec3 SampleF(const SurfaceDiff &surface, const Vec3 &w_o, Vec3 &w_i,
                        Real &pdf, bool adjoint = false) const = 0;
+  virtual ~Bsdf() = default;
   Bsdf::Type type_;
 };
 
@@ -0,0 +1,898 @@
+#ifndef REN_BVH_H_
+#define REN_BVH_H_
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include "ren/bounds.h"
+#include "ren/ray.h"
+#include "ren/ray_packet.h"
+#include "ren/simd.h"
+#include "ren/thread_pool.h"
+#include "ren/typedefs.h"
+namespace ren {
+// Settings of the hierarchy builder.
+struct BvhOptions {
+  enum SplitMethod {
+    kMiddle,  // split at the middle of the centroids' extent
+    kSah      // binned surface area heuristic
+  };
+  SplitMethod split_method = kSah;
+  // the maximum number of primitives in a leaf
+  int max_prims_in_node = 4;
+  // the number of bins per axis used to evaluate the surface area heuristic
+  int num_bins = 16;
+  // the pool the subtrees are built on, null for DefaultThreadPool(). It
+  // must outlive the refits of the hierarchy, which must not be built or
+  // refitted by a task of the pool
+  ThreadPool *thread_pool = nullptr;
+  // allow splitting primitives that straddle a split plane (SBVH). It's only
+  // used by hierarchies built with a clipping function, e.g., triangle meshes
+  bool spatial_splits = false;
+  // spatial splits are only tried when the overlap of the children of the
+  // best object split, relative to the area of the root, is above this
+  Real spatial_split_alpha = 1E-5;
+  // the maximum number of references to primitives that spatial splits can
+  // create, relative to the number of primitives
+  Real spatial_split_budget = 2;
+  // refitting rebuilds the highest modified subtree whose SAH cost, relative
+  // to its area, grew by more than this factor since it was built
+  Real rebuild_threshold = 1.3;
+  // store the bounds of the children of every node quantized to 8 bits
+  // relative to the bounds of the node, which takes less than a third of the
+  // memory. The bounds are decoded during the traversal and refitting
+  // rebuilds the whole hierarchy. Only used by binary hierarchies
+  bool compressed = false;
+  // the number of children of the nodes traversed: 2, or 4 or 8 to collapse
+  // the binary hierarchy into a wide one whose child bounds are tested
+  // together with SIMD instructions. Refitting a wide hierarchy rebuilds it,
+  // unless keep_binary is set
+  int width = 2;
+  // keep the binary nodes of a wide hierarchy alongside the wide ones, so
+  // that Refit refits them and collapses them again instead of rebuilding.
+  // Costs the memory of the binary nodes, which suits small hierarchies
+  // like the one over the objects of a scene
+  bool keep_binary = false;
+  // build a grid instead of a hierarchy if 1 or 2, in time linear in the
+  // number of primitives. Each cell references the primitives overlapping it
+  // and rays walk the cells they cross in order. With 2 levels the cells of a
+  // coarse grid holding primitives are split by grids of their own, which
+  // skips the empty space around surfaces faster than a uniform grid. Slower
+  // to trace than a hierarchy, grids suit previews and scenes rebuilt every
+  // frame
+  int grid_levels = 0;
+  // the number of cells of a grid per primitive, or of the grid of a cell
+  // per primitive of the cell
+  Real grid_density = 2;
+  // print the statistics of every build to std::clog
+  bool report = false;
+};
+
+// Compute the bounds of the two parts of a primitive cut by an axis aligned
+// plane.
+// @param prim the index of the primitive
+// @param bounds the part of the primitive being split, the results should
+// be clamped to it
+// @param axis the axis the plane is perpendicular to
+// @param pos the position of the plane along \p axis
+// @param left the bounds of the part of the primitive below the plane
+// @param right the bounds of the part of the primitive above the plane
+typedef std::function<void(int prim, const Bounds3 &bounds, int axis, Real pos,
+                           Bounds3 &left, Bounds3 &right)>
+    ClipFunction;
+
+// @return the options used when none are given explicitly. They can be
+// modified, e.g., from the command line, before the scenes are built.
+BvhOptions &DefaultBvhOptions();
+
+// Statistics gathered while building a hierarchy.
+struct BvhStats {
+  int num_prims = 0;
+  // the number of primitives referenced by the leaves, larger than
+  // num_prims when spatial splits or the cells of a grid duplicated some of
+  // them
+  int num_refs = 0;
+  // the cells of a grid count as nodes, and the non-empty cells of the last
+  // level as leaves
+  int num_nodes = 0;
+  int num_leaves = 0;
+  int num_threads = 0;
+  // expected cost of tracing a ray hitting the root according to the surface
+  // area heuristic, in units of primitive intersections
+  Real sah_cost = 0;
+  double build_ms = 0;
+  // the number of calls to Refit() and of subtrees rebuilt by them
+  int num_refits = 0;
+  int num_rebuilds = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, const BvhStats &stats);
+
+// Bounding volume hierarchy over a set of primitives. The hierarchy only knows
+// about the bounds of the primitives, intersecting the primitives themselves
+// is left to the caller by means of a callback. If BvhOptions::grid_levels
+// is set a grid takes the place of the hierarchy, its cells being handed over
+// like leaves.
+class Bvh {
+ public:
+  Bvh();
+  // Build the hierarchy.
+  // @param prim_bounds the bounds of each primitive
+  // @param options the builder settings
+  Bvh(const std::vector<Bounds3> &prim_bounds,
+      const BvhOptions &options = DefaultBvhOptions());
+  // Build the hierarchy allowing spatial splits if enabled in \p options.
+  // @param prim_bounds the bounds of each primitive
+  // @param options the builder settings
+  // @param clip the function used to split the primitives
+  Bvh(const std::vector<Bounds3> &prim_bounds, const BvhOptions &options,
+      const ClipFunction &clip);
+  // Traverse the hierarchy front to back looking for the closest
+  // intersection.
+  // @param ray the ray to test with. Its tmax is used to cull nodes and it
+  // should be shortened by \p intersect whenever a closer hit is found
+  // @param intersect callable with signature bool(int prim, Ray &ray) that
+  // tests the primitive with index \p prim against \p ray
+  // @return true if any call to \p intersect returned true
+  template <typename F>
+  bool Intersect(Ray &ray, F intersect) const;
+  // Traverse the hierarchy with a packet of rays looking for the closest
+  // intersection of each of them. Coherent packets share the traversal of
+  // binary hierarchies, the others are traced one ray at a time.
+  // @param packet the rays to test with, like in Intersect()
+  // @param intersect callable with signature bool(int prim, int rays) that
+  // tests the primitive with index \p prim against the rays of \p packet
+  // whose bits are set in \p rays
+  template <typename F>
+  void Intersect(RayPacket &packet, F intersect) const;
+  // Traverse the hierarchy until any primitive is hit.
+  // @param ray the ray to test with
+  // @param occluded callable with signature bool(int prim) that tests the
+  // primitive with index \p prim against \p ray
+  // @return true as soon as a call to \p occluded returns true
+  template <typename F>
+  bool Occluded(const Ray &ray, F occluded) const;
+  // Same as Intersect() but the primitives of a leaf are handed over
+  // together, e.g., to test several of them at once.
+  // @param intersect callable with signature bool(int begin, int end, Ray
+  // &ray) that tests the primitives prim_indices()[i] for i in [begin, end)
+  template <typename F>
+  bool IntersectLeaves(Ray &ray, F intersect) const;
+  // Same as Occluded() but the primitives of a leaf are handed over together.
+  // @param occluded callable with signature bool(int begin, int end) that
+  // tests the primitives prim_indices()[i] for i in [begin, end)
+  template <typename F>
+  bool OccludedLeaves(const Ray &ray, F occluded) const;
+  const Bounds3 &bounds() const;
+  // @return the primitives in the order they are referenced by the leaves. A
+  // primitive can appear more than once if spatial splits were used.
+  const std::vector<int> &prim_indices() const;
+  // Renumber the primitives referenced by the leaves. Used by callers that
+  // reorder their primitives following prim_indices() for better locality.
+  // @param old_to_new the new index of each primitive
+  void RemapPrims(const std::vector<int> &old_to_new);
+  // Update the hierarchy after the bounds of some primitives changed. The
+  // nodes above them are refit bottom-up and the highest subtree degraded
+  // past BvhOptions::rebuild_threshold, if any, is rebuilt. Grids and
+  // hierarchies without their binary nodes are rebuilt whole.
+  // @param prims the primitives whose bounds changed
+  // @param prim_bounds the current bounds of every primitive
+  void Refit(const std::vector<int> &prims,
+             const std::vector<Bounds3> &prim_bounds);
+  bool empty() const;
+  const BvhStats &stats() const;
+  // @return the bytes used by the nodes and the primitive indices
+  std::size_t MemoryUsage() const;
+  // Copy the hierarchy to a block of bytes, e.g., to store it in a file,
+  // which Deserialize() reads back without building the hierarchy again. The
+  // block holds the nodes as they are in memory so it can only be read by a
+  // build with the same Real.
+  // @param out where the block is written, nullptr to only get its size
+  // @return the size of the block in bytes
+  std::size_t Serialize(char *out) const;
+  // @param data a block written by Serialize()
+  // @return the hierarchy stored in the block
+  static Bvh Deserialize(const char *data);
+  // The layout of the blocks of Serialize(), bumped whenever it changes so
+  // that the files holding blocks of another layout are rejected.
+  static const uint32_t kSerializeVersion = 2;
+
+ private:
+  // the size of the traversal stack. The builder falls back to halving the
+  // primitives 32 levels before this depth so the stack never overflows.
+  static const int kMaxDepth = 128;
+  struct Node {
+    Bounds3 bounds;
+    // index of the first primitive for leaves, index of the second child for
+    // interior nodes. The first child always follows its parent.
+    int offset;
+    uint16_t num_prims;  // 0 for interior nodes
+    uint8_t axis;        // the split axis of interior nodes
+  };
+  // Node of a compressed hierarchy. It holds the bounds of its two children
+  // on a grid over its own bounds with 255 cells per axis. Leaves aren't
+  // nodes of their own, their primitives are referenced by their parent.
+  struct QuantizedNode {
+    // the grid starts at origin and its cells measure 2^exponent
+    float origin[3];
+    int8_t exponent[3];
+    // the number of primitives of the first child in the low 4 bits and of
+    // the second one in the high 4 bits, kInteriorChild for interior nodes
+    uint8_t num_prims;
+    uint8_t lo[3][2];
+    uint8_t hi[3][2];
+    // index of the second child if both children are interior nodes,
+    // otherwise index of the first primitive of the leaves. The primitives
+    // of the second child follow those of the first one if both are leaves
+    // and the first interior child always follows its parent.
+    int32_t offset;
+  };
+  static const int kInteriorChild = 15;
+  // Node of a wide hierarchy with up to N children. Their bounds are stored
+  // in single precision, rounded outwards, with the same coordinate of every
+  // child contiguous. The unused children have empty bounds.
+  template <int N>
+  struct WideNode {
+    float min[3][N];
+    float max[3][N];
+    // index of the node for interior children, of the first primitive for
+    // leaves
+    int32_t offset[N];
+    // 0 for interior children
+    uint16_t num_prims[N];
+  };
+  // Ray prepared for testing the children of wide nodes.
+  template <int N>
+  struct WideRay {
+    explicit WideRay(const Ray &ray);
+    int dir_is_neg[3];
+    SimdFloat<N> origin[3];
+    SimdFloat<N> inv_dir[3];
+  };
+  // A child of a wide node waiting on the traversal stack.
+  struct WideStackEntry {
+    int offset;
+    int num_prims;
+    Real tmin;
+  };
+  // A ray walking the cells of a grid it crosses, a 3D-DDA.
+  struct GridWalk {
+    // Start from the cell of the point of the ray at distance \p t, or the
+    // closest one if the point is out of the grid.
+    // @param origin the lower corner of the grid
+    // @param resolution the number of cells along each axis
+    // @param cell_size the size of the cells along each axis
+    GridWalk(const Ray &ray, const Vec3 &inv_dir, Real t, const Vec3 &origin,
+             const int resolution[3], const Vec3 &cell_size);
+    // Move to the next cell.
+    // @return false if the ray leaves the grid or only enters the next cell
+    // farther than \p tmax
+    bool Next(Real tmax);
+    // the index of the current cell and the distance the ray enters it at
+    int cell;
+    Real t;
+    int coords[3];
+    // the steps of the coordinates and of the index along each axis, and the
+    // coordinates past the grid
+    int step[3];
+    int stride[3];
+    int end[3];
+    // the distance to the next cell along each axis, and between cells
+    Real next[3];
+    Real delta[3];
+  };
+  // A cell of the top grid, split by a grid of its own if it has more than
+  // one cell.
+  struct GridBlock {
+    // the index of its first cell in grid_cells_
+    int first;
+    int resolution[3];
+  };
+  struct BuildContext;
+  struct BuildTask;
+  struct PrimRef;
+  struct CompressedChild;
+  void Build(const std::vector<Bounds3> &prim_bounds, const BvhOptions &options,
+             const ClipFunction *clip);
+  // Build the grid and, with two levels, the grids of its cells.
+  void BuildGrid(const std::vector<Bounds3> &prim_bounds,
+                 const BvhOptions &options);
+  // Build the subtree over the primitive references [begin, end), or over
+  // \p refs with spatial splits, like BuildRecursive() and
+  // BuildSpatialRecursive() but on the threads of the pool. The nodes of the
+  // top levels are split a level at a time, spread over the threads, then
+  // the subtrees below them are built by whichever thread is free.
+  void BuildParallel(BuildContext &context, int begin, int end,
+                     std::vector<PrimRef> &refs, int depth,
+                     std::vector<Node> &nodes, std::vector<int> &prims);
+  // Append the nodes of a task of BuildParallel() and of its children,
+  // fixing their offsets.
+  static void AppendTask(const BuildContext &context,
+                         const std::vector<BuildTask> &tasks, int t,
+                         std::vector<Node> &nodes, std::vector<int> &prims);
+  // Build the subtree over the primitive references [begin, end) appending
+  // its nodes to \p nodes.
+  // @return the index of the root of the subtree in \p nodes
+  int BuildRecursive(BuildContext &context, int begin, int end, int depth,
+                     std::vector<Node> &nodes);
+  // Choose how to split the primitive references [begin, end) and partition
+  // them.
+  // @return false if a leaf should be created instead
+  bool Split(BuildContext &context, int begin, int end, const Bounds3 &bounds,
+             int depth, int &axis, int &mid);
+  // Same as BuildRecursive() but the references are not partitioned in place
+  // since spatial splits can duplicate them. The primitives of the leaves are
+  // appended to \p prims.
+  int BuildSpatialRecursive(BuildContext &context, std::vector<PrimRef> &refs,
+                            int depth, std::vector<Node> &nodes,
+                            std::vector<int> &prims);
+  // Choose how to split the references \p refs, which may duplicate some of
+  // them, and distribute them to \p left and \p right, releasing \p refs.
+  // @return false if a leaf should be created instead
+  bool SplitSpatial(BuildContext &context, std::vector<PrimRef> &refs,
+                    const Bounds3 &bounds, int depth, int &axis,
+                    std::vector<PrimRef> &left, std::vector<PrimRef> &right);
+  Real SahCost(int node) const;
+  // Replace the nodes by quantized ones.
+  void Compress();
+  // Append the quantized node of \p parent and its subtree.
+  // @param prims the primitive indices ordered as the compressed leaves
+  // @return the index of the node
+  int CompressRecursive(const CompressedChild &parent, std::vector<int> &prims);
+  // Intersect a ray with the two children of a quantized node.
+  // @param tmin the distance to the entry point into each child
+  // @return bit i set if child i is hit closer than \p tmax
+  static int IntersectChildren(const QuantizedNode &node, const Vec3 &origin,
+                               const Vec3 &inv_dir, const int dir_is_neg[3],
+                               Real tmax, Real tmin[2]);
+  // The traversals of the compressed and wide layouts take the leaf
+  // callbacks of IntersectLeaves() and OccludedLeaves().
+  template <typename F>
+  bool IntersectCompressed(Ray &ray, F intersect) const;
+  template <typename F>
+  bool OccludedCompressed(const Ray &ray, F occluded) const;
+  // Replace the nodes by wide ones, each taking the place of the binary
+  // nodes with the largest area below it.
+  template <int N>
+  void Collapse(std::vector<WideNode<N>> &wide_nodes);
+  // @return the index of the wide node of \p node
+  template <int N>
+  int CollapseRecursive(int node, std::vector<WideNode<N>> &wide_nodes);
+  // Intersect a ray with the children of a wide node.
+  // @param tmin the distance to the entry point into each child
+  // @return bit i set if child i is hit closer than \p tmax
+  template <int N>
+  static int IntersectChildren(const WideNode<N> &node, const WideRay<N> &ray,
+                               Real tmax, float tmin[N]);
+  template <int N, typename F>
+  bool IntersectWide(const std::vector<WideNode<N>> &nodes, Ray &ray,
+                     F intersect) const;
+  template <int N, typename F>
+  bool OccludedWide(const std::vector<WideNode<N>> &nodes, const Ray &ray,
+                    F occluded) const;
+  // Hand over the cells of the grid a ray crosses in order to \p visit, a
+  // function bool(int begin, int end) that can shorten the ray.
+  // @return true if \p visit returned true, which stops the walk
+  template <typename F>
+  bool WalkGrid(const Ray &ray, F visit) const;
+  // Compute what refitting needs: the parents of the nodes, the leaves
+  // referencing each primitive and the SAH cost of every subtree.
+  void PrepareRefit(int num_prims);
+  // Recompute the bounds and the cost of a node from its children or its
+  // primitives.
+  void RefitNode(int node, const std::vector<Bounds3> &prim_bounds);
+  // Rebuild the subtree rooted at \p node from scratch over the same
+  // primitives.
+  void RebuildSubtree(int node, const std::vector<Bounds3> &prim_bounds);
+  std::vector<Node> nodes_;
+  // replace nodes_ if the hierarchy is compressed or wide
+  std::vector<QuantizedNode> quantized_nodes_;
+  std::vector<WideNode<4>> wide4_nodes_;
+  std::vector<WideNode<8>> wide8_nodes_;
+  // replaces the nodes if BvhOptions::grid_levels is set. root_bounds_ is
+  // split in grid_resolution_[axis] blocks of grid_cell_size_[axis] along
+  // each axis, each one split in cells in turn unless the grid is uniform and
+  // grid_blocks_ empty. The primitives of cell c are prim_indices_[i] for i
+  // in [grid_cells_[c], grid_cells_[c + 1])
+  int grid_resolution_[3] = {0, 0, 0};
+  Vec3 grid_cell_size_;
+  std::vector<GridBlock> grid_blocks_;
+  std::vector<int> grid_cells_;
+  // the bounds of the root once nodes_ is replaced
+  Bounds3 root_bounds_;
+  std::vector<int> prim_indices_;
+  BvhStats stats_;
+  BvhOptions options_;
+  // only used by Refit() and computed the first time it's called
+  std::vector<int> parents_;
+  // the leaves referencing primitive p are prim_leaves_[i] for i in
+  // [prim_leaf_offsets_[p], prim_leaf_offsets_[p + 1])
+  std::vector<int> prim_leaf_offsets_;
+  std::vector<int> prim_leaves_;
+  // SAH cost of the subtree of each node, not normalized by its area
+  std::vector<Real> costs_;
+  // the cost relative to the area of each node when it was built
+  std::vector<Real> build_quality_;
+};
+
+template <typename F>
+bool Bvh::Intersect(Ray &ray, F intersect) const {
+  return IntersectLeaves(ray, [this, &intersect](int begin, int end, Ray &r) {
+    bool hit = false;
+    for (int i = begin; i < end; ++i) {
+      if (intersect(prim_indices_[i], r)) {
+        hit = true;
+      }
+    }
+    return hit;
+  });
+}
+
+template <typename F>
+bool Bvh::IntersectLeaves(Ray &ray, F intersect) const {
+  if (!grid_cells_.empty()) {
+    bool hit = false;
+    WalkGrid(ray, [&](int begin, int end) {
+      hit = intersect(begin, end, ray) || hit;
+      return false;
+    });
+    return hit;
+  } else if (!quantized_nodes_.empty()) {
+    return IntersectCompressed(ray, intersect);
+  } else if (!wide4_nodes_.empty()) {
+    return IntersectWide(wide4_nodes_, ray, intersect);
+  } else if (!wide8_nodes_.empty()) {
+    return IntersectWide(wide8_nodes_, ray, intersect);
+  }
+  if (nodes_.empty()) {
+    return false;
+  }
+  auto origin = ray.origin();
+  auto dir = ray.direction();
+  Vec3 inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+  int stack[kMaxDepth];
+  int stack_size = 0;
+  int current = 0;
+  bool hit = false;
+  for (;;) {
+    const Node &node = nodes_[current];
+    if (node.bounds.IntersectP(origin, inv_dir, dir_is_neg, ray.tmax())) {
+      if (node.num_prims > 0) {
+        if (intersect(node.offset, node.offset + node.num_prims, ray)) {
+          hit = true;
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+      } else if (dir_is_neg[node.axis]) {
+        // visit the second child first since it's closer to the origin
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    } else {
+      if (stack_size == 0) break;
+      current = stack[--stack_size];
+    }
+  }
+  return hit;
+}
+
+template <typename F>
+void Bvh::Intersect(RayPacket &packet, F intersect) const {
+  // the packets go down the binary nodes, a wide hierarchy keeping them is
+  // traversed with the width it was built for
+  if (nodes_.empty() || !wide4_nodes_.empty() || !wide8_nodes_.empty() ||
+      !packet.coherent()) {
+    for (int i = 0; i < packet.size(); ++i) {
+      Intersect(packet[i], [&intersect, i](int prim, Ray &) {
+        return intersect(prim, 1 << i);
+      });
+    }
+    return;
+  }
+  const int *dir_is_neg = packet.dir_is_neg();
+  // each node is tested from the first ray that hit its parent on
+  int stack[kMaxDepth];
+  int first_stack[kMaxDepth];
+  int stack_size = 0;
+  int current = 0;
+  int first = 0;
+  for (;;) {
+    const Node &node = nodes_[current];
+    if (!packet.IntersectP(first, node.bounds)) {
+      first = packet.FrustumIntersectP(node.bounds) ? first + 1 : packet.size();
+      while (first < packet.size() && !packet.IntersectP(first, node.bounds)) {
+        ++first;
+      }
+    }
+    if (first < packet.size() && node.num_prims > 0) {
+      int rays = 1 << first;
+      for (int i = first + 1; i < packet.size(); ++i) {
+        rays |= packet.IntersectP(i, node.bounds) << i;
+      }
+      for (int i = 0; i < node.num_prims; ++i) {
+        intersect(prim_indices_[node.offset + i], rays);
+      }
+    } else if (first < packet.size()) {
+      // the rays share the signs of their directions so they agree on the
+      // closer child
+      first_stack[stack_size] = first;
+      if (dir_is_neg[node.axis]) {
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+      continue;
+    }
+    if (stack_size == 0) break;
+    --stack_size;
+    current = stack[stack_size];
+    first = first_stack[stack_size];
+  }
+}
+
+template <typename F>
+bool Bvh::Occluded(const Ray &ray, F occluded) const {
+  return OccludedLeaves(ray, [this, &occluded](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      if (occluded(prim_indices_[i])) {
+        return true;
+      }
+    }
+    return false;
+  });
+}
+
+template <typename F>
+bool Bvh::OccludedLeaves(const Ray &ray, F occluded) const {
+  if (!grid_cells_.empty()) {
+    return WalkGrid(ray, occluded);
+  } else if (!quantized_nodes_.empty()) {
+    return OccludedCompressed(ray, occluded);
+  } else if (!wide4_nodes_.empty()) {
+    return OccludedWide(wide4_nodes_, ray, occluded);
+  } else if (!wide8_nodes_.empty()) {
+    return OccludedWide(wide8_nodes_, ray, occluded);
+  }
+  if (nodes_.empty()) {
+    return false;
+  }
+  auto origin = ray.origin();
+  auto dir = ray.direction();
+  Vec3 inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+  int stack[kMaxDepth];
+  int stack_size = 0;
+  int current = 0;
+  for (;;) {
+    const Node &node = nodes_[current];
+    if (node.bounds.IntersectP(origin, inv_dir, dir_is_neg, ray.tmax())) {
+      if (node.num_prims > 0) {
+        if (occluded(node.offset, node.offset + node.num_prims)) {
+          return true;
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+      } else if (dir_is_neg[node.axis]) {
+        // the closer child is still more likely to block the ray
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    } else {
+      if (stack_size == 0) break;
+      current = stack[--stack_size];
+    }
+  }
+  return false;
+}
+inline int Bvh::IntersectChildren(const QuantizedNode &node,
+                                  const Vec3 &origin, const Vec3 &inv_dir,
+                                  const int dir_is_neg[3], Real tmax,
+                                  Real tmin[2]) {
+  Real t0[2] = {0, 0};
+  Real t1[2] = {tmax, tmax};
+  for (int axis = 0; axis < 3; ++axis) {
+    // the exponents are within the range of normal floats
+    uint32_t bits = static_cast<uint32_t>(node.exponent[axis] + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    Real grid_origin = node.origin[axis] - origin[axis];
+    const uint8_t *near = dir_is_neg[axis] ? node.hi[axis] : node.lo[axis];
+    const uint8_t *far = dir_is_neg[axis] ? node.lo[axis] : node.hi[axis];
+    for (int i = 0; i < 2; ++i) {
+      Real t_near = (grid_origin + near[i] * scale) * inv_dir[axis];
+      Real t_far = (grid_origin + far[i] * scale) * inv_dir[axis];
+      if (t_near > t0[i]) t0[i] = t_near;
+      if (t_far < t1[i]) t1[i] = t_far;
+    }
+  }
+  tmin[0] = t0[0];
+  tmin[1] = t0[1];
+  return (t0[0] <= t1[0]) | (t0[1] <= t1[1]) << 1;
+}
+
+template <typename F>
+bool Bvh::IntersectCompressed(Ray &ray, F intersect) const {
+  auto origin = ray.origin();
+  auto dir = ray.direction();
+  Vec3 inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+  int stack[kMaxDepth];
+  int stack_size = 0;
+  int current = 0;
+  bool hit = false;
+  for (;;) {
+    const QuantizedNode &node = quantized_nodes_[current];
+    Real tmin[2];
+    int hits = IntersectChildren(node, origin, inv_dir, dir_is_neg,
+                                 ray.tmax(), tmin);
+    int num_prims[2] = {node.num_prims & 0xF, node.num_prims >> 4};
+    int next = -1;
+    // visit the closer child first
+    int first = tmin[1] < tmin[0];
+    for (int c : {first, 1 - first}) {
+      if (!(hits >> c & 1) || tmin[c] > ray.tmax()) {
+        continue;
+      }
+      if (num_prims[c] == kInteriorChild) {
+        int child = c == 0 || num_prims[0] != kInteriorChild ? current + 1
+                                                             : node.offset;
+        if (next < 0) {
+          next = child;
+        } else {
+          stack[stack_size++] = child;
+        }
+        continue;
+      }
+      int begin = c == 1 && num_prims[0] != kInteriorChild
+                      ? node.offset + num_prims[0]
+                      : node.offset;
+      if (intersect(begin, begin + num_prims[c], ray)) {
+        hit = true;
+      }
+    }
+    if (next >= 0) {
+      current = next;
+    } else if (stack_size > 0) {
+      current = stack[--stack_size];
+    } else {
+      break;
+    }
+  }
+  return hit;
+}
+
+template <typename F>
+bool Bvh::OccludedCompressed(const Ray &ray, F occluded) const {
+  auto origin = ray.origin();
+  auto dir = ray.direction();
+  Vec3 inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+  int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+  int stack[kMaxDepth];
+  int stack_size = 0;
+  int current = 0;
+  for (;;) {
+    const QuantizedNode &node = quantized_nodes_[current];
+    Real tmin[2];
+    int hits = IntersectChildren(node, origin, inv_dir, dir_is_neg,
+                                 ray.tmax(), tmin);
+    int num_prims[2] = {node.num_prims & 0xF, node.num_prims >> 4};
+    int next = -1;
+    for (int c = 0; c < 2; ++c) {
+      if (!(hits >> c & 1)) {
+        continue;
+      }
+      if (num_prims[c] == kInteriorChild) {
+        int child = c == 0 || num_prims[0] != kInteriorChild ? current + 1
+                                                             : node.offset;
+        if (next < 0) {
+          next = child;
+        } else {
+          stack[stack_size++] = child;
+        }
+        continue;
+      }
+      int begin = c == 1 && num_prims[0] != kInteriorChild
+                      ? node.offset + num_prims[0]
+                      : node.offset;
+      if (occluded(begin, begin + num_prims[c])) {
+        return true;
+      }
+    }
+    if (next >= 0) {
+      current = next;
+    } else if (stack_size > 0) {
+      current = stack[--stack_size];
+    } else {
+      break;
+    }
+  }
+  return false;
+}
+template <int N>
+Bvh::WideRay<N>::WideRay(const Ray &ray) {
+  for (int axis = 0; axis < 3; ++axis) {
+    Real inv = 1 / ray.direction()[axis];
+    dir_is_neg[axis] = inv < 0;
+    origin[axis] = SimdFloat<N>(ray.origin()[axis]);
+    inv_dir[axis] = SimdFloat<N>(inv);
+  }
+}
+
+template <int N>
+int Bvh::IntersectChildren(const WideNode<N> &node, const WideRay<N> &ray,
+                           Real tmax, float tmin[N]) {
+  // the distances are computed in single precision, the far ones are moved
+  // by a few ulps so rays grazing a box still hit it
+  SimdFloat<N> t0(0.0f);
+  SimdFloat<N> t1(static_cast<float>(tmax * (1 + 1E-6)));
+  for (int axis = 0; axis < 3; ++axis) {
+    const float *near = ray.dir_is_neg[axis] ? node.max[axis] : node.min[axis];
+    const float *far = ray.dir_is_neg[axis] ? node.min[axis] : node.max[axis];
+    auto t_near =
+        (SimdFloat<N>::Load(near) - ray.origin[axis]) * ray.inv_dir[axis];
+    auto t_far =
+        (SimdFloat<N>::Load(far) - ray.origin[axis]) * ray.inv_dir[axis];
+    // NaNs, from a ray in the plane of a face, leave the distances as they are
+    t0 = Max(t_near, t0);
+    t1 = Min(t_far * SimdFloat<N>(1 + 4E-7f), t1);
+  }
+  t0.Store(tmin);
+  return LessEqual(t0, t1);
+}
+
+template <int N, typename F>
+bool Bvh::IntersectWide(const std::vector<WideNode<N>> &nodes, Ray &ray,
+                        F intersect) const {
+  WideRay<N> wide_ray(ray);
+  WideStackEntry stack[(N - 1) * kMaxDepth + 1];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, 0};
+  bool hit = false;
+  while (stack_size > 0) {
+    auto entry = stack[--stack_size];
+    if (entry.tmin > ray.tmax()) {
+      continue;
+    }
+    if (entry.num_prims > 0) {
+      if (intersect(entry.offset, entry.offset + entry.num_prims, ray)) {
+        hit = true;
+      }
+      continue;
+    }
+    const WideNode<N> &node = nodes[entry.offset];
+    float tmin[N];
+    int hits = IntersectChildren(node, wide_ray, ray.tmax(), tmin);
+    // push the children hit from the farthest to the closest so the closest
+    // one is visited next
+    int first = stack_size;
+    for (int i = 0; i < N; ++i) {
+      if (!(hits >> i & 1)) {
+        continue;
+      }
+      WideStackEntry child{node.offset[i], node.num_prims[i], tmin[i]};
+      int j = stack_size++;
+      for (; j > first && stack[j - 1].tmin < child.tmin; --j) {
+        stack[j] = stack[j - 1];
+      }
+      stack[j] = child;
+    }
+  }
+  return hit;
+}
+
+template <int N, typename F>
+bool Bvh::OccludedWide(const std::vector<WideNode<N>> &nodes, const Ray &ray,
+                       F occluded) const {
+  WideRay<N> wide_ray(ray);
+  int stack[(N - 1) * kMaxDepth + 1];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0) {
+    const WideNode<N> &node = nodes[stack[--stack_size]];
+    float tmin[N];
+    int hits = IntersectChildren(node, wide_ray, ray.tmax(), tmin);
+    for (int i = 0; i < N; ++i) {
+      if (!(hits >> i & 1)) {
+        continue;
+      }
+      if (node.num_prims[i] == 0) {
+        stack[stack_size++] = node.offset[i];
+        continue;
+      }
+      if (occluded(node.offset[i], node.offset[i] + node.num_prims[i])) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+inline bool Bvh::GridWalk::Next(Real tmax) {
+  int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                               : (next[1] < next[2] ? 1 : 2);
+  if (next[axis] > tmax) {
+    return false;
+  }
+  coords[axis] += step[axis];
+  if (coords[axis] == end[axis]) {
+    return false;
+  }
+  cell += stride[axis];
+  t = next[axis];
+  next[axis] += delta[axis];
+  return true;
+}
+
+template <typename F>
+bool Bvh::WalkGrid(const Ray &ray, F visit) const {
+  // clip the ray to the grid, the comparisons skip the NaNs of a direction
+  // parallel to a face
+  const auto &origin = ray.origin();
+  const auto &dir = ray.direction();
+  Vec3 inv_dir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+  Real t0 = 0;
+  Real t1 = ray.tmax();
+  for (int axis = 0; axis < 3; ++axis) {
+    Real t_near = (root_bounds_.min[axis] - origin[axis]) * inv_dir[axis];
+    Real t_far = (root_bounds_.max[axis] - origin[axis]) * inv_dir[axis];
+    if (t_near > t_far) {
+      std::swap(t_near, t_far);
+    }
+    t0 = t_near > t0 ? t_near : t0;
+    t1 = t_far < t1 ? t_far : t1;
+    if (t0 > t1) {
+      return false;
+    }
+  }
+  // a primitive hit in a cell can be farther than the cell, so the walks
+  // only stop once the next cell starts past the closest hit
+  GridWalk walk(ray, inv_dir, t0, root_bounds_.min, grid_resolution_,
+                grid_cell_size_);
+  do {
+    int first = walk.cell;
+    const int *resolution = nullptr;
+    if (!grid_blocks_.empty()) {
+      first = grid_blocks_[walk.cell].first;
+      resolution = grid_blocks_[walk.cell].resolution;
+    }
+    if (!resolution || resolution[0] * resolution[1] * resolution[2] == 1) {
+      int begin = grid_cells_[first];
+      int end = grid_cells_[first + 1];
+      if (begin < end && visit(begin, end)) {
+        return true;
+      }
+      continue;
+    }
+    Vec3 block_origin;
+    Vec3 cell_size;
+    for (int axis = 0; axis < 3; ++axis) {
+      block_origin[axis] = root_bounds_.min[axis] +
+                           walk.coords[axis] * grid_cell_size_[axis];
+      cell_size[axis] = grid_cell_size_[axis] / resolution[axis];
+    }
+    GridWalk block_walk(ray, inv_dir, walk.t, block_origin, resolution,
+                        cell_size);
+    do {
+      int begin = grid_cells_[first + block_walk.cell];
+      int end = grid_cells_[first + block_walk.cell + 1];
+      if (begin < end && visit(begin, end)) {
+        return true;
+      }
+    } while (block_walk.Next(ray.tmax()));
+  } while (walk.Next(ray.tmax()));
+  return false;
+}
+}  // namespace ren
+#endif  // REN_BVH_H_
@@ -9,12 +9,23 @@ class Disk : public Shape {
   Disk(const Mat4 &local_to_world, Real radius);
   virtual bool Intersect(const Ray &ray, Real &t,
                          SurfaceDiff &surface_diff) override;
+  virtual bool Occluded(const Ray &ray) const override;
   virtual SurfaceDiff SamplePoint(Real &pdf) override;
   virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
   Real Pdf() const;
 
  private:
+  // Compute the center and the frame of the disk from its transform.
+  void UpdateTransform();
   Real radius_;
+  Real radius2_;
+  Vec3 origin_;
+  // the axes of the transform, the disk lies on the plane of x_ and z_
+  Vec3 x_;
+  Vec3 normal_;
+  Vec3 z_;
 };
 }  // namespace ren
 #endif  // REN_DISK_H_
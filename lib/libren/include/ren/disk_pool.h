@@ -0,0 +1,69 @@
+#ifndef REN_DISK_POOL_H_
+#define REN_DISK_POOL_H_
+#include <cstddef>
+#include <vector>
+#include "ren/bvh.h"
+#include "ren/shape.h"
+#include "ren/vec.h"
+namespace ren {
+struct LaneRay;
+// Many disks sharing a material stored as one shape with a hierarchy of its
+// own. Like SpherePool, the disks of a leaf are tested several at a time in
+// single precision and the candidates again in double precision.
+class DiskPool : public Shape {
+ public:
+  // @param local_to_world the transform of the pool
+  // @param centers the center of each disk
+  // @param normals the normal of the plane of each disk, not necessarily
+  // normalized
+  // @param radii the radius of each disk
+  // @param options the settings used to build the hierarchy, never a grid
+  DiskPool(const Mat4 &local_to_world, const std::vector<Vec3> &centers,
+           const std::vector<Vec3> &normals, const std::vector<Real> &radii,
+           const BvhOptions &options = DefaultBvhOptions());
+  virtual bool Intersect(const Ray &ray, Real &t,
+                         SurfaceDiff &surface_diff) override;
+  virtual bool Occluded(const Ray &ray) const override;
+  // Sample a point uniformly over the area of the disks. The density is only
+  // uniform if the transform doesn't scale some axes more than others.
+  virtual SurfaceDiff SamplePoint(Real &pdf) override;
+  virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
+  int size() const;
+  const BvhStats &bvh_stats() const;
+
+ private:
+  // Compute what depends on the transform: the area and the bounds.
+  void UpdateTransform();
+  // Test a ray against the disks [begin, begin + kSimdLanes). The test is
+  // conservative: it may report a disk the ray misses, never the opposite.
+  // @return bit i set if disk begin + i may be hit closer than \p tmax
+  int IntersectLanes(const LaneRay &ray, int begin, Real tmax) const;
+  // @param t the distance to the hit of \p ray with disk \p i
+  // @return true if the hit is closer than the tmax of \p ray
+  bool Intersect(const Ray &ray, int i, Real &t) const;
+  // @param i the index of a disk
+  // @param p a point of the disk in the local space of the pool
+  // @param p_error bound on the absolute error of each coordinate of \p p
+  SurfaceDiff GetSurfaceDiff(int i, const Vec3 &p, const Vec3 &p_error) const;
+  // the disks in the local space of the pool, ordered like the leaves of the
+  // hierarchy
+  std::vector<Vec3> centers_;
+  std::vector<Vec3> normals_;
+  std::vector<Real> radii_;
+  // the disks as structure of arrays in single precision, padded with a
+  // register of empty disks
+  std::vector<float> lane_centers_[3];
+  std::vector<float> lane_normals_[3];
+  std::vector<float> lane_radii_;
+  // the cumulative areas of the disks, to sample them
+  std::vector<Real> cdf_;
+  Bvh bvh_;
+  // rays aren't transformed if the pool has the identity transform
+  bool identity_;
+  Real area_;
+  Bounds3 world_bound_;
+};
+}  // namespace ren
+#endif  // REN_DISK_POOL_H_
@@ -0,0 +1,77 @@
+#ifndef REN_LANES_H_
+#define REN_LANES_H_
+#include <cmath>
+#include "ren/bounds.h"
+#include "ren/mat.h"
+#include "ren/ray.h"
+#include "ren/simd.h"
+#include "ren/typedefs.h"
+#include "ren/vec.h"
+// Helpers shared by the shapes that hold their primitives in their local
+// space and test them several at a time in single precision. Internal to the
+// library.
+namespace ren {
+typedef SimdFloat<kSimdLanes> Lanes;
+
+// bound on the relative rounding error of the single precision tests, with
+// ample room for the few operations chained
+const float kLaneEpsilon = 1E-5f;
+
+// @return the sum of the magnitudes of the coordinates of \p v
+inline Real L1Norm(const Vec3 &v) {
+  return std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+}
+
+// A ray broadcast to every lane, along with the magnitudes of its origin and
+// direction that bound the rounding errors of the tests.
+struct LaneRay {
+  explicit LaneRay(const Ray &ray) {
+    for (int axis = 0; axis < 3; ++axis) {
+      origin[axis] = Lanes(ray.origin()[axis]);
+      dir[axis] = Lanes(ray.direction()[axis]);
+    }
+    origin_norm = Lanes(L1Norm(ray.origin()));
+    dir_norm = Lanes(L1Norm(ray.direction()));
+  }
+  Lanes origin[3];
+  Lanes dir[3];
+  Lanes origin_norm;
+  Lanes dir_norm;
+};
+
+// @return true if \p m is exactly the identity, in which case the shapes
+// skip transforming the rays
+inline bool IsIdentity(const Mat4 &m) {
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      if (m[i][j] != (i == j ? 1 : 0)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// @return the magnitude of the determinant of the linear part of \p m. Under
+// rotations, translations and uniform scales, areas scale with it to the
+// power of 2/3 and lengths to the power of 1/3
+inline Real LinearDeterminant(const Mat4 &m) {
+  Vec3 x = m[0];
+  Vec3 y = m[1];
+  Vec3 z = m[2];
+  return std::abs(Dot(x, Cross(y, z)));
+}
+
+// @return the bounds of the corners of \p bounds transformed by \p m
+inline Bounds3 TransformBounds(const Mat4 &m, const Bounds3 &bounds) {
+  Bounds3 result;
+  for (int i = 0; i < 8; ++i) {
+    Vec3 corner((i & 1 ? bounds.max : bounds.min).x,
+                (i & 2 ? bounds.max : bounds.min).y,
+                (i & 4 ? bounds.max : bounds.min).z);
+    result.Expand(Vec3(m * Vec4(corner, 1)));
+  }
+  return result;
+}
+}  // namespace ren
+#endif  // REN_LANES_H_
@@ -29,6 +29,7 @@ class Light {
   virtual Vec3 SampleLe(SurfaceDiff &point, Vec3 &dir, Real &pdf_point,
                         Real &pdf_dir) = 0;
   virtual Vec3 power();
+  virtual ~Light() = default;
 
  protected:
   Mat4 local_to_world_;
@@ -24,6 +24,24 @@ class Object {
   // intersction point
   // @return true if the ray \p ray intersected with this shape, false otherwise
   bool Intersect(const Ray &ray, Real &t, SurfaceDiff &surface_diff);
+  // Test for intersection with some rays of a packet.
+  // @param packet the rays to test with. The tmax of the rays hitting the
+  // object is set to the distance to the hit
+  // @param rays bit i is set if ray i of \p packet should be tested
+  // @param surface_diffs the geometric and material information about the
+  // intersection point of each ray hitting the object
+  // @return bit i set if ray i hit the object
+  int Intersect(RayPacket &packet, int rays, SurfaceDiff surface_diffs[]);
+  // Test if a ray hits the object at all.
+  // @param ray the ray to test with
+  // @return true if \p ray hits this object closer than its tmax
+  bool Occluded(const Ray &ray) const;
+  // @return the bounding box of the object in world space coordinates
+  Bounds3 WorldBound() const;
+  // Move the object.
+  // @param local_to_world the new transform of its shape
+  void set_local_to_world(const Mat4 &local_to_world);
+  const Shape &shape() const;
   const Bsdf &bsdf() const;
   const AreaLight *area_light() const;
 
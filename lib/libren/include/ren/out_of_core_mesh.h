@@ -0,0 +1,138 @@
+#ifndef REN_OUT_OF_CORE_MESH_H_
+#define REN_OUT_OF_CORE_MESH_H_
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ren/bvh.h"
+#include "ren/shape.h"
+#include "ren/triangle.h"
+#include "ren/vec.h"
+namespace ren {
+// Counters of the clusters requested by the rays traced against an
+// OutOfCoreMesh.
+struct OutOfCoreStats {
+  // the number of times a ray needed the triangles of a cluster
+  long long requests = 0;
+  // the requests served by a resident cluster
+  long long hits = 0;
+  // the requests that had to page a cluster in from the file
+  long long faults = 0;
+  // the clusters dropped to stay within the budget
+  long long evictions = 0;
+  // the bytes used by the resident clusters, now and at the most
+  std::size_t resident_bytes = 0;
+  std::size_t peak_resident_bytes = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, const OutOfCoreStats &stats);
+
+// Triangle mesh that doesn't need to fit in memory. Write() splits the mesh
+// into spatial clusters of triangles and stores each one along with its
+// hierarchy in a file. The file is memory mapped and only a hierarchy over
+// the bounds of the clusters is kept in memory: a cluster is paged in the
+// first time a ray reaches it, and the least recently used clusters are
+// dropped once the resident ones take more than a budget of bytes.
+class OutOfCoreMesh : public Shape {
+ public:
+  // the default number of triangles of a cluster
+  static const int kDefaultClusterSize = 1 << 12;
+  // Split a mesh into clusters and write them to a file.
+  // @param path the file to write
+  // @param vertices the vertices of the mesh
+  // @param indices every three indices to \p vertices form a triangle
+  // @param cluster_size the maximum number of triangles of a cluster
+  // @param options the settings used to build the hierarchy of each cluster
+  static void Write(const std::string &path, const std::vector<Vec3> &vertices,
+                    const std::vector<int> &indices,
+                    int cluster_size = kDefaultClusterSize,
+                    const BvhOptions &options = DefaultBvhOptions());
+  // Map a file written by Write(). Throws std::runtime_error if the file
+  // can't be read, or was written by a build with a different Real.
+  // @param local_to_world the transform of the mesh
+  // @param path the file of the mesh
+  // @param budget the bytes the resident clusters can take. The cluster a ray
+  // needs is paged in even if it alone exceeds the budget
+  OutOfCoreMesh(const Mat4 &local_to_world, const std::string &path,
+                std::size_t budget);
+  virtual ~OutOfCoreMesh();
+  virtual bool Intersect(const Ray &ray, Real &t,
+                         SurfaceDiff &surface_diff) override;
+  virtual bool Occluded(const Ray &ray) const override;
+  // Sample a point of the mesh, paging in the cluster it belongs to. The
+  // density is uniform under the same conditions as TriangleMesh.
+  virtual SurfaceDiff SamplePoint(Real &pdf) override;
+  virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
+  int num_clusters() const;
+  // @return the bytes all the clusters would take if they were resident
+  std::size_t total_bytes() const;
+  OutOfCoreStats stats() const;
+  // Set the counters back to 0, except the resident bytes.
+  void ResetStats();
+
+ private:
+  // A cluster as described by the directory of the file, and its triangles
+  // once paged in.
+  struct Cluster {
+    Bounds3 bounds;
+    // the block of the file holding the triangles and their hierarchy
+    std::size_t offset;
+    std::size_t size;
+    int num_vertices;
+    int num_triangles;
+    // the bytes the cluster takes once paged in
+    std::size_t bytes;
+    Real area;
+    // null unless the cluster is resident, read and written with the
+    // atomic functions of shared_ptr
+    std::shared_ptr<const TriangleMeshData> data;
+  };
+  // Compute what depends on the transform: the area and the bounds.
+  void UpdateTransform();
+  // @return the triangles of a cluster, paged in if needed. Holding the
+  // result keeps them alive even if the cluster is evicted meanwhile.
+  std::shared_ptr<const TriangleMeshData> Acquire(int cluster) const;
+  // Read the block of a cluster from the mapping and release its pages.
+  std::shared_ptr<const TriangleMeshData> Read(const Cluster &cluster) const;
+  // Fill the shading frame of a point of a triangle of a cluster.
+  // @param p the point in the local space of the mesh
+  // @param p_error bound on the absolute error of each coordinate of \p p
+  void SetSurfaceDiff(const TriangleMeshData &data, int triangle,
+                      const Vec3 &p, const Vec3 &p_error,
+                      SurfaceDiff &surface_diff) const;
+  int fd_;
+  const char *map_;
+  std::size_t map_size_;
+  // the resident clusters change while tracing, hence mutable. A resident
+  // cluster is served without locking, mutex_ guards paging clusters in
+  // and out, along with resident_ and stats_
+  mutable std::vector<Cluster> clusters_;
+  // the resident clusters
+  mutable std::vector<int> resident_;
+  // the faults so far, and the value it had when each cluster was last
+  // used, which orders the clusters from the least recently used
+  mutable std::atomic<long long> clock_;
+  std::unique_ptr<std::atomic<long long>[]> last_use_;
+  // the requests and hits, counted outside of the lock
+  mutable std::atomic<long long> requests_;
+  mutable std::atomic<long long> hits_;
+  mutable OutOfCoreStats stats_;
+  mutable std::mutex mutex_;
+  std::size_t budget_;
+  std::size_t total_bytes_;
+  // hierarchy over the bounds of the clusters
+  Bvh bvh_;
+  // the cumulative areas of the clusters, to sample them
+  std::vector<Real> cdf_;
+  // rays aren't transformed if the mesh has the identity transform
+  bool identity_;
+  Real area_;
+  Bounds3 world_bound_;
+};
+}  // namespace ren
+#endif  // REN_OUT_OF_CORE_MESH_H_
@@ -11,8 +11,12 @@ class PathTracer : public Renderer {
   virtual void Render() override;
 
  private:
-  void RenderRange(int min_y, int max_y);
-  Vec3 Li(int i, int j);
+  void RenderTile(const Tile &tile);
+  // @param first_sample the index of the first of the samples, which picks
+  // their random numbers
+  // @param samples the number of samples of the pixel (\p i, \p j)
+  // @return the average radiance of their camera rays
+  Vec3 Li(int i, int j, int first_sample, int samples);
   Scene *scene_;
   PinholeCamera *camera_;
   int spp_;
@@ -1,51 +1,121 @@
 #ifndef REN_PHOTONMAP_H_
 #define REN_PHOTONMAP_H_
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <queue>
 #include <vector>
+#include "ren/simd.h"
+#include "ren/thread_pool.h"
 #include "ren/typedefs.h"
 #include "ren/vec.h"
 namespace ren {
-// Small structure representing a photon.
+// Small structure representing a photon, compressed to 8 bytes: the power
+// as 8 bit mantissas sharing an exponent (RGBE) and the direction mapped to
+// the octahedron and quantized to 16 bits per coordinate. The position is
+// kept apart by the PhotonMap, which needs it by axis.
 struct Photon {
-  Vec3 pos;
-  Vec3 power;
-  Vec3 dir;
-  Photon(const Vec3 &position, const Vec3 &weight, const Vec3 &direction)
-      : pos(position), power(weight), dir(direction) {}
-  Photon() : pos(0), power(0), dir(0) {}
+  // red, green and blue mantissas and the biased exponent, from the lowest
+  // byte up
+  uint32_t rgbe;
+  uint16_t octahedral_dir[2];
+  Photon(const Vec3 &weight, const Vec3 &direction);
+  Photon() : rgbe(0), octahedral_dir{0, 0} {}
+  // @return the power, within 0.4% of the largest component
+  Vec3 power() const;
+  // @return the direction, a unit vector within 1E-4 radians of the one
+  // stored
+  Vec3 dir() const;
 };
 
-// Generic kd-tree.
+// Generic kd-tree over elements at given positions, which the tree searches
+// in single precision. The positions are only stored by axis, apart from the
+// elements.
 template <typename Data>
 class KdTree {
  public:
-  // The result of a query operation.
+  // An element found by a query, by its index in the tree.
   struct QueryResult {
-    Data data;
+    int index;
     Real distance2;
-    bool operator<(const KdTree::QueryResult &rhs) {
+    bool operator<(const QueryResult &rhs) const {
       return distance2 < rhs.distance2;
-    };
-    bool operator>(const KdTree::QueryResult &rhs) {
+    }
+    bool operator>(const QueryResult &rhs) const {
       return distance2 > rhs.distance2;
     }
-    QueryResult() : data(), distance2(0) {}
-    QueryResult(const Data &data_res, Real distance2_res)
-        : data(data_res), distance2(distance2_res) {}
+    QueryResult() : index(0), distance2(0) {}
+    QueryResult(int index_res, Real distance2_res)
+        : index(index_res), distance2(distance2_res) {}
   };
+  // the most elements in a leaf
+  static const int kMaxLeafSize = 16;
 
-  KdTree(const std::vector<Data> &data)
-      : nodes_(data.size()), data_(data.size()), next_node_(1) {
-    std::vector<const Data *> data_ptrs;
-    data_ptrs.reserve(data.size());
-    for (int i = 0; i < data.size(); ++i) {
-      data_ptrs.push_back(&data[i]);
-    }
-    Balance(0, data.size(), 0, &data_ptrs[0]);
+  // Build the tree over \p data, which it takes ownership of and reorders in
+  // place along with the positions. Every node splits the range of its
+  // elements in two halves at the median along the longest axis of their
+  // bounds, down to leaves of at most kMaxLeafSize elements, all at the same
+  // depth. The nodes are numbered like a binary heap, so the tree stores only
+  // the split of each node. The nodes near the root are split a level at a
+  // time, spread over the threads of \p pool, then the subtrees below them
+  // are built by whichever thread is free.
+  // @param positions the position of each element of \p data, moved in and
+  // released once stored by axis
+  // @param data the elements, moved in to avoid a copy
+  // @param pool the threads building the tree, which must not be one of them
+  KdTree(std::vector<Vec3f> positions, std::vector<Data> data,
+         ThreadPool &pool = DefaultThreadPool())
+      : data_(std::move(data)) {
+    int depth = 0;
+    while ((data_.size() + (std::size_t(1) << depth) - 1) >> depth >
+           kMaxLeafSize) {
+      ++depth;
+    }
+    nodes_.resize((std::size_t(1) << depth) - 1);
+    // the positions of the leaves are tested kSimdLanes at a time, the padding
+    // is masked out
+    Vec3 min(std::numeric_limits<Real>::max());
+    Vec3 max(std::numeric_limits<Real>::lowest());
+    for (int dim = 0; dim < 3; ++dim) {
+      lane_pos_[dim].assign(data_.size() + kSimdLanes, 0);
+      for (int i = 0; i < data_.size(); ++i) {
+        lane_pos_[dim][i] = positions[i][dim];
+        min[dim] = std::min(min[dim], Real(positions[i][dim]));
+        max[dim] = std::max(max[dim], Real(positions[i][dim]));
+      }
+    }
+    positions = std::vector<Vec3f>();
+    std::vector<Range> level(1, Range{0, int(data_.size()), min, max});
+    // the index of the first node of the level
+    int first = 0;
+    // call balance(i) on the nodes of the level spread over the threads
+    auto run = [&](const std::function<void(int i)> &balance) {
+      std::atomic<int> next_node{0};
+      pool.Run([&](int) {
+        for (int i; (i = next_node++) < level.size();) {
+          balance(i);
+        }
+      });
+    };
+    while (level.size() < pool.num_threads() && first < nodes_.size() &&
+           level[0].end - level[0].begin >= kMinParallelSize) {
+      std::vector<Range> children(2 * level.size());
+      run([&](int i) {
+        Split(first + i, level[i], children[2 * i], children[2 * i + 1]);
+      });
+      level.swap(children);
+      first = 2 * first + 1;
+    }
+    if (level.size() == 1) {
+      Balance(first, level[0]);
+    } else {
+      run([&](int i) { Balance(first + i, level[i]); });
+    }
   }
   // Query the \p n nearest elements closest to \p p.
   // @param p the point we are interested in. The returned point should be
@@ -54,114 +124,309 @@ class KdTree {
   // heap, i.e., the first element of has the largest distance to \p p squaed.
   void QueryNearest(const Vec3 &p, int n,
                     std::vector<QueryResult> &results) const {
-    results.clear();
-    Real r2 = std::numeric_limits<Real>::max();
-    QueryRecursive(p, n, r2, results, 0);
+    float query[3] = {float(p.x), float(p.y), float(p.z)};
+    Query(query, n, std::numeric_limits<float>::max(), results);
+  }
+  // Query the \p n nearest elements of each of several points. The points
+  // are queried in the order of a Morton curve through their bounds, so
+  // that consecutive queries walk the same paths of the tree while they are
+  // in the cache, and the neighbours found for a point bound the search
+  // radius of the next one from the start.
+  // @param points the points we are interested in
+  // @param results the results of each point, in the same order, each one a
+  // max heap like the results of a single query. Reusing the vector across
+  // calls saves allocating the heaps
+  void QueryNearest(const std::vector<Vec3> &points, int n,
+                    std::vector<std::vector<QueryResult>> &results) const {
+    results.resize(points.size());
+    Vec3 min(std::numeric_limits<Real>::max());
+    Vec3 max(std::numeric_limits<Real>::lowest());
+    for (const auto &p : points) {
+      for (int dim = 0; dim < 3; ++dim) {
+        min[dim] = std::min(min[dim], p[dim]);
+        max[dim] = std::max(max[dim], p[dim]);
+      }
+    }
+    std::vector<std::pair<uint32_t, int>> order;
+    order.reserve(points.size());
+    for (int i = 0; i < points.size(); ++i) {
+      uint32_t cell[3];
+      for (int dim = 0; dim < 3; ++dim) {
+        Real extent = max[dim] - min[dim];
+        cell[dim] = extent > 0 ? (points[i][dim] - min[dim]) / extent * 1023
+                               : 0;
+      }
+      order.emplace_back(MortonIndex(cell), i);
+    }
+    std::sort(order.begin(), order.end());
+    const std::vector<QueryResult> *previous = nullptr;
+    for (const auto &keyed_point : order) {
+      const auto &p = points[keyed_point.second];
+      float query[3] = {float(p.x), float(p.y), float(p.z)};
+      float r2 = std::numeric_limits<float>::max();
+      if (previous && previous->size() == n) {
+        // the n neighbours of the previous point are as many candidates,
+        // so the farthest of them bounds the distance of the n-th nearest.
+        // Widened for rounding, since the results must be strictly closer
+        float bound = 0;
+        for (const auto &result : *previous) {
+          float distance2 = 0;
+          for (int dim = 0; dim < 3; ++dim) {
+            float d = lane_pos_[dim][result.index] - query[dim];
+            distance2 += d * d;
+          }
+          bound = std::max(bound, distance2);
+        }
+        r2 = bound * (1 + 1E-5f) + std::numeric_limits<float>::min();
+      }
+      auto &point_results = results[keyed_point.second];
+      Query(query, n, r2, point_results);
+      previous = &point_results;
+    }
+  }
+  // @return the element at \p index, like the index of a QueryResult
+  const Data &operator[](int index) const { return data_[index]; }
+  // @return the position of the element at \p index
+  Vec3 position(int index) const {
+    return Vec3(lane_pos_[0][index], lane_pos_[1][index],
+                lane_pos_[2][index]);
+  }
+  int size() const { return data_.size(); }
+  // @return the bytes taken by the elements and the tree
+  std::size_t MemoryUsage() const {
+    return data_.capacity() * sizeof(Data) +
+           nodes_.capacity() * sizeof(Node) +
+           3 * lane_pos_[0].capacity() * sizeof(float);
   }
 
  private:
+  typedef SimdFloat<kSimdLanes> Lanes;
+  // the levels whose ranges are smaller than this are built by one thread
+  // per subtree rather than a level at a time
+  static const int kMinParallelSize = 1 << 14;
+
+  // The elements of a node, and their bounds: the bounds of the parent cut
+  // by its split.
+  struct Range {
+    int begin;
+    int end;
+    Vec3 min;
+    Vec3 max;
+  };
+
+  // The split of a node: the elements of its first child are at most at
+  // \c split along the axis \c dim, the elements of the second at least.
   struct Node {
-    Real pos;
-    unsigned int dim : 2;
-    unsigned int has_left_child : 1;
-    unsigned int right_child : 29;
-    Node() : dim(3), right_child((1 << 29) - 1), has_left_child(0) {}
-    Node(Real position, int dimension)
-        : pos(position),
-          dim(dimension),
-          right_child((1 << 29) - 1),
-          has_left_child(0) {}
+    float split;
+    int dim;
   };
 
-  void Balance(int begin, int end, int node, const Data **data_ptrs) {
-    if (begin + 1 == end) {
-      nodes_[node] = Node();
-      data_[node] = *data_ptrs[begin];
+  static void Prefetch(const void *address) {
+#if defined(__GNUC__)
+    __builtin_prefetch(address);
+#endif
+  }
+
+  // Split the elements of a node, and the two halves recursively, down to
+  // the leaves.
+  void Balance(int node, const Range &range) {
+    if (node >= nodes_.size()) {
       return;
     }
+    Range left;
+    Range right;
+    Split(node, range, left, right);
+    Balance(2 * node + 1, left);
+    Balance(2 * node + 2, right);
+  }
+  // Split the elements of \p node at their middle element along the longest
+  // axis of their bounds.
+  // @param left the elements of the first child and their bounds
+  // @param right the elements of the second child and their bounds
+  void Split(int node, const Range &range, Range &left, Range &right) {
+    auto extent = range.max - range.min;
+    int dim = extent.x >= extent.y && extent.x >= extent.z ? 0
+              : extent.y >= extent.z                       ? 1
+                                                           : 2;
+    int m = (range.begin + range.end) / 2;
+    Select(dim, range.begin, m, range.end);
+    float split = lane_pos_[dim][m];
+    nodes_[node].split = split;
+    nodes_[node].dim = dim;
+    left = Range{range.begin, m, range.min, range.max};
+    right = Range{m, range.end, range.min, range.max};
+    left.max[dim] = split;
+    right.min[dim] = split;
+  }
 
-    Vec3 min(std::numeric_limits<Real>::max());
-    Vec3 max(std::numeric_limits<Real>::min());
-    // calculate extent of the bounding  box
-    {
-      for (int i = begin; i < end; ++i) {
-        for (int dim = 0; dim < 3; ++dim) {
-          auto value_dim = data_ptrs[i]->pos[dim];
-          if (value_dim < min[dim]) min[dim] = value_dim;
-          if (value_dim > max[dim]) max[dim] = value_dim;
+  // Reorder the range [begin, end) so that the element at \p m is the one
+  // that would be there if the range was sorted along \p dim, the elements
+  // before it being at most at its coordinate and the ones after at least.
+  // Like std::nth_element, but moving the elements and their positions
+  // together: quickselect with a median of three pivot and Hoare's
+  // partition, which splits runs of equal coordinates evenly.
+  void Select(int dim, int begin, int m, int end) {
+    const auto &key = lane_pos_[dim];
+    while (end - begin > 1) {
+      int mid = begin + (end - begin) / 2;
+      // sort the first, middle and last elements, and use the median as the
+      // pivot from the front of the range
+      if (key[mid] < key[begin]) Swap(mid, begin);
+      if (key[end - 1] < key[begin]) Swap(end - 1, begin);
+      if (key[end - 1] < key[mid]) Swap(end - 1, mid);
+      Swap(begin, mid);
+      float pivot = key[begin];
+      int i = begin - 1;
+      int j = end;
+      for (;;) {
+        do {
+          ++i;
+        } while (key[i] < pivot);
+        do {
+          --j;
+        } while (pivot < key[j]);
+        if (i >= j) {
+          break;
         }
+        Swap(i, j);
       }
-    }
-
-    int dim = 0;
-    // calculate the dimension of the bounding box having maximum extent
-    {
-      Real distance = std::numeric_limits<Real>::min();
-      for (int i = 0; i < 3; ++i) {
-        Real tmp_distance = std::abs(max[i] - min[i]);
-        if (tmp_distance > distance) {
-          distance = tmp_distance;
-          dim = i;
-        }
+      // [begin, j] is at most at the pivot and (j, end) at least
+      if (m <= j) {
+        end = j + 1;
+      } else {
+        begin = j + 1;
       }
     }
-    int m = (begin + end) / 2;
-    std::nth_element(
-        &data_ptrs[begin], &data_ptrs[m], &data_ptrs[end],
-        [dim](const Data *a, const Data *b) -> bool {
-          return a->pos[dim] == b->pos[dim] ? a < b : a->pos[dim] < b->pos[dim];
-        });
-    nodes_[node] = Node(data_ptrs[m]->pos[dim], dim);
-    data_[node] = *data_ptrs[m];
-    if (begin < m) {
-      nodes_[node].has_left_child = 1;
-      int child_num = next_node_++;
-      Balance(begin, m, child_num, data_ptrs);
+  }
+
+  // Swap two elements along with their positions.
+  void Swap(int i, int j) {
+    std::swap(data_[i], data_[j]);
+    for (int dim = 0; dim < 3; ++dim) {
+      std::swap(lane_pos_[dim][i], lane_pos_[dim][j]);
     }
+  }
 
-    if (m + 1 < end) {
-      nodes_[node].right_child = next_node_++;
-      Balance(m + 1, end, nodes_[node].right_child, data_ptrs);
+  // Query the \p n nearest elements closer to \p query than \p r2.
+  void Query(const float query[3], int n, float r2,
+             std::vector<QueryResult> &results) const {
+    results.clear();
+    if (n <= 0) {
+      return;
+    }
+    Lanes query_lanes[3] = {Lanes(query[0]), Lanes(query[1]),
+                            Lanes(query[2])};
+    // the subtrees left to visit, with the squared distance from the query
+    // to the split that separates them from it
+    struct Entry {
+      int node;
+      int begin;
+      int end;
+      float distance2;
+    };
+    Entry stack[64];
+    int stack_size = 0;
+    int num_nodes = nodes_.size();
+    int node = 0;
+    int begin = 0;
+    int end = data_.size();
+    for (;;) {
+      // go down to the leaf holding the query, leaving the other children
+      // on the stack
+      while (node < num_nodes) {
+        const Node &split = nodes_[node];
+        int m = (begin + end) / 2;
+        float d = query[split.dim] - split.split;
+        Entry far = {2 * node + 2, m, end, d * d};
+        int near = 2 * node + 1;
+        int near_end = m;
+        if (d > 0) {
+          std::swap(far.node, near);
+          std::swap(far.begin, begin);
+          std::swap(far.end, near_end);
+        }
+        end = near_end;
+        node = near;
+        if (near < num_nodes / 2) {
+          Prefetch(&nodes_[2 * near + 1]);
+        }
+        if (far.distance2 < r2) {
+          if (far.node >= num_nodes) {
+            for (int dim = 0; dim < 3; ++dim) {
+              Prefetch(&lane_pos_[dim][far.begin]);
+            }
+          }
+          stack[stack_size++] = far;
+        }
+      }
+      QueryLeaf(query_lanes, n, begin, end, r2, results);
+      do {
+        if (stack_size == 0) {
+          return;
+        }
+        --stack_size;
+      } while (stack[stack_size].distance2 >= r2);
+      node = stack[stack_size].node;
+      begin = stack[stack_size].begin;
+      end = stack[stack_size].end;
     }
   }
 
-  void QueryRecursive(const Vec3 &p, int max, Real &r2,
-                      std::vector<QueryResult> &results, int node) const {
-    const Node *n = &nodes_[node];
-    if (n->dim != 3) {
-      Real distance2 = p[n->dim] - n->pos;
-      distance2 *= distance2;
-      if (p[n->dim] <= n->pos) {
-        if (n->has_left_child) QueryRecursive(p, max, r2, results, node + 1);
-        if (distance2 < r2 && n->right_child < nodes_.size())
-          QueryRecursive(p, max, r2, results, n->right_child);
-      } else {
-        if (n->right_child < nodes_.size())
-          QueryRecursive(p, max, r2, results, n->right_child);
-        if (distance2 < r2 && n->has_left_child)
-          QueryRecursive(p, max, r2, results, node + 1);
+  // @param cell a cell of a grid of 1024^3 cells
+  // @return the position of the cell along the Morton curve
+  static uint32_t MortonIndex(const uint32_t cell[3]) {
+    uint32_t index = 0;
+    for (int bit = 0; bit < 10; ++bit) {
+      for (int dim = 0; dim < 3; ++dim) {
+        index |= (cell[dim] >> bit & 1) << (3 * bit + dim);
       }
     }
+    return index;
+  }
 
-    Real distance2 = Length(data_[node].pos - p);
-    distance2 *= distance2;
-    if (distance2 < r2) {
-      QueryResult result;
-      result.data = data_[node];
-      result.distance2 = distance2;
-      results.push_back(result);
-      std::push_heap(results.begin(), results.end());
-      if (results.size() > max) {
-        std::pop_heap(results.begin(), results.end());
-        r2 = results.back().distance2;
-        results.pop_back();
+  // Add the elements of the leaf [begin, end) closer to the query than
+  // \p r2 to the heap of results, kSimdLanes at a time.
+  // @param r2 the squared distance the results must be closer than,
+  // lowered to the distance of the farthest result once there are \p n of
+  // them
+  void QueryLeaf(const Lanes query[3], int n, int begin, int end, float &r2,
+                 std::vector<QueryResult> &results) const {
+    for (int i = begin; i < end; i += kSimdLanes) {
+      auto distance2 = Lanes(0.0f);
+      for (int dim = 0; dim < 3; ++dim) {
+        auto d = Lanes::Load(&lane_pos_[dim][i]) - query[dim];
+        distance2 = distance2 + d * d;
+      }
+      int candidates = LessEqual(distance2, Lanes(r2)) &
+                       ((1 << std::min(end - i, kSimdLanes)) - 1);
+      if (candidates == 0) {
+        continue;
+      }
+      float distances2[kSimdLanes];
+      distance2.Store(distances2);
+      for (int j = 0; candidates >> j != 0; ++j) {
+        if (!(candidates >> j & 1) || distances2[j] >= r2) {
+          continue;
+        }
+        if (results.size() < n) {
+          results.emplace_back(i + j, distances2[j]);
+          std::push_heap(results.begin(), results.end());
+        } else {
+          std::pop_heap(results.begin(), results.end());
+          results.back() = QueryResult(i + j, distances2[j]);
+          std::push_heap(results.begin(), results.end());
+        }
+        if (results.size() == n) {
+          r2 = results.front().distance2;
+        }
       }
     }
   }
 
-  std::vector<Node> nodes_;
   std::vector<Data> data_;
-  int next_node_;
+  std::vector<Node> nodes_;
+  // the positions of the elements by axis, which the elements don't repeat
+  std::vector<float> lane_pos_[3];
 };
 
 typedef KdTree<Photon> PhotonMap;
@@ -14,10 +14,63 @@ class PhotonMapper : public Renderer {
   virtual void Render() override;
 
  private:
+  // A photon stored by a path, where, and whether the bounce before it was
+  // specular, which makes it a caustic photon while their budget lasts.
+  struct StoredPhoton {
+    Vec3f pos;
+    Photon photon;
+    bool caustic;
+  };
+  // The photons stored by a batch of iterations of photon emission, in
+  // order, and where the photons of each iteration end.
+  struct Batch {
+    std::vector<StoredPhoton> photons;
+    std::vector<int> iteration_ends;
+  };
+  // Trace the photons on the threads of the pool until the budgets of
+  // caustic and indirect photons are filled.
   PhotonMap BuildPhotonMap(const Scene &scene);
-  void RenderRange(int min_y, int max_y, const PhotonMap &photon_map);
-  Vec3 Li(int i, int j, const PhotonMap &photon_map,
-          std::vector<PhotonMap::QueryResult> &query_results);
+  // Emit a photon from a light and add the photons its path stores.
+  // @param iteration the iteration of photon emission, which picks the
+  // random numbers of the photon along with \p light
+  void TracePhoton(const Scene &scene, int light, uint32_t iteration,
+                   std::vector<StoredPhoton> &photons) const;
+  // A diffuse hit where a camera path ends, waiting for the photons around
+  // it to estimate the radiance it reflects.
+  struct GatherPoint {
+    SurfaceDiff surface;
+    // the direction towards the camera
+    Vec3 wo;
+    // the throughput of the path times its share of the radiance of its
+    // pixel
+    Vec3 weight;
+    // the pixel, counted from the first one of the tile
+    int pixel;
+  };
+  // The gather points of a tile waiting to be queried together, and the
+  // buffers of the query, reused from a batch to the next.
+  struct GatherBatch {
+    std::vector<GatherPoint> gather_points;
+    std::vector<Vec3> points;
+    std::vector<std::vector<PhotonMap::QueryResult>> results;
+  };
+  void RenderTile(const Tile &tile, const PhotonMap &photon_map);
+  // @param first_sample the index of the first of the samples, which picks
+  // their random numbers
+  // @param samples the number of samples of the pixel (\p i, \p j)
+  // @param tile_pixel the pixel within its tile
+  // @param gather_points where the paths ending on a diffuse surface are
+  // added
+  // @return the average radiance of their camera rays, times \p samples,
+  // but for the radiance of the gather points
+  Vec3 Li(int i, int j, int first_sample, int samples, int tile_pixel,
+          std::vector<GatherPoint> &gather_points);
+  // Query the photons around the gather points of a batch at once and add
+  // the radiance they estimate to the pixels of the points. Empties the
+  // batch.
+  // @param radiance the radiance of the pixels of the tile
+  void Gather(const PhotonMap &photon_map, GatherBatch &batch,
+              std::vector<Vec3> &radiance) const;
   Scene *scene_;
   PinholeCamera *camera_;
   int num_sampled_photons_;
@@ -9,6 +9,9 @@
 namespace ren {
 class PinholeCamera {
  public:
+  // the rays GenRays() returns for a sample of a pixel, one through each
+  // quarter of the pixel
+  static const int kRaysPerSample = 4;
   // Construct a simple pinhole camera
   // @param from the point from where the camera is looking
   // @param to the point to where the camera is looking at
@@ -27,7 +30,7 @@ class PinholeCamera {
   // Generate a number of rays. This is used for antialiasing.
   // @param col the height coordinate of the image
   // @param row the width coordinate of the image
-  // @return a couple of rays for the pixel (\p col, \p row)
+  // @return kRaysPerSample rays for the pixel (\p col, \p row)
   std::vector<Ray> GenRays(int col, int row);
 
  private:
@@ -11,8 +11,18 @@ class Plane : public Shape {
   Vec3 normal() const;
   virtual bool Intersect(const Ray &ray, Real &t,
                          SurfaceDiff &surface_diff) override;
+  virtual bool Occluded(const Ray &ray) const override;
   virtual SurfaceDiff SamplePoint(Real &pdf) override;
   virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
+  // Move a point computed along a ray back onto the plane it hits.
+  // @param point a point of the plane
+  // @param normal the normal of the plane, not necessarily normalized
+  // @param error bound on the absolute error of each coordinate of the result
+  // @return the point of the plane
+  static Vec3 ProjectToSurface(const Vec3 &p, const Vec3 &point,
+                               const Vec3 &normal, Vec3 &error);
 
  private:
   const static Vec3 kPoint;
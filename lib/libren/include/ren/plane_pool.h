@@ -0,0 +1,50 @@
+#ifndef REN_PLANE_POOL_H_
+#define REN_PLANE_POOL_H_
+#include <vector>
+#include "ren/shape.h"
+#include "ren/vec.h"
+namespace ren {
+struct LaneRay;
+// Many planes sharing a material stored as one shape. Planes are unbounded so
+// there is no hierarchy, every ray is tested against all the planes several
+// at a time in single precision and the candidates again in double
+// precision.
+class PlanePool : public Shape {
+ public:
+  // @param local_to_world the transform of the pool
+  // @param points a point of each plane
+  // @param normals the normal of each plane, not necessarily normalized
+  PlanePool(const Mat4 &local_to_world, const std::vector<Vec3> &points,
+            const std::vector<Vec3> &normals);
+  virtual bool Intersect(const Ray &ray, Real &t,
+                         SurfaceDiff &surface_diff) override;
+  virtual bool Occluded(const Ray &ray) const override;
+  // Sampling isn't supported, like Plane.
+  virtual SurfaceDiff SamplePoint(Real &pdf) override;
+  virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
+  int size() const;
+
+ private:
+  // Check whether the transform is the identity.
+  void UpdateTransform();
+  // Test a ray against the planes [begin, begin + kSimdLanes). The test is
+  // conservative: it may report a plane the ray misses, never the opposite.
+  // @return bit i set if plane begin + i may be hit closer than \p tmax
+  int IntersectLanes(const LaneRay &ray, int begin, Real tmax) const;
+  // @param t the distance to the hit of \p ray with plane \p i
+  // @return true if the hit is closer than the tmax of \p ray
+  bool Intersect(const Ray &ray, int i, Real &t) const;
+  // the planes in the local space of the pool
+  std::vector<Vec3> points_;
+  std::vector<Vec3> normals_;
+  // the planes as structure of arrays in single precision, padded with a
+  // register of planes without normal
+  std::vector<float> lane_points_[3];
+  std::vector<float> lane_normals_[3];
+  // rays aren't transformed if the pool has the identity transform
+  bool identity_;
+};
+}  // namespace ren
+#endif  // REN_PLANE_POOL_H_
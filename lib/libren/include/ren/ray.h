@@ -6,8 +6,60 @@
 #include "ren/typedefs.h"
 #include "ren/vec.h"
 namespace ren {
+// Bound on the relative rounding error of n chained floating point
+// operations, (1 + epsilon)^n - 1, where epsilon is half the machine epsilon.
+constexpr Real Gamma(int n) {
+  return n * std::numeric_limits<Real>::epsilon() / 2 /
+         (1 - n * std::numeric_limits<Real>::epsilon() / 2);
+}
+
+// Move the origin of a ray leaving a surface just out of the rounding error
+// of the point it leaves from, so that the ray can't hit that surface again.
+// Unlike a fixed offset, this holds however large the coordinates are and
+// doesn't skip the geometry close to the point.
+// @param p the point of the surface
+// @param p_error bound on the absolute error of each coordinate of \p p
+// @param n the normal of unit length of the surface at \p p
+// @param w the direction of the ray, which tells the side of the surface
+// @return the origin of the ray
+Vec3 OffsetRayOrigin(const Vec3 &p, const Vec3 &p_error, const Vec3 &n,
+                     const Vec3 &w);
+
+// Transform a point and bound the rounding error of the result.
+// @param m the transform matrix
+// @param p the point
+// @param p_error bound on the absolute error of each coordinate of \p p
+// @param error bound on the absolute error of each coordinate of the
+// transformed point, including the error carried over from \p p_error
+// @return the transformed point
+Vec3 TransformPoint(const Mat4 &m, const Vec3 &p, const Vec3 &p_error,
+                    Vec3 &error);
+
+// Footprint of a ray seen as a cone around it: its width at the origin of
+// the ray and how much wider it gets per unit of distance, i.e., the angle
+// of the cone. Details smaller than the width of the cone where a ray gets
+// to them can't be told apart, which lets meshes answer it with a coarser
+// level of detail.
+struct RayCone {
+  Real width = 0;
+  Real spread = 0;
+  // @return the width of the cone at \p distance from the origin of the ray
+  Real WidthAt(Real distance) const { return width + spread * distance; }
+  // The cone of a ray scattered by a surface. A specular surface reflects the
+  // cone as is, other surfaces widen it to the solid angle 1 / \p pdf that a
+  // sampled direction stands for.
+  // @param distance the distance from the origin of the ray to the surface
+  // @param pdf the density of the direction sampled, in solid angle
+  // @param specular true if the surface is a perfect mirror or refractor
+  // @return the cone of the scattered ray
+  RayCone Scatter(Real distance, Real pdf, bool specular) const;
+};
+
 class Ray {
  public:
+  // A ray that reaches nothing, to fill the arrays of rays before they are
+  // assigned.
+  Ray();
   Ray(const Vec3 &origin, const Vec3 &direction,
       Real tmax = std::numeric_limits<Real>::infinity());
   Ray(const Vec3 &direction, Real tmax = std::numeric_limits<Real>::infinity());
@@ -16,8 +68,11 @@ class Ray {
   Vec3 direction() const;
   Real tmax() const;
   void set_tmax(Real tmax);
+  const RayCone &cone() const;
+  void set_cone(const RayCone &cone);
   // Transform the ray direcion and position according to the given transform
-  // matrix.
+  // matrix. The direction isn't normalized so tmax keeps its meaning. The
+  // cone is kept as is, in the units of the space the ray comes from.
   // @param transform the transform matrix
   // @return the new ray transformed
   Ray Transform(const Mat4 &transform) const;
@@ -26,6 +81,7 @@ class Ray {
   Real tmax_;
   Vec3 origin_;
   Vec3 direction_;
+  RayCone cone_;
 };
 }  // namespace ren
 #endif  // REN_RAY_H_
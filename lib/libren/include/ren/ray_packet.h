@@ -0,0 +1,47 @@
+#ifndef REN_RAY_PACKET_H_
+#define REN_RAY_PACKET_H_
+#include "ren/bounds.h"
+#include "ren/ray.h"
+#include "ren/typedefs.h"
+namespace ren {
+// Rays traced together through the hierarchies. Coherent rays, e.g., the
+// camera rays of neighbouring pixels, hit mostly the same nodes so a node is
+// only tested against the rays until one of them hits it.
+class RayPacket {
+ public:
+  static const int kMaxSize = 16;
+  // @param rays the rays of the packet, copied
+  // @param size the number of \p rays, at most kMaxSize
+  RayPacket(const Ray rays[], int size);
+  int size() const { return size_; }
+  Ray &operator[](int i) { return rays_[i]; }
+  const Ray &operator[](int i) const { return rays_[i]; }
+  // @return true if the directions of all the rays have the same signs,
+  // which traversing the hierarchies with the whole packet requires
+  bool coherent() const;
+  // @return the signs of the directions of coherent packets
+  const int *dir_is_neg() const;
+  // @return true if ray \p i hits \p bounds closer than its tmax
+  bool IntersectP(int i, const Bounds3 &bounds) const {
+    return bounds.IntersectP(rays_[i].origin(), inv_dirs_[i],
+                             ray_dir_is_neg_[i], rays_[i].tmax());
+  }
+  // Test the frustum containing the rays of a coherent packet.
+  // @return false if no ray of the packet can hit \p bounds
+  bool FrustumIntersectP(const Bounds3 &bounds) const;
+
+ private:
+  // fixed arrays rather than vectors, a packet is built for every pixel and
+  // for every transformed mesh its rays reach
+  Ray rays_[kMaxSize];
+  int size_;
+  Vec3 inv_dirs_[kMaxSize];
+  int ray_dir_is_neg_[kMaxSize][3];
+  bool coherent_;
+  int dir_is_neg_[3];
+  // the bounds of the origins and of the inverse directions of the rays
+  Bounds3 origins_;
+  Bounds3 inv_dirs_bounds_;
+};
+}  // namespace ren
+#endif  // REN_RAY_PACKET_H_
@@ -2,28 +2,40 @@
 #ifndef REN_REN_H_
 #define REN_REN_H_
 #include "ren/area_light.h"
+#include "ren/bounds.h"
 #include "ren/bsdf.h"
+#include "ren/bvh.h"
 #include "ren/disk.h"
+#include "ren/disk_pool.h"
 #include "ren/film.h"
 #include "ren/light.h"
 #include "ren/mat.h"
 #include "ren/object.h"
+#include "ren/out_of_core_mesh.h"
 #include "ren/path_tracer.h"
 #include "ren/photon_map.h"
 #include "ren/photon_mapper.h"
 #include "ren/pinhole_camera.h"
 #include "ren/plane.h"
+#include "ren/plane_pool.h"
 #include "ren/point_light.h"
 #include "ren/ray.h"
+#include "ren/ray_packet.h"
 #include "ren/renderer.h"
 #include "ren/rng.h"
 #include "ren/sampling.h"
 #include "ren/scene.h"
+#include "ren/scene_cache.h"
 #include "ren/scene_factory.h"
+#include "ren/serialize.h"
 #include "ren/shape.h"
 #include "ren/sphere.h"
+#include "ren/sphere_pool.h"
 #include "ren/surface_diff.h"
+#include "ren/thread_pool.h"
+#include "ren/tile_scheduler.h"
 #include "ren/transform.h"
+#include "ren/triangle.h"
 #include "ren/typedefs.h"
 #include "ren/vec.h"
 #endif
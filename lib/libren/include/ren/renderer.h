@@ -1,12 +1,17 @@
 #ifndef REN_RENDERER_H_
 #define REN_RENDERER_H_
+#include <functional>
+#include <vector>
 #include "ren/scene.h"
 #include "ren/surface_diff.h"
+#include "ren/thread_pool.h"
+#include "ren/tile_scheduler.h"
 #include "ren/vec.h"
 namespace ren {
 // Generic renderer interface.
 class Renderer {
  public:
+  virtual ~Renderer() = default;
   // Render the final image.
   virtual void Render() = 0;
   // Estimate the direct radiance.
@@ -17,6 +22,35 @@ class Renderer {
   // @return the total estimated radiance due to direct illumiation
   Vec3 EstimateDirectRadiance(const Scene &scene, const SurfaceDiff &surface,
                               const Vec3 &wo, int samples = 1);
+  // Trace the rays scattered by non specular surfaces with a cone, which lets
+  // the meshes with levels of detail answer them with coarser triangles.
+  void set_ray_cones(bool ray_cones);
+  // Render the image in tiles of tile_size x tile_size pixels, in the given
+  // order.
+  void set_tiles(int tile_size, TileScheduler::Order order);
+  // @return what each thread did while rendering the image
+  const std::vector<TileStats> &tile_stats() const;
+  // Render with the threads of \p pool instead of DefaultThreadPool(). The
+  // pool must outlive the renderer.
+  void set_thread_pool(ThreadPool *pool);
+  // Give each NUMA node of the pool its own copy of the read-only structures
+  // built for a render, like the photon map, if its threads are pinned.
+  void set_replicate(bool replicate);
+
+ protected:
+  // Render the tiles of an image on the threads of the pool.
+  // @param render callable rendering a tile on a thread of the pool, called
+  // concurrently
+  void RenderTiles(int height, int width,
+                   const std::function<void(const Tile &, int thread)> &render);
+  ThreadPool &thread_pool() const;
+  bool ray_cones_ = false;
+  int tile_size_ = TileScheduler::kDefaultTileSize;
+  TileScheduler::Order tile_order_ = TileScheduler::kHilbert;
+  std::vector<TileStats> tile_stats_;
+  // null for DefaultThreadPool()
+  ThreadPool *pool_ = nullptr;
+  bool replicate_ = false;
 };
 }  // namespace ren
 #endif  // REN_RENDERER_H_
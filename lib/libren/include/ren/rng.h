@@ -1,11 +1,41 @@
 #ifndef REN_RNG_H_
 #define REN_RNG_H_
+#include <cstdint>
 #include "ren/typedefs.h"
 namespace ren {
+// Random numbers drawn from counter-based streams. The numbers of a stream
+// are a hash (Philox 4x32-10) of the path they belong to and of their
+// position in it, so every thread draws from its own stream without sharing
+// state and a path draws the same numbers whatever thread traces it and
+// whatever else the thread traced before.
 namespace rng {
-// Return a random number uniformly distributed between [0,1).
-// NOTE: If Real is a float, there is a bug and the number could be between
-// [0,1]; 1 being included.
+// The kinds of paths, so that paths of different kinds with the same index
+// and sample draw different numbers.
+enum Domain : uint32_t {
+  // the stream of a thread before it starts a path
+  kThread = 0,
+  // the positions of the camera rays of a sample of a pixel
+  kCameraSample = 1,
+  // the path of a camera ray
+  kCameraPath = 2,
+  // the path of a photon
+  kPhoton = 3
+};
+
+// Start the stream of the numbers of a path on the calling thread, at its
+// first bounce.
+// @param domain the kind of the path
+// @param index what the path starts from, like a pixel or a photon
+// @param sample tells apart the paths of the same index
+void SetPath(Domain domain, uint32_t index, uint32_t sample);
+
+// Move the stream of the current path on the calling thread to the start of
+// a bounce, so the numbers of a bounce don't depend on how many numbers the
+// previous ones drew.
+void SetBounce(uint32_t bounce);
+
+// Return a random number uniformly distributed between [0,1) from the stream
+// of the calling thread.
 // @return random number
 Real Uniform();
 }  // namespace rng
@@ -2,6 +2,7 @@
 #define REN_SCENE_H_
 #include <memory>
 #include <vector>
+#include "ren/bvh.h"
 #include "ren/light.h"
 #include "ren/object.h"
 #include "ren/ray.h"
@@ -16,6 +17,32 @@ class Scene {
   // intersection point
   // @return true if hte ray intersect an object in the scene, false otherwise
   bool Intersect(const Ray &ray, SurfaceDiff &surface_diff) const;
+  // Test a packet of rays against the scene, sharing the traversal of the
+  // hierarchies if they are coherent.
+  // @param packet the rays to test with. The tmax of the rays hitting an
+  // object is set to the distance to the closest hit
+  // @param surface_diffs the intersection point of each ray
+  // @return bit i set if ray i of \p packet intersects an object
+  int Intersect(RayPacket &packet, SurfaceDiff surface_diffs[]) const;
+  // Test if the ray hits any object in the scene. Cheaper than Intersect()
+  // since it stops at the first hit and computes no surface information.
+  // @param ray the ray to test with, only hits closer than its tmax count
+  // @return true if the ray is blocked by some object
+  bool Occluded(const Ray &ray) const;
+  // Build the acceleration structure over the objects of the scene. It has to
+  // be called after the last object has been added and before tracing any
+  // ray.
+  // @param options the settings used to build the hierarchy
+  void Build(const BvhOptions &options = DefaultBvhOptions());
+  // Move an object. The hierarchy isn't updated until Update() is called.
+  // @param object the index of the object in the order they were added
+  // @param local_to_world the new transform of the object
+  void SetObjectTransform(int object, const Mat4 &local_to_world);
+  // Refit the hierarchy to the objects moved since the last update instead
+  // of rebuilding it. Like Build(), it can't be called while tracing rays.
+  void Update();
+  const std::vector<std::unique_ptr<Object>> &objects() const;
+  const BvhStats &bvh_stats() const;
   const std::vector<std::unique_ptr<Light>> &lights() const;
   void AddObject(std::unique_ptr<Object> o);
   void AddLight(std::unique_ptr<Light> l);
@@ -24,6 +51,14 @@ class Scene {
  private:
   std::vector<std::unique_ptr<Object>> objects_;
   std::vector<std::unique_ptr<Light>> lights_;
+  // hierarchy over the bounded objects
+  Bvh bvh_;
+  // the bounds of every object when the hierarchy was last updated
+  std::vector<Bounds3> bounds_;
+  // objects with infinite extent, e.g. planes, that are always tested
+  std::vector<int> unbounded_;
+  // bounded objects moved since the last update
+  std::vector<int> moved_;
 };
 }  // namespace ren
 #endif  // REN_SCENE_H_
@@ -0,0 +1,77 @@
+#ifndef REN_SCENE_CACHE_H_
+#define REN_SCENE_CACHE_H_
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ren/bvh.h"
+#include "ren/mat.h"
+#include "ren/sphere_pool.h"
+#include "ren/triangle.h"
+#include "ren/vec.h"
+namespace ren {
+// Counters of the lookups of a SceneCache.
+struct SceneCacheStats {
+  // the lookups served by a file of the cache
+  int hits = 0;
+  // the lookups that built the geometry and added it to the cache
+  int misses = 0;
+  std::size_t bytes_read = 0;
+  std::size_t bytes_written = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, const SceneCacheStats &stats);
+
+// Directory of files holding the geometry of scenes along with its
+// acceleration structures, so that building a scene again reads them instead
+// of building them. A file is named after a hash of its content: the
+// geometry it's built from, the settings of the hierarchies and the version
+// of the format, which tells builds with a different Real apart. Files are
+// memory mapped and copied in bulk to the data structures, there is nothing
+// to parse.
+class SceneCache {
+ public:
+  // @param directory where the files are, created if missing. Throws
+  // std::runtime_error if it can't be
+  explicit SceneCache(const std::string &directory);
+  // Get the geometry of a mesh from the cache, or build it and add it.
+  // Throws std::runtime_error if the file can't be written.
+  // @param vertices the vertices of the mesh
+  // @param indices every three indices to \p vertices form a triangle
+  // @param levels_of_detail whether to build the levels of detail too
+  // @param options the settings used to build the hierarchies
+  std::shared_ptr<TriangleMeshData> Mesh(
+      const std::vector<Vec3> &vertices, const std::vector<int> &indices,
+      bool levels_of_detail, const BvhOptions &options = DefaultBvhOptions());
+  // Get a pool of spheres from the cache, or build it and add it. Throws
+  // std::runtime_error if the file can't be written.
+  // @param local_to_world the transform of the pool
+  // @param centers the center of each sphere
+  // @param radii the radius of each sphere
+  // @param options the settings used to build the hierarchy
+  std::unique_ptr<SpherePool> Spheres(
+      const Mat4 &local_to_world, const std::vector<Vec3> &centers,
+      const std::vector<Real> &radii,
+      const BvhOptions &options = DefaultBvhOptions());
+  // Remove the files of the cache from its directory.
+  void Clear();
+  const SceneCacheStats &stats() const;
+
+ private:
+  // Map the file of a key and hand its block over to \p read.
+  // @return false if there is no file for the key written by this build
+  bool Read(uint64_t key, const std::function<void(const char *)> &read);
+  // Write the file of a key.
+  // @param size the size of the block
+  // @param write callable filling the block
+  void Write(uint64_t key, std::size_t size,
+             const std::function<void(char *)> &write);
+  std::string Path(uint64_t key) const;
+  std::string directory_;
+  SceneCacheStats stats_;
+};
+}  // namespace ren
+#endif  // REN_SCENE_CACHE_H_
@@ -3,13 +3,24 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 #include "ren/scene.h"
+#include "ren/scene_cache.h"
 namespace ren {
 // Singleton holding a couple of hardcoded example scenes.
 class SceneFactory {
  public:
+  // The scenes are built the first time they are requested since some of
+  // them, like cbox_particles, take a while.
+  // @return the scene called \p name, nullptr if there is none
   Scene *GetScene(const std::string &name);
   static SceneFactory &GetInstance();
+  // Read the meshes and the pools of the scenes built from now on from a
+  // SceneCache in \p directory, adding the ones missing. Throws
+  // std::runtime_error if the directory can't be created.
+  void set_cache_directory(const std::string &directory);
+  // @return the cache set by set_cache_directory(), nullptr if there is none
+  const SceneCache *cache() const;
 
  private:
   Scene Cbox();
@@ -17,9 +28,23 @@ class SceneFactory {
   Scene CboxSpheres();
   Scene CboxSphereInside();
   Scene CboxBlocksDisk();
+  // A million small spheres floating in the box like dust.
+  Scene CboxParticles();
+  // Two rippled spheres of half a million triangles each with levels of
+  // detail.
+  Scene CboxMeshes();
+  // Build the geometry of a mesh with levels of detail, or get it from the
+  // cache.
+  std::shared_ptr<TriangleMeshData> MeshData(const std::vector<Vec3> &vertices,
+                                             const std::vector<int> &indices);
+  // Build a pool of spheres, or get it from the cache.
+  std::unique_ptr<SpherePool> Spheres(const std::vector<Vec3> &centers,
+                                      const std::vector<Real> &radii);
   SceneFactory();
   static std::unique_ptr<SceneFactory> instance_;
+  std::map<std::string, Scene (SceneFactory::*)()> builders_;
   std::map<std::string, Scene> scenes_;
+  std::unique_ptr<SceneCache> cache_;
 };
 }  // namespace ren
 #endif  // REN_SCENEFACTORY_H_
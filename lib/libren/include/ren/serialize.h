@@ -0,0 +1,46 @@
+#ifndef REN_SERIALIZE_H_
+#define REN_SERIALIZE_H_
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+namespace ren {
+// Helpers to copy data structures to blocks of bytes and back, as they are in
+// memory. Writing with a null block only adds up the size it takes.
+namespace serialize {
+// Copy \p size bytes to out + offset, unless out is null, and advance offset.
+inline void Put(char *out, std::size_t &offset, const void *src,
+                std::size_t size) {
+  if (out && size > 0) {
+    std::memcpy(out + offset, src, size);
+  }
+  offset += size;
+}
+
+// Same as Put() for the size and the elements of a vector.
+template <typename T>
+void PutVector(char *out, std::size_t &offset, const std::vector<T> &v) {
+  uint64_t size = v.size();
+  Put(out, offset, &size, sizeof(size));
+  Put(out, offset, v.data(), size * sizeof(T));
+}
+
+// Copy \p size bytes from data to dst and advance data.
+inline void Get(const char *&data, void *dst, std::size_t size) {
+  if (size > 0) {
+    std::memcpy(dst, data, size);
+  }
+  data += size;
+}
+
+// Read a vector written by PutVector() and advance data.
+template <typename T>
+void GetVector(const char *&data, std::vector<T> &v) {
+  uint64_t size;
+  Get(data, &size, sizeof(size));
+  v.resize(size);
+  Get(data, v.data(), size * sizeof(T));
+}
+}  // namespace serialize
+}  // namespace ren
+#endif  // REN_SERIALIZE_H_
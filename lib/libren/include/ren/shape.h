@@ -1,6 +1,8 @@
 #ifndef REN_SHAPE_H_
 #define REN_SHAPE_H_
+#include "ren/bounds.h"
 #include "ren/ray.h"
+#include "ren/ray_packet.h"
 #include "ren/surface_diff.h"
 #include "ren/typedefs.h"
 
@@ -17,6 +19,20 @@ class Shape {
   // @return true if the ray \p ray intersected with this shape, false otherwise
   virtual bool Intersect(const Ray &ray, Real &t,
                          SurfaceDiff &surface_diff) = 0;
+  // Test for intersection with some rays of a packet. The default tests them
+  // one at a time.
+  // @param packet the rays to test with. The tmax of the rays hitting the
+  // shape is set to the distance to the hit
+  // @param rays bit i is set if ray i of \p packet should be tested
+  // @param surface_diffs the geometric information about the intersection
+  // point of each ray, only written for the rays hitting the shape
+  // @return bit i set if ray i hit the shape
+  virtual int Intersect(RayPacket &packet, int rays,
+                        SurfaceDiff surface_diffs[]);
+  // Test if a ray hits the shape at all, e.g., for shadow rays.
+  // @param ray the ray to test with
+  // @return true if \p ray hits this shape closer than its tmax
+  virtual bool Occluded(const Ray &ray) const = 0;
   // Sampled a point of the shape.
   // @param pdf the probability of sampling the returned point
   // @return the geometric information at the sampled point
@@ -24,7 +40,13 @@ class Shape {
   virtual ~Shape() = default;
   const Mat4 &world_to_local() const;
   const Mat4 &local_to_world() const;
+  // Move the shape. Shapes caching anything derived from the transform
+  // update it here.
+  // @param local_to_world the new transform
+  virtual void set_local_to_world(const Mat4 &local_to_world);
   virtual Real Area() const = 0;
+  // @return the bounding box of the shape in world space coordinates
+  virtual Bounds3 WorldBound() const = 0;
 
  protected:
   Mat4 world_to_local_;
@@ -0,0 +1,171 @@
+#ifndef REN_SIMD_H_
+#define REN_SIMD_H_
+#include <algorithm>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+namespace ren {
+// the number of floats of the widest register the compiler targets, used by
+// the kernels testing several primitives at a time
+#if defined(__AVX__)
+const int kSimdLanes = 8;
+#else
+const int kSimdLanes = 4;
+#endif
+
+// N floats processed together. Mapped to an SSE register for N = 4 and to
+// an AVX register for N = 8 when the compiler targets them, otherwise the
+// operations loop over the lanes.
+template <int N>
+struct SimdFloat {
+  float v[N];
+  SimdFloat() {}
+  explicit SimdFloat(float value) { std::fill(v, v + N, value); }
+  static SimdFloat Load(const float *p) {
+    SimdFloat r;
+    std::copy(p, p + N, r.v);
+    return r;
+  }
+  void Store(float *p) const { std::copy(v, v + N, p); }
+};
+
+template <int N>
+SimdFloat<N> operator+(const SimdFloat<N> &a, const SimdFloat<N> &b) {
+  SimdFloat<N> r;
+  for (int i = 0; i < N; ++i) r.v[i] = a.v[i] + b.v[i];
+  return r;
+}
+
+template <int N>
+SimdFloat<N> operator-(const SimdFloat<N> &a, const SimdFloat<N> &b) {
+  SimdFloat<N> r;
+  for (int i = 0; i < N; ++i) r.v[i] = a.v[i] - b.v[i];
+  return r;
+}
+
+template <int N>
+SimdFloat<N> operator*(const SimdFloat<N> &a, const SimdFloat<N> &b) {
+  SimdFloat<N> r;
+  for (int i = 0; i < N; ++i) r.v[i] = a.v[i] * b.v[i];
+  return r;
+}
+
+template <int N>
+SimdFloat<N> operator/(const SimdFloat<N> &a, const SimdFloat<N> &b) {
+  SimdFloat<N> r;
+  for (int i = 0; i < N; ++i) r.v[i] = a.v[i] / b.v[i];
+  return r;
+}
+
+// The lanes of \p b are returned where either lane is NaN, like the SSE
+// instructions.
+template <int N>
+SimdFloat<N> Min(const SimdFloat<N> &a, const SimdFloat<N> &b) {
+  SimdFloat<N> r;
+  for (int i = 0; i < N; ++i) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+  return r;
+}
+
+template <int N>
+SimdFloat<N> Max(const SimdFloat<N> &a, const SimdFloat<N> &b) {
+  SimdFloat<N> r;
+  for (int i = 0; i < N; ++i) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+  return r;
+}
+
+// @return bit i set if lane i of \p a is less or equal than lane i of \p b
+template <int N>
+int LessEqual(const SimdFloat<N> &a, const SimdFloat<N> &b) {
+  int mask = 0;
+  for (int i = 0; i < N; ++i) mask |= (a.v[i] <= b.v[i]) << i;
+  return mask;
+}
+
+#if defined(__SSE__)
+template <>
+struct SimdFloat<4> {
+  __m128 v;
+  SimdFloat() {}
+  explicit SimdFloat(__m128 value) : v(value) {}
+  explicit SimdFloat(float value) : v(_mm_set1_ps(value)) {}
+  static SimdFloat Load(const float *p) { return SimdFloat(_mm_loadu_ps(p)); }
+  void Store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+inline SimdFloat<4> operator+(const SimdFloat<4> &a, const SimdFloat<4> &b) {
+  return SimdFloat<4>(_mm_add_ps(a.v, b.v));
+}
+
+inline SimdFloat<4> operator-(const SimdFloat<4> &a, const SimdFloat<4> &b) {
+  return SimdFloat<4>(_mm_sub_ps(a.v, b.v));
+}
+
+inline SimdFloat<4> operator*(const SimdFloat<4> &a, const SimdFloat<4> &b) {
+  return SimdFloat<4>(_mm_mul_ps(a.v, b.v));
+}
+
+inline SimdFloat<4> operator/(const SimdFloat<4> &a, const SimdFloat<4> &b) {
+  return SimdFloat<4>(_mm_div_ps(a.v, b.v));
+}
+
+inline SimdFloat<4> Min(const SimdFloat<4> &a, const SimdFloat<4> &b) {
+  return SimdFloat<4>(_mm_min_ps(a.v, b.v));
+}
+
+inline SimdFloat<4> Max(const SimdFloat<4> &a, const SimdFloat<4> &b) {
+  return SimdFloat<4>(_mm_max_ps(a.v, b.v));
+}
+
+inline int LessEqual(const SimdFloat<4> &a, const SimdFloat<4> &b) {
+  return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+struct SimdFloat<8> {
+  __m256 v;
+  SimdFloat() {}
+  explicit SimdFloat(__m256 value) : v(value) {}
+  explicit SimdFloat(float value) : v(_mm256_set1_ps(value)) {}
+  static SimdFloat Load(const float *p) {
+    return SimdFloat(_mm256_loadu_ps(p));
+  }
+  void Store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline SimdFloat<8> operator+(const SimdFloat<8> &a, const SimdFloat<8> &b) {
+  return SimdFloat<8>(_mm256_add_ps(a.v, b.v));
+}
+
+inline SimdFloat<8> operator-(const SimdFloat<8> &a, const SimdFloat<8> &b) {
+  return SimdFloat<8>(_mm256_sub_ps(a.v, b.v));
+}
+
+inline SimdFloat<8> operator*(const SimdFloat<8> &a, const SimdFloat<8> &b) {
+  return SimdFloat<8>(_mm256_mul_ps(a.v, b.v));
+}
+
+inline SimdFloat<8> operator/(const SimdFloat<8> &a, const SimdFloat<8> &b) {
+  return SimdFloat<8>(_mm256_div_ps(a.v, b.v));
+}
+
+inline SimdFloat<8> Min(const SimdFloat<8> &a, const SimdFloat<8> &b) {
+  return SimdFloat<8>(_mm256_min_ps(a.v, b.v));
+}
+
+inline SimdFloat<8> Max(const SimdFloat<8> &a, const SimdFloat<8> &b) {
+  return SimdFloat<8>(_mm256_max_ps(a.v, b.v));
+}
+
+inline int LessEqual(const SimdFloat<8> &a, const SimdFloat<8> &b) {
+  return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ));
+}
+#endif
+
+template <int N>
+SimdFloat<N> Abs(const SimdFloat<N> &a) {
+  return Max(a, SimdFloat<N>(0.0f) - a);
+}
+}  // namespace ren
+#endif  // REN_SIMD_H_
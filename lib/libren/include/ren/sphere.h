@@ -11,13 +11,30 @@ class Sphere : public Shape {
   Real radius() const;
   virtual bool Intersect(const Ray &ray, Real &t,
                          SurfaceDiff &surface_diff) override;
+  virtual bool Occluded(const Ray &ray) const override;
   virtual SurfaceDiff SamplePoint(Real &pdf) override;
   virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
+  // Find the closest hit of a ray with a sphere. The discriminant is computed
+  // from the distance of the center to the line of the ray, which unlike
+  // b^2 - 4ac doesn't cancel out for spheres small next to their distance to
+  // the origin of the ray, in single precision most of all.
+  // @param t the distance to the hit
+  // @return true if the ray hits the sphere within [0, tmax]
+  static bool Intersect(const Ray &ray, const Vec3 &center, Real radius2,
+                        Real &t);
+  // Move a point computed along a ray back onto the sphere it hits.
+  // @param error bound on the absolute error of each coordinate of the result
+  // @return the point of the sphere
+  static Vec3 ProjectToSurface(const Vec3 &p, const Vec3 &center, Real radius,
+                               Vec3 &error);
 
  private:
   const static Vec3 kOrigin;
   Vec3 origin_;
   Real radius_;
+  Real radius2_;
 };
 }  // namespace ren
 #endif  // REN_SPHERE_H_
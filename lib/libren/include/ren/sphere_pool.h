@@ -0,0 +1,78 @@
+#ifndef REN_SPHERE_POOL_H_
+#define REN_SPHERE_POOL_H_
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "ren/bvh.h"
+#include "ren/shape.h"
+#include "ren/vec.h"
+namespace ren {
+// Many spheres sharing a material, e.g., particles, stored as one shape with
+// a hierarchy of its own. The spheres of a leaf are tested several at a time
+// in single precision and the few that may be hit are tested again in double
+// precision, which costs far less time and memory than a Sphere per particle.
+class SpherePool : public Shape {
+ public:
+  // @param local_to_world the transform of the pool
+  // @param centers the center of each sphere
+  // @param radii the radius of each sphere
+  // @param options the settings used to build the hierarchy, never a grid
+  SpherePool(const Mat4 &local_to_world, const std::vector<Vec3> &centers,
+             const std::vector<Real> &radii,
+             const BvhOptions &options = DefaultBvhOptions());
+  virtual bool Intersect(const Ray &ray, Real &t,
+                         SurfaceDiff &surface_diff) override;
+  virtual bool Occluded(const Ray &ray) const override;
+  // Sampling isn't supported, like Sphere.
+  virtual SurfaceDiff SamplePoint(Real &pdf) override;
+  virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
+  int size() const;
+  const BvhStats &bvh_stats() const;
+  // @return the bytes used by the spheres and the hierarchy
+  std::size_t MemoryUsage() const;
+  // Copy the spheres in their local space to a block of bytes along with
+  // their hierarchy, which Deserialize() reads back without building it
+  // again. The block can only be read by a build with the same Real.
+  // @param out where the block is written, nullptr to only get its size
+  // @return the size of the block in bytes
+  std::size_t Serialize(char *out) const;
+  // @param local_to_world the transform of the pool
+  // @param data a block written by Serialize()
+  // @return the pool stored in the block
+  static std::unique_ptr<SpherePool> Deserialize(const Mat4 &local_to_world,
+                                                 const char *data);
+
+ private:
+  // A ray broadcast to the lanes of the single precision test, with the
+  // inverse length of its direction.
+  struct LaneRay;
+  // Used by Deserialize(), which fills the members.
+  explicit SpherePool(const Mat4 &local_to_world);
+  // Copy the spheres to the lanes, padded to the register width.
+  void BuildLanes();
+  // Compute the bounds from the transform.
+  void UpdateTransform();
+  // Test a ray against the spheres [begin, begin + kSimdLanes). The test is
+  // conservative: it may report a sphere the ray misses, never the opposite.
+  // @return bit i set if sphere begin + i may be hit closer than \p tmax
+  int IntersectLanes(const LaneRay &ray, int begin, Real tmax) const;
+  // @param t the distance to the closest hit of \p ray with sphere \p i
+  // @return true if the hit is closer than the tmax of \p ray
+  bool Intersect(const Ray &ray, int i, Real &t) const;
+  // the spheres in the local space of the pool, ordered like the leaves of
+  // the hierarchy
+  std::vector<Vec3> centers_;
+  std::vector<Real> radii2_;
+  // the spheres as structure of arrays in single precision, padded with a
+  // register of empty spheres
+  std::vector<float> lane_centers_[3];
+  std::vector<float> lane_radii_;
+  Bvh bvh_;
+  // rays aren't transformed if the pool has the identity transform
+  bool identity_;
+  Bounds3 world_bound_;
+};
+}  // namespace ren
+#endif  // REN_SPHERE_POOL_H_
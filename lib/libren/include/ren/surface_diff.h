@@ -1,6 +1,7 @@
 #ifndef REN_SURFACEDIFF_H_
 #define REN_SURFACEDIFF_H_
 #include "ren/mat.h"
+#include "ren/ray.h"
 #include "ren/typedefs.h"
 #include "ren/vec.h"
 namespace ren {
@@ -12,7 +13,17 @@ struct SurfaceDiff {
   Vec3 x;  // the x axis
   Vec3 y;  // the y axis
   Vec3 z;  // the z axis. x and z form a plane and y is the normal to this plane
+  Vec3 p_error;  // bound on the absolute rounding error of each coordinate of p
   const Object *o;  // the intersected object
+
+  // @param w the direction of the ray
+  // @return a ray leaving the surface from p, with its origin moved out of
+  // the rounding error of p
+  Ray SpawnRay(const Vec3 &w) const;
+  // @param to a point of another surface
+  // @return a ray with a direction of unit length from p to \p to, which
+  // stops before reaching the surface of \p to
+  Ray SpawnRayTo(const SurfaceDiff &to) const;
 };
 }  // namespace ren
 #endif  // REN_SURFACEDIFF_H_
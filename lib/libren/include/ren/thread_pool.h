@@ -0,0 +1,103 @@
+#ifndef REN_THREAD_POOL_H_
+#define REN_THREAD_POOL_H_
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace ren {
+// Threads that live as long as the pool and run the tasks handed to Run(),
+// optionally pinned to CPUs. The CPUs are grouped by NUMA node as listed in
+// /sys/devices/system/node, or in a single node where that isn't available.
+class ThreadPool {
+ public:
+  // Where the threads run.
+  enum Affinity {
+    // wherever the OS schedules them
+    kNone,
+    // one per CPU, filling the CPUs of a node before moving to the next
+    kCompact,
+    // one per CPU, spread round robin over the nodes
+    kScatter
+  };
+  // @param num_threads the threads of the pool, 0 for all the hardware
+  // threads. Threads beyond the CPUs available share them
+  // @param affinity where the threads run
+  explicit ThreadPool(int num_threads = 0, Affinity affinity = kNone);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  // Run task(thread) on every thread of the pool and return once all of
+  // them returned. Not reentrant: a task must not call Run() on its pool.
+  void Run(const std::function<void(int thread)> &task);
+  int num_threads() const;
+  Affinity affinity() const;
+  // @return the NUMA nodes the threads of the pool are pinned to, 1 if they
+  // aren't pinned
+  int num_nodes() const;
+  // @return the NUMA node a thread is pinned to, 0 if it isn't pinned
+  int node(int thread) const;
+
+ private:
+  void Work(int thread);
+  std::vector<std::thread> threads_;
+  // the node of each thread, in [0, num_nodes_)
+  std::vector<int> nodes_;
+  int num_nodes_ = 1;
+  Affinity affinity_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  // the task of the current Run(), and the tasks started so far
+  const std::function<void(int)> *task_ = nullptr;
+  long long generation_ = 0;
+  int running_ = 0;
+  bool stop_ = false;
+};
+
+// @return the pool used unless told otherwise, with a thread per hardware
+// thread and no affinity
+ThreadPool &DefaultThreadPool();
+
+// Copies of a read-only structure, one per NUMA node of a pool, each one
+// made by a thread pinned to the node so that its pages are allocated there.
+// The threads of the pool read the copy of their node instead of reaching
+// across the interconnect. Without pinned threads on several nodes, nothing
+// is copied and the original is used.
+template <typename T>
+class NodeReplicas {
+ public:
+  // @param pool the pool whose threads read the structure
+  // @param original the structure, which must outlive the replicas
+  NodeReplicas(ThreadPool &pool, const T &original)
+      : pool_(pool), original_(original) {
+    if (pool.affinity() == ThreadPool::kNone || pool.num_nodes() < 2) {
+      return;
+    }
+    replicas_.resize(pool.num_nodes());
+    std::vector<int> first_thread(pool.num_nodes(), -1);
+    for (int thread = pool.num_threads() - 1; thread >= 0; --thread) {
+      first_thread[pool.node(thread)] = thread;
+    }
+    pool.Run([&](int thread) {
+      int node = pool.node(thread);
+      if (first_thread[node] == thread) {
+        replicas_[node] = std::make_unique<T>(original);
+      }
+    });
+  }
+  // @return the copy of the node of a thread of the pool
+  const T &Get(int thread) const {
+    return replicas_.empty() ? original_ : *replicas_[pool_.node(thread)];
+  }
+  // @return the copies made, 0 if the original is used
+  int num_replicas() const { return replicas_.size(); }
+
+ private:
+  ThreadPool &pool_;
+  const T &original_;
+  std::vector<std::unique_ptr<T>> replicas_;
+};
+}  // namespace ren
+#endif  // REN_THREAD_POOL_H_
@@ -0,0 +1,79 @@
+#ifndef REN_TILE_SCHEDULER_H_
+#define REN_TILE_SCHEDULER_H_
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "ren/thread_pool.h"
+namespace ren {
+// A rectangle of pixels of the image, the rows [min_row, max_row) and the
+// columns [min_col, max_col).
+struct Tile {
+  int min_row;
+  int max_row;
+  int min_col;
+  int max_col;
+};
+
+// What a thread did while rendering the tiles of an image.
+struct TileStats {
+  int tiles = 0;
+  // the ranges of tiles taken from other threads
+  int steals = 0;
+  // the time spent rendering tiles, and the rest of the time until the last
+  // thread finished
+  double busy_ms = 0;
+  double idle_ms = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, const TileStats &stats);
+
+// Renders the tiles of an image on several threads. The tiles are sorted
+// along a curve and each thread starts with a contiguous range of them, so
+// the tiles it renders are close in the image. A thread that runs out of
+// tiles steals the second half of the largest range left, which balances
+// threads that got the expensive parts of the image. Every pixel belongs to
+// exactly one tile, whatever the size of the image.
+class TileScheduler {
+ public:
+  // The order of the tiles.
+  enum Order { kScanline, kMorton, kHilbert };
+  static const int kDefaultTileSize = 16;
+  // @param height the rows of the image
+  // @param width the columns of the image
+  // @param tile_size the rows and columns of a tile, smaller at the edges
+  // @param order the order of the tiles
+  TileScheduler(int height, int width, int tile_size = kDefaultTileSize,
+                Order order = kHilbert);
+  // Render all the tiles and return once they are rendered.
+  // @param pool the threads rendering the tiles
+  // @param render callable rendering a tile on a thread of the pool, called
+  // concurrently from the threads
+  void Run(ThreadPool &pool,
+           const std::function<void(const Tile &, int thread)> &render);
+  const std::vector<Tile> &tiles() const;
+  // @return what each thread of the pool did in the last Run()
+  const std::vector<TileStats> &stats() const;
+
+ private:
+  // The range of tiles [begin, end) a thread has left, packed in 64 bits so
+  // that the thread and the thieves update it with a single compare and swap.
+  struct Range {
+    std::atomic<uint64_t> packed;
+  };
+  // Take the first tile of the range of a thread.
+  // @return false if the range is empty
+  bool Pop(Range &range, int &tile);
+  // Move the second half of the largest range of the other threads to the
+  // range of \p thread.
+  // @return false if there was nothing left to steal
+  bool Steal(int thread);
+  std::vector<Tile> tiles_;
+  std::unique_ptr<Range[]> ranges_;
+  int num_ranges_ = 0;
+  std::vector<TileStats> stats_;
+};
+}  // namespace ren
+#endif  // REN_TILE_SCHEDULER_H_
@@ -1,27 +1,217 @@
 #ifndef REN_TRIANGLE_H_
 #define REN_TRIANGLE_H_
+#include <cstddef>
+#include <memory>
 #include <vector>
+#include "ren/bvh.h"
 #include "ren/shape.h"
 #include "ren/vec.h"
 namespace ren {
-// Class representing a triangle mesh.
-class TriangleMesh : public Shape {
+struct LaneRay;
+// Geometry of a triangle mesh in its local space along with its hierarchy. It
+// isn't modified once built so any number of TriangleMesh instances can share
+// it.
+class TriangleMeshData {
  public:
-  TriangleMesh(const Mat4 &local_to_world, const std::vector<Vec3> &vertices,
-               const std::vector<int> &indices);
-  virtual bool Intersect(const Ray &ray, Real &t,
-                         SurfaceDiff &surface_diff) override;
-  virtual SurfaceDiff SamplePoint(Real &pdf) override;
-  virtual Real Area() const override;
+  // Build the hierarchy of the mesh. The triangles are reordered to follow
+  // the leaves of the hierarchy.
+  // @param vertices the vertices of the mesh
+  // @param indices every three indices to \p vertices form a triangle
+  // @param options the settings used to build the hierarchy
+  TriangleMeshData(const std::vector<Vec3> &vertices,
+                   const std::vector<int> &indices,
+                   const BvhOptions &options = DefaultBvhOptions());
+  // Use a hierarchy built before, e.g., read from a file, instead of
+  // building it.
+  // @param vertices the vertices of the mesh
+  // @param indices the triangles in the order of the leaves of \p bvh, as
+  // returned by indices() once the hierarchy is built
+  // @param bvh the hierarchy over the triangles
+  TriangleMeshData(std::vector<Vec3> vertices, std::vector<int> indices,
+                   Bvh bvh);
+  // Build coarser versions of the mesh for the rays too wide to tell its
+  // triangles apart. Each level merges the vertices in the same cell of a
+  // grid, whose cells are twice as large as those of the level before, and
+  // drops the triangles that collapse. Called before the geometry is shared.
+  // @param options the settings used to build the hierarchy of each level
+  void BuildLevelsOfDetail(const BvhOptions &options = DefaultBvhOptions());
+  // @param footprint the width of a ray where it gets to the mesh, in the
+  // local space of the mesh
+  // @return the coarsest level whose vertices moved less than \p footprint,
+  // the mesh itself if there is none
+  const TriangleMeshData &LevelOfDetail(Real footprint) const;
+  // @return the number of levels of detail, the mesh itself included
+  int num_levels() const;
+  // @return how far the vertices of this level of detail may be from the
+  // surface of the mesh it simplifies, 0 for the mesh itself
+  Real level_error() const;
+  // Find the closest triangle hit by a ray. The triangles of a leaf are
+  // tested several at a time in single precision and the few that may be hit
+  // are tested again in double precision.
+  // @param ray the ray in the local space of the mesh. Its tmax is set to the
+  // distance to the hit
+  // @param barycentrics the weights of the vertices of the triangle at the
+  // hit
+  // @return the index of the triangle hit, -1 if there is none
+  int Intersect(Ray &ray, Vec3 &barycentrics) const;
+  // Find the closest triangle hit by each ray of a packet.
+  // @param packet the rays in the local space of the mesh. The tmax of the
+  // rays hitting a triangle is set to the distance to the hit
+  // @param triangles the index of the triangle hit by each ray, left as is
+  // for the rays missing the mesh
+  // @param barycentrics the weights of the vertices at the hit of each ray
+  void Intersect(RayPacket &packet, int triangles[],
+                 Vec3 barycentrics[]) const;
+  // @param ray the ray in the local space of the mesh
+  // @return true if \p ray hits any triangle closer than its tmax
+  bool Occluded(const Ray &ray) const;
+  // Sample a point uniformly over the area of the mesh.
+  // @param triangle the index of the triangle the point belongs to
+  // @param error bound on the absolute error of each coordinate of the point
+  // @return the point in the local space of the mesh
+  Vec3 SamplePoint(int &triangle, Vec3 &error) const;
+  // Compute a point of a triangle from its barycentric coordinates. Unlike
+  // the point at the distance of a hit along the ray, its error only depends
+  // on the magnitude of the vertices.
+  // @param triangle the index of the triangle
+  // @param barycentrics the weights of the vertices
+  // @param error bound on the absolute error of each coordinate of the point
+  // @return the point in the local space of the mesh
+  Vec3 Interpolate(int triangle, const Vec3 &barycentrics, Vec3 &error) const;
+  // @param triangle the index of the triangle
+  // @param e1 the edge from the first to the second vertex of the triangle
+  // @param e2 the edge from the first to the third vertex of the triangle
+  void Edges(int triangle, Vec3 &e1, Vec3 &e2) const;
+  Real Area() const;
+  const Bounds3 &bounds() const;
+  const std::vector<Vec3> &vertices() const;
+  const std::vector<int> &indices() const;
+  const Bvh &bvh() const;
+  const BvhStats &bvh_stats() const;
+  // @return the bytes used by the geometry and the hierarchy
+  std::size_t MemoryUsage() const;
+  // @return the bytes used by the hierarchy alone
+  std::size_t BvhMemoryUsage() const;
+  // Copy the mesh to a block of bytes along with its hierarchy and its
+  // levels of detail, which Deserialize() reads back without building them
+  // again. Like Bvh::Serialize(), the block can only be
+  // read by a build with the same Real.
+  // @param out where the block is written, nullptr to only get its size
+  // @return the size of the block in bytes
+  std::size_t Serialize(char *out) const;
+  // @param data a block written by Serialize()
+  // @return the mesh stored in the block
+  static std::unique_ptr<TriangleMeshData> Deserialize(const char *data);
 
  private:
+  // Used by Deserialize(), which fills the members.
+  TriangleMeshData() = default;
+  // The triangles referenced by the leaves, in the order of
+  // bvh_.prim_indices(), as structure of arrays in single precision so that
+  // consecutive triangles of a leaf are loaded into the lanes of a SIMD
+  // register. Each array is padded with a register of degenerate triangles.
+  struct TriangleLanes {
+    std::vector<float> v0[3];
+    std::vector<float> e1[3];
+    std::vector<float> e2[3];
+  };
+  // Compute what follows from the triangles once they are in the order of
+  // the hierarchy: the lanes and the areas.
+  void Prepare();
+  void BuildLanes();
+  // Test a ray against the triangles of the references [begin, begin +
+  // lanes). The test is conservative: it may report a triangle the ray
+  // misses, never the opposite.
+  // @return bit i set if the triangle of reference begin + i may be hit
+  // closer than \p tmax
+  int IntersectLanes(const LaneRay &ray, int begin, Real tmax) const;
   bool Intersect(const Ray &ray, int i0, int i1, int i2, Real &t,
-                 SurfaceDiff &surface_diff);
+                 Vec3 *barycentrics = nullptr) const;
+  // The watertight test of Woop et al.: the vertices are moved to a space
+  // where the ray starts at the origin and goes along z, and the ray hits
+  // the triangle if it is on the same side of the three edges there. A ray
+  // through an edge can't slip between the two triangles sharing it, even in
+  // single precision, and the distance of a hit is only accepted past its
+  // rounding error.
+  // @param v0 the first vertex of the triangle
+  // @param v1 the second vertex of the triangle
+  // @param v2 the third vertex of the triangle
+  // @param barycentrics if not null, the weights of the vertices at the hit
+  static bool Intersect(const Ray &ray, const Vec3 &v0, const Vec3 &v1,
+                        const Vec3 &v2, Real &t,
+                        Vec3 *barycentrics = nullptr);
   Real Area(int i0, int i1, int i2) const;
+  // Split the part of a triangle within \p bounds by an axis aligned plane.
+  // Used by the builder of the hierarchy when spatial splits are enabled.
+  void Clip(int triangle, const Bounds3 &bounds, int axis, Real pos,
+            Bounds3 &left, Bounds3 &right) const;
   std::vector<Vec3> vertices_;
   std::vector<int> indices_;
+  Bvh bvh_;
+  TriangleLanes lanes_;
   std::vector<Real> probabilities_;
   Real surface_area_;
+  // the coarser levels of detail, from the finest
+  std::vector<std::unique_ptr<TriangleMeshData>> levels_;
+  Real level_error_ = 0;
+};
+
+// Class representing an instance of a triangle mesh. Rays are transformed to
+// the local space of the mesh so the geometry and its hierarchy are stored
+// once no matter how many instances use them.
+class TriangleMesh : public Shape {
+ public:
+  // Construct a triangle mesh with geometry of its own.
+  // @param local_to_world the transform of the mesh
+  // @param vertices the vertices of the mesh
+  // @param indices every three indices to \p vertices form a triangle
+  // @param options the settings used to build the hierarchy
+  TriangleMesh(const Mat4 &local_to_world, const std::vector<Vec3> &vertices,
+               const std::vector<int> &indices,
+               const BvhOptions &options = DefaultBvhOptions());
+  // Construct an instance of shared geometry.
+  // @param local_to_world the transform of the instance
+  // @param data the geometry of the mesh
+  TriangleMesh(const Mat4 &local_to_world,
+               std::shared_ptr<const TriangleMeshData> data);
+  // Rays with a cone are traced against the coarsest level of detail whose
+  // error is below the width of the cone where it gets to the mesh.
+  virtual bool Intersect(const Ray &ray, Real &t,
+                         SurfaceDiff &surface_diff) override;
+  // Transform the rays once to the local space of the mesh and trace them
+  // together through its hierarchy.
+  virtual int Intersect(RayPacket &packet, int rays,
+                        SurfaceDiff surface_diffs[]) override;
+  virtual bool Occluded(const Ray &ray) const override;
+  // Sample a point of the mesh. The density is only uniform over the
+  // instance if its transform doesn't scale some axes more than others.
+  virtual SurfaceDiff SamplePoint(Real &pdf) override;
+  virtual Real Area() const override;
+  virtual Bounds3 WorldBound() const override;
+  virtual void set_local_to_world(const Mat4 &local_to_world) override;
+  const BvhStats &bvh_stats() const;
+  const std::shared_ptr<const TriangleMeshData> &data() const;
+
+ private:
+  // Compute what depends on the transform: the area, the bounds and the
+  // scale.
+  void UpdateTransform();
+  // @return the level of detail of the mesh a ray is traced against
+  const TriangleMeshData &LevelOfDetail(const Ray &ray) const;
+  // Fill the shading frame of a hit. Only done once the closest hit is known.
+  // @param data the level of detail hit
+  // @param p the point in the local space of the mesh
+  // @param p_error bound on the absolute error of each coordinate of \p p
+  void SetSurfaceDiff(const TriangleMeshData &data, int triangle,
+                      const Vec3 &p, const Vec3 &p_error,
+                      SurfaceDiff &surface_diff) const;
+  std::shared_ptr<const TriangleMeshData> data_;
+  // rays aren't transformed if the instance has the identity transform
+  bool identity_;
+  // how much the transform scales lengths, the cube root of its determinant
+  Real scale_;
+  Real area_;
+  Bounds3 world_bound_;
 };
 
 }  // namespace ren
@@ -4,11 +4,16 @@
 #include "ren/vec.h"
 namespace ren {
 // Just some convenient typedefs.
+#if defined(REN_SINGLE_PRECISION)
+typedef float Real;
+#else
 typedef double Real;
+#endif
 
 typedef VecFun<Real, 2> Vec2;
 typedef VecFun<int, 2> Vec2i;
 typedef VecFun<Real, 3> Vec3;
+typedef VecFun<float, 3> Vec3f;
 typedef VecFun<int, 3> Vec3i;
 typedef VecFun<Real, 4> Vec4;
 typedef VecFun<int, 4> Vec4i;
@@ -267,6 +267,15 @@ inline T MinComp(const VecFun<T, N> &v) {
   return *std::min_element(&v.data[0], &v.data[N]);
 }
 
+template <typename T, int N>
+inline VecFun<T, N> Abs(const VecFun<T, N> &v) {
+  VecFun<T, N> res;
+  for (int i = 0; i < N; ++i) {
+    res[i] = std::abs(v[i]);
+  }
+  return res;
+}
+
 template <typename T, int N>
 inline T Avg(const VecFun<T, N> &v) {
   auto total = T(0);
@@ -0,0 +1,1402 @@
+#include "ren/bvh.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include "ren/serialize.h"
+
+using namespace ren;
+
+namespace {
+// cost of visiting an interior node relative to intersecting a primitive
+const Real kTraversalCost = 0.125;
+// subtrees smaller than this are not worth a thread of their own
+const int kMinPrimsPerThread = 4096;
+const int kMaxBins = 256;
+// the most cells of a grid along an axis
+const int kMaxGridResolution = 1024;
+// the number of primitives per cell of the top grid of two levels, relative
+// to the cells per primitive of the grids of its cells
+const Real kGridBlockSize = 32;
+// grids flatter than this fraction of their largest extent along an axis are
+// given this thickness to size their cells
+const Real kMinGridExtent = 1E-3;
+// primitives are added to the cells within this fraction of a cell of their
+// bounds, in case the rounding of the traversal puts a ray in a neighbor
+const Real kGridMargin = 1E-3;
+
+struct Bin {
+  Bounds3 bounds;
+  int count = 0;
+};
+
+struct SpatialBin {
+  Bounds3 bounds;
+  int entries = 0;  // references whose bounds start in the bin
+  int exits = 0;    // references whose bounds end in the bin
+};
+
+// A way of splitting a node. The cost is the sum over both sides of the
+// number of references times the surface area, i.e., it isn't normalized by
+// the area of the node.
+struct SplitCandidate {
+  Real cost = std::numeric_limits<Real>::infinity();
+  int axis = -1;  // -1 if no split was found
+  int bin = 0;    // bins [0, bin] are on the left
+  Real pos = 0;   // position of the plane of spatial splits
+  Bounds3 left;
+  Bounds3 right;
+  int num_left = 0;
+  int num_right = 0;
+};
+
+// Maps the centroids of the references of a node to bins along each axis.
+class CentroidBinner {
+ public:
+  CentroidBinner(const Bounds3 &centroid_bounds, int num_bins)
+      : min_(centroid_bounds.min), num_bins_(num_bins) {
+    for (int a = 0; a < 3; ++a) {
+      Real extent = centroid_bounds.max[a] - centroid_bounds.min[a];
+      scale_[a] = extent > 0 ? num_bins / extent : 0;
+    }
+  }
+  template <typename Ref>
+  int operator()(const Ref &ref, int axis) const {
+    int b = (ref.Centroid(axis) - min_[axis]) * scale_[axis];
+    return std::min(b, num_bins_ - 1);
+  }
+  int num_bins() const { return num_bins_; }
+
+ private:
+  Vec3 min_;
+  Vec3 scale_;
+  int num_bins_;
+};
+
+// Find the best object split of a node with the binned surface area
+// heuristic, evaluating all three axes in a single pass over the references.
+template <typename Ref>
+SplitCandidate FindObjectSplit(const Ref *refs, int num_refs,
+                               const Bounds3 &centroid_bounds,
+                               const CentroidBinner &bin_of) {
+  int num_bins = bin_of.num_bins();
+  // reused between calls to not initialize the bins once per node
+  thread_local std::vector<Bin> bins(3 * kMaxBins);
+  std::fill(bins.begin(), bins.begin() + 3 * num_bins, Bin());
+  for (int i = 0; i < num_refs; ++i) {
+    for (int a = 0; a < 3; ++a) {
+      auto &bin = bins[a * num_bins + bin_of(refs[i], a)];
+      ++bin.count;
+      bin.bounds.Expand(refs[i].bounds);
+    }
+  }
+  SplitCandidate best;
+  Real cost_left[kMaxBins];
+  for (int a = 0; a < 3; ++a) {
+    if (centroid_bounds.max[a] == centroid_bounds.min[a]) {
+      continue;
+    }
+    const Bin *axis_bins = &bins[a * num_bins];
+    // sweep from the left and then from the right, the split after bin i
+    // puts bins [0, i] on the left
+    Bounds3 left;
+    int count = 0;
+    for (int i = 0; i < num_bins - 1; ++i) {
+      left.Expand(axis_bins[i].bounds);
+      count += axis_bins[i].count;
+      cost_left[i] = count * left.SurfaceArea();
+    }
+    Bounds3 right;
+    count = 0;
+    for (int i = num_bins - 1; i > 0; --i) {
+      right.Expand(axis_bins[i].bounds);
+      count += axis_bins[i].count;
+      Real cost = cost_left[i - 1] + count * right.SurfaceArea();
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = a;
+        best.bin = i - 1;
+      }
+    }
+  }
+  if (best.axis >= 0) {
+    const Bin *axis_bins = &bins[best.axis * num_bins];
+    for (int i = 0; i < num_bins; ++i) {
+      if (i <= best.bin) {
+        best.left.Expand(axis_bins[i].bounds);
+        best.num_left += axis_bins[i].count;
+      } else {
+        best.right.Expand(axis_bins[i].bounds);
+        best.num_right += axis_bins[i].count;
+      }
+    }
+  }
+  return best;
+}
+
+Bounds3 Intersection(const Bounds3 &a, const Bounds3 &b) {
+  Bounds3 res;
+  for (int i = 0; i < 3; ++i) {
+    res.min[i] = std::max(a.min[i], b.min[i]);
+    res.max[i] = std::min(a.max[i], b.max[i]);
+  }
+  return res;
+}
+
+// Set the resolution of a grid of about \p num_cells cubic cells.
+void GridResolution(const Vec3 &extent, Real num_cells, int resolution[3]) {
+  Real max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+  Real volume = 1;
+  for (int axis = 0; axis < 3; ++axis) {
+    volume *= std::max(extent[axis], kMinGridExtent * max_extent);
+  }
+  Real cells_per_unit =
+      max_extent > 0 ? std::cbrt(std::max<Real>(0, num_cells) / volume) : 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    resolution[axis] = std::max(
+        1, static_cast<int>(std::min<Real>(extent[axis] * cells_per_unit,
+                                           kMaxGridResolution)));
+  }
+}
+
+// Find the cells of a grid overlapped by some bounds, clamped to the grid.
+// @return false if the bounds are empty
+bool GridCellRange(const Bounds3 &bounds, const Vec3 &origin,
+                   const Vec3 &cell_size, const int resolution[3],
+                   int first[3], int last[3]) {
+  if (bounds.IsEmpty()) {
+    return false;
+  }
+  for (int axis = 0; axis < 3; ++axis) {
+    Real inv_size = cell_size[axis] > 0 ? 1 / cell_size[axis] : 0;
+    Real lo = (bounds.min[axis] - origin[axis]) * inv_size - kGridMargin;
+    Real hi = (bounds.max[axis] - origin[axis]) * inv_size + kGridMargin;
+    Real max_cell = resolution[axis] - 1;
+    first[axis] = std::min(std::max<Real>(lo, 0), max_cell);
+    last[axis] = std::min(std::max<Real>(hi, 0), max_cell);
+  }
+  return true;
+}
+
+// Append the cells of a grid over some primitives to \p cells and their
+// references to \p refs. Cell c of the grid references refs[i] for i from
+// cells[n + c] to the next offset, n being the size of \p cells before.
+// @param prims the primitives, indices to \p prim_bounds
+// @param origin the lower corner of the grid
+void FillGrid(const std::vector<Bounds3> &prim_bounds, const int *prims,
+              int num_prims, const Vec3 &origin, const Vec3 &cell_size,
+              const int resolution[3], std::vector<int> &cells,
+              std::vector<int> &refs) {
+  int stride[3] = {1, resolution[0], resolution[0] * resolution[1]};
+  int num_cells = stride[2] * resolution[2];
+  int first_cell = cells.size();
+  // count the references of each cell, then turn the counts into offsets
+  // and write the references
+  cells.resize(first_cell + num_cells + 1, 0);
+  int *offsets = &cells[first_cell];
+  int first[3];
+  int last[3];
+  for (int i = 0; i < num_prims; ++i) {
+    if (!GridCellRange(prim_bounds[prims[i]], origin, cell_size, resolution,
+                       first, last)) {
+      continue;
+    }
+    for (int z = first[2]; z <= last[2]; ++z) {
+      for (int y = first[1]; y <= last[1]; ++y) {
+        for (int x = first[0]; x <= last[0]; ++x) {
+          ++offsets[x + y * stride[1] + z * stride[2] + 1];
+        }
+      }
+    }
+  }
+  offsets[0] = refs.size();
+  for (int cell = 0; cell < num_cells; ++cell) {
+    offsets[cell + 1] += offsets[cell];
+  }
+  refs.resize(offsets[num_cells]);
+  std::vector<int> next(offsets, offsets + num_cells);
+  for (int i = 0; i < num_prims; ++i) {
+    if (!GridCellRange(prim_bounds[prims[i]], origin, cell_size, resolution,
+                       first, last)) {
+      continue;
+    }
+    for (int z = first[2]; z <= last[2]; ++z) {
+      for (int y = first[1]; y <= last[1]; ++y) {
+        for (int x = first[0]; x <= last[0]; ++x) {
+          refs[next[x + y * stride[1] + z * stride[2]]++] = prims[i];
+        }
+      }
+    }
+  }
+  // the end of the last cell is the start of whatever comes next
+  cells.pop_back();
+}
+}  // namespace
+
+// Reference to a primitive holding a copy of its bounds. The builder
+// partitions references instead of indices to the primitives, which keeps the
+// accesses sequential. With spatial splits a primitive can have several
+// references, each bounding the part of it on one side of a split.
+struct Bvh::PrimRef {
+  Bounds3 bounds;
+  int prim;
+  Real Centroid(int axis) const {
+    return (bounds.min[axis] + bounds.max[axis]) / 2;
+  }
+};
+
+// A child of a node of a compressed hierarchy: either an interior node of the
+// uncompressed hierarchy or the primitives of a leaf. Leaves with more
+// primitives than a quantized node can reference are split in halves with
+// the same bounds.
+struct Bvh::CompressedChild {
+  Bounds3 bounds;
+  // index of the uncompressed node, -1 for leaves
+  int node;
+  int begin;
+  int num_prims;
+  bool IsLeaf() const { return node < 0 && num_prims < kInteriorChild; }
+};
+
+struct Bvh::BuildContext {
+  // Clamp the options to what the builder supports.
+  explicit BuildContext(const BvhOptions &build_options)
+      : options(build_options) {
+    options.max_prims_in_node =
+        std::max(1, std::min(options.max_prims_in_node, 0xFFFF));
+    options.num_bins = std::max(2, std::min(options.num_bins, kMaxBins));
+    options.width = options.width >= 8 ? 8 : options.width >= 4 ? 4 : 2;
+    pool = options.thread_pool ? options.thread_pool : &DefaultThreadPool();
+    num_threads = pool->num_threads();
+    while ((1 << parallel_depth) < num_threads) {
+      ++parallel_depth;
+    }
+  }
+  std::vector<PrimRef> refs;
+  BvhOptions options;
+  // null unless spatial splits are enabled
+  const ClipFunction *clip = nullptr;
+  ThreadPool *pool;
+  int num_threads;
+  // the levels split with their nodes spread over the threads before the
+  // subtrees below them are built
+  int parallel_depth = 0;
+  // spatial splits are only tried if the overlap of the children is a
+  // fraction of this area
+  Real root_area = 0;
+  // the number of references so far and the most spatial splits can create
+  std::atomic<int> num_refs{0};
+  int max_refs = 0;
+};
+
+// A node of the top levels of a hierarchy built on a pool, or the subtree
+// below them.
+struct Bvh::BuildTask {
+  // the references of the node, a range of BuildContext::refs or, with
+  // spatial splits, a vector of their own
+  int begin = 0;
+  int end = 0;
+  std::vector<PrimRef> refs;
+  int depth = 0;
+  Bounds3 bounds;
+  // whether the node was split, and then how and the index of the task of
+  // its first child, followed by the second
+  bool split = false;
+  int axis = 0;
+  int first_child = 0;
+  // the references of the children until their tasks are made
+  int mid = 0;
+  std::vector<PrimRef> child_refs[2];
+  // the nodes of the subtree of a node that wasn't split and, with spatial
+  // splits, the primitives of its leaves
+  std::vector<Node> nodes;
+  std::vector<int> prims;
+};
+
+BvhOptions &ren::DefaultBvhOptions() {
+  static BvhOptions options;
+  return options;
+}
+
+std::ostream &ren::operator<<(std::ostream &os, const BvhStats &stats) {
+  os << stats.num_prims << " prims";
+  if (stats.num_refs != stats.num_prims) {
+    os << " (" << stats.num_refs << " references)";
+  }
+  os << ", " << stats.num_nodes << " nodes (" << stats.num_leaves
+     << " leaves), SAH cost " << stats.sah_cost << ", built in "
+     << stats.build_ms << " ms on " << stats.num_threads << " threads";
+  return os;
+}
+
+Bvh::Bvh() {}
+
+Bvh::Bvh(const std::vector<Bounds3> &prim_bounds, const BvhOptions &options) {
+  Build(prim_bounds, options, nullptr);
+}
+
+Bvh::Bvh(const std::vector<Bounds3> &prim_bounds, const BvhOptions &options,
+         const ClipFunction &clip) {
+  Build(prim_bounds, options, &clip);
+}
+
+const Bounds3 &Bvh::bounds() const {
+  return nodes_.empty() ? root_bounds_ : nodes_[0].bounds;
+}
+
+const std::vector<int> &Bvh::prim_indices() const { return prim_indices_; }
+
+void Bvh::RemapPrims(const std::vector<int> &old_to_new) {
+  for (int &prim : prim_indices_) {
+    prim = old_to_new[prim];
+  }
+  // the leaves of each primitive are recomputed if refit later
+  parents_.clear();
+}
+
+bool Bvh::empty() const {
+  return nodes_.empty() && quantized_nodes_.empty() && wide4_nodes_.empty() &&
+         wide8_nodes_.empty() && grid_cells_.empty();
+}
+
+const BvhStats &Bvh::stats() const { return stats_; }
+
+std::size_t Bvh::MemoryUsage() const {
+  return nodes_.capacity() * sizeof(Node) +
+         quantized_nodes_.capacity() * sizeof(QuantizedNode) +
+         wide4_nodes_.capacity() * sizeof(WideNode<4>) +
+         wide8_nodes_.capacity() * sizeof(WideNode<8>) +
+         grid_blocks_.capacity() * sizeof(GridBlock) +
+         grid_cells_.capacity() * sizeof(int) +
+         prim_indices_.capacity() * sizeof(int);
+}
+
+const uint32_t Bvh::kSerializeVersion;
+
+std::size_t Bvh::Serialize(char *out) const {
+  std::size_t size = 0;
+  serialize::Put(out, size, &root_bounds_, sizeof(root_bounds_));
+  serialize::Put(out, size, &stats_, sizeof(stats_));
+  serialize::Put(out, size, &options_, sizeof(options_));
+  serialize::PutVector(out, size, nodes_);
+  serialize::PutVector(out, size, quantized_nodes_);
+  serialize::PutVector(out, size, wide4_nodes_);
+  serialize::PutVector(out, size, wide8_nodes_);
+  serialize::Put(out, size, grid_resolution_, sizeof(grid_resolution_));
+  serialize::Put(out, size, &grid_cell_size_, sizeof(grid_cell_size_));
+  serialize::PutVector(out, size, grid_blocks_);
+  serialize::PutVector(out, size, grid_cells_);
+  serialize::PutVector(out, size, prim_indices_);
+  return size;
+}
+
+Bvh Bvh::Deserialize(const char *data) {
+  Bvh bvh;
+  serialize::Get(data, &bvh.root_bounds_, sizeof(bvh.root_bounds_));
+  serialize::Get(data, &bvh.stats_, sizeof(bvh.stats_));
+  serialize::Get(data, &bvh.options_, sizeof(bvh.options_));
+  serialize::GetVector(data, bvh.nodes_);
+  serialize::GetVector(data, bvh.quantized_nodes_);
+  serialize::GetVector(data, bvh.wide4_nodes_);
+  serialize::GetVector(data, bvh.wide8_nodes_);
+  serialize::Get(data, bvh.grid_resolution_, sizeof(bvh.grid_resolution_));
+  serialize::Get(data, &bvh.grid_cell_size_, sizeof(bvh.grid_cell_size_));
+  serialize::GetVector(data, bvh.grid_blocks_);
+  serialize::GetVector(data, bvh.grid_cells_);
+  serialize::GetVector(data, bvh.prim_indices_);
+  return bvh;
+}
+
+void Bvh::Build(const std::vector<Bounds3> &prim_bounds,
+                const BvhOptions &options, const ClipFunction *clip) {
+  if (prim_bounds.empty()) {
+    return;
+  }
+  if (options.grid_levels > 0) {
+    BuildGrid(prim_bounds, options);
+    return;
+  }
+  auto begin = std::chrono::steady_clock::now();
+  BuildContext context(options);
+  options_ = context.options;
+  if (options.spatial_splits) {
+    context.clip = clip;
+  }
+  context.refs.reserve(prim_bounds.size());
+  Bounds3 root_bounds;
+  for (int i = 0; i < prim_bounds.size(); ++i) {
+    context.refs.push_back({prim_bounds[i], i});
+    root_bounds.Expand(prim_bounds[i]);
+  }
+  context.root_area = root_bounds.SurfaceArea();
+  context.num_refs = prim_bounds.size();
+  context.max_refs =
+      std::max<Real>(1, options.spatial_split_budget) * prim_bounds.size();
+  nodes_.reserve(2 * prim_bounds.size() - 1);
+  if (context.clip) {
+    std::vector<PrimRef> refs;
+    refs.swap(context.refs);
+    BuildParallel(context, 0, 0, refs, 0, nodes_, prim_indices_);
+  } else {
+    std::vector<PrimRef> refs;
+    BuildParallel(context, 0, prim_bounds.size(), refs, 0, nodes_,
+                  prim_indices_);
+    prim_indices_.reserve(context.refs.size());
+    for (const auto &ref : context.refs) {
+      prim_indices_.push_back(ref.prim);
+    }
+  }
+  nodes_.shrink_to_fit();
+  prim_indices_.shrink_to_fit();
+  auto end = std::chrono::steady_clock::now();
+
+  stats_.num_prims = prim_bounds.size();
+  stats_.num_refs = prim_indices_.size();
+  stats_.num_nodes = nodes_.size();
+  stats_.num_leaves = std::count_if(nodes_.begin(), nodes_.end(),
+                                    [](const Node &n) { return n.num_prims; });
+  stats_.num_threads = context.num_threads;
+  Real root_area = nodes_[0].bounds.SurfaceArea();
+  stats_.sah_cost = root_area > 0 ? SahCost(0) / root_area : 0;
+  stats_.build_ms =
+      std::chrono::duration<double, std::milli>(end - begin).count();
+  if (options_.width == 4) {
+    Collapse(wide4_nodes_);
+  } else if (options_.width == 8) {
+    Collapse(wide8_nodes_);
+  } else if (options.compressed) {
+    Compress();
+  }
+  if (options.report) {
+    std::clog << "bvh: " << stats_ << "\n";
+  }
+}
+
+void Bvh::BuildGrid(const std::vector<Bounds3> &prim_bounds,
+                    const BvhOptions &options) {
+  auto begin = std::chrono::steady_clock::now();
+  options_ = options;
+  root_bounds_ = Bounds3();
+  for (const auto &bounds : prim_bounds) {
+    root_bounds_.Expand(bounds);
+  }
+  bool two_levels = options.grid_levels > 1;
+  Real density = std::max<Real>(0, options.grid_density);
+  Vec3 extent = root_bounds_.max - root_bounds_.min;
+  GridResolution(extent,
+                 (two_levels ? density / kGridBlockSize : density) *
+                     prim_bounds.size(),
+                 grid_resolution_);
+  for (int axis = 0; axis < 3; ++axis) {
+    grid_cell_size_[axis] = extent[axis] / grid_resolution_[axis];
+  }
+  int num_blocks =
+      grid_resolution_[0] * grid_resolution_[1] * grid_resolution_[2];
+  std::vector<int> prims(prim_bounds.size());
+  std::iota(prims.begin(), prims.end(), 0);
+  if (!two_levels) {
+    FillGrid(prim_bounds, prims.data(), prims.size(), root_bounds_.min,
+             grid_cell_size_, grid_resolution_, grid_cells_, prim_indices_);
+  } else {
+    grid_blocks_.resize(num_blocks);
+    // the primitives of each block, which then gets a grid over them
+    std::vector<int> block_offsets;
+    std::vector<int> block_prims;
+    FillGrid(prim_bounds, prims.data(), prims.size(), root_bounds_.min,
+             grid_cell_size_, grid_resolution_, block_offsets, block_prims);
+    block_offsets.push_back(block_prims.size());
+    for (int i = 0; i < num_blocks; ++i) {
+      auto &block = grid_blocks_[i];
+      int num_prims = block_offsets[i + 1] - block_offsets[i];
+      block.first = grid_cells_.size();
+      block.resolution[0] = block.resolution[1] = block.resolution[2] = 1;
+      if (num_prims > 1) {
+        GridResolution(grid_cell_size_, density * num_prims, block.resolution);
+      }
+      int coords[3] = {i % grid_resolution_[0],
+                       i / grid_resolution_[0] % grid_resolution_[1],
+                       i / grid_resolution_[0] / grid_resolution_[1]};
+      Vec3 origin;
+      Vec3 cell_size;
+      for (int axis = 0; axis < 3; ++axis) {
+        origin[axis] =
+            root_bounds_.min[axis] + coords[axis] * grid_cell_size_[axis];
+        cell_size[axis] = grid_cell_size_[axis] / block.resolution[axis];
+      }
+      FillGrid(prim_bounds, block_prims.data() + block_offsets[i], num_prims,
+               origin, cell_size, block.resolution, grid_cells_,
+               prim_indices_);
+    }
+  }
+  grid_cells_.push_back(prim_indices_.size());
+  grid_blocks_.shrink_to_fit();
+  grid_cells_.shrink_to_fit();
+  prim_indices_.shrink_to_fit();
+  auto end = std::chrono::steady_clock::now();
+
+  int num_cells = grid_cells_.size() - 1;
+  stats_.num_prims = prim_bounds.size();
+  stats_.num_refs = prim_indices_.size();
+  stats_.num_nodes = two_levels ? num_blocks + num_cells : num_cells;
+  stats_.num_leaves = 0;
+  for (int cell = 0; cell < num_cells; ++cell) {
+    stats_.num_leaves += grid_cells_[cell] < grid_cells_[cell + 1];
+  }
+  stats_.num_threads = 1;
+  stats_.sah_cost = 0;
+  stats_.build_ms =
+      std::chrono::duration<double, std::milli>(end - begin).count();
+  if (options.report) {
+    std::clog << "grid " << grid_resolution_[0] << "x" << grid_resolution_[1]
+              << "x" << grid_resolution_[2]
+              << (two_levels ? " of grids: " : ": ") << stats_ << "\n";
+  }
+}
+
+Bvh::GridWalk::GridWalk(const Ray &ray, const Vec3 &inv_dir, Real t,
+                        const Vec3 &origin, const int resolution[3],
+                        const Vec3 &cell_size)
+    : cell(0), t(t) {
+  const auto &dir = ray.direction();
+  int cells_per_step = 1;
+  for (int axis = 0; axis < 3; ++axis) {
+    Real size = cell_size[axis];
+    Real p = ray.origin()[axis] + t * dir[axis] - origin[axis];
+    Real c = size > 0 ? p / size : 0;
+    coords[axis] =
+        c > 0 ? static_cast<int>(std::min<Real>(c, resolution[axis] - 1)) : 0;
+    cell += coords[axis] * cells_per_step;
+    if (dir[axis] > 0) {
+      step[axis] = 1;
+      end[axis] = resolution[axis];
+      next[axis] = ((coords[axis] + 1) * size - p) * inv_dir[axis] + t;
+      delta[axis] = size * inv_dir[axis];
+    } else if (dir[axis] < 0) {
+      step[axis] = -1;
+      end[axis] = -1;
+      next[axis] = (coords[axis] * size - p) * inv_dir[axis] + t;
+      delta[axis] = -size * inv_dir[axis];
+    } else {
+      // never steps along the axis: reaching end right away stops the walk
+      step[axis] = 0;
+      end[axis] = coords[axis];
+      next[axis] = std::numeric_limits<Real>::infinity();
+      delta[axis] = 0;
+    }
+    stride[axis] = step[axis] * cells_per_step;
+    cells_per_step *= resolution[axis];
+  }
+}
+
+int Bvh::BuildRecursive(BuildContext &context, int begin, int end, int depth,
+                        std::vector<Node> &nodes) {
+  int node_index = nodes.size();
+  nodes.emplace_back();
+  Bounds3 bounds;
+  for (int i = begin; i < end; ++i) {
+    bounds.Expand(context.refs[i].bounds);
+  }
+  nodes[node_index].bounds = bounds;
+  int axis;
+  int mid;
+  if (!Split(context, begin, end, bounds, depth, axis, mid)) {
+    nodes[node_index].offset = begin;
+    nodes[node_index].num_prims = end - begin;
+    return node_index;
+  }
+  nodes[node_index].num_prims = 0;
+  nodes[node_index].axis = axis;
+  BuildRecursive(context, begin, mid, depth + 1, nodes);
+  int second = BuildRecursive(context, mid, end, depth + 1, nodes);
+  nodes[node_index].offset = second;
+  return node_index;
+}
+
+void Bvh::BuildParallel(BuildContext &context, int begin, int end,
+                        std::vector<PrimRef> &refs, int depth,
+                        std::vector<Node> &nodes, std::vector<int> &prims) {
+  int num_refs = context.clip ? refs.size() : end - begin;
+  if (context.parallel_depth == 0 || num_refs < kMinPrimsPerThread) {
+    if (context.clip) {
+      BuildSpatialRecursive(context, refs, depth, nodes, prims);
+    } else {
+      BuildRecursive(context, begin, end, depth, nodes);
+    }
+    return;
+  }
+  std::vector<BuildTask> tasks(1);
+  tasks[0].begin = begin;
+  tasks[0].end = end;
+  tasks[0].refs.swap(refs);
+  tasks[0].depth = depth;
+  // call work on the tasks [first, last) spread over the threads
+  auto run = [&](int first, int last,
+                 const std::function<void(BuildTask &)> &work) {
+    std::atomic<int> next_task{first};
+    context.pool->Run([&](int) {
+      for (int t; (t = next_task++) < last;) {
+        work(tasks[t]);
+      }
+    });
+  };
+  int level = 0;
+  for (int d = 0; d < context.parallel_depth; ++d) {
+    int level_end = tasks.size();
+    run(level, level_end, [&](BuildTask &task) {
+      if (context.clip) {
+        if (task.refs.size() >= kMinPrimsPerThread) {
+          for (const auto &ref : task.refs) {
+            task.bounds.Expand(ref.bounds);
+          }
+          task.split =
+              SplitSpatial(context, task.refs, task.bounds, task.depth,
+                           task.axis, task.child_refs[0], task.child_refs[1]);
+        }
+      } else if (task.end - task.begin >= kMinPrimsPerThread) {
+        for (int i = task.begin; i < task.end; ++i) {
+          task.bounds.Expand(context.refs[i].bounds);
+        }
+        task.split = Split(context, task.begin, task.end, task.bounds,
+                           task.depth, task.axis, task.mid);
+      }
+    });
+    for (int t = level; t < level_end; ++t) {
+      if (!tasks[t].split) {
+        continue;
+      }
+      tasks[t].first_child = tasks.size();
+      for (int i = 0; i < 2; ++i) {
+        BuildTask child;
+        child.begin = i == 0 ? tasks[t].begin : tasks[t].mid;
+        child.end = i == 0 ? tasks[t].mid : tasks[t].end;
+        child.refs.swap(tasks[t].child_refs[i]);
+        child.depth = tasks[t].depth + 1;
+        tasks.push_back(std::move(child));
+      }
+    }
+    level = level_end;
+  }
+  run(0, tasks.size(), [&](BuildTask &task) {
+    if (task.split) {
+      return;
+    }
+    if (context.clip) {
+      BuildSpatialRecursive(context, task.refs, task.depth, task.nodes,
+                            task.prims);
+    } else {
+      BuildRecursive(context, task.begin, task.end, task.depth, task.nodes);
+    }
+  });
+  AppendTask(context, tasks, 0, nodes, prims);
+}
+
+void Bvh::AppendTask(const BuildContext &context,
+                     const std::vector<BuildTask> &tasks, int t,
+                     std::vector<Node> &nodes, std::vector<int> &prims) {
+  const auto &task = tasks[t];
+  if (!task.split) {
+    // the interior nodes are offset by the nodes before the subtree and,
+    // with spatial splits, the leaves by the primitives before it
+    int node_base = nodes.size();
+    int prim_base = prims.size();
+    for (auto node : task.nodes) {
+      if (node.num_prims == 0) {
+        node.offset += node_base;
+      } else if (context.clip) {
+        node.offset += prim_base;
+      }
+      nodes.push_back(node);
+    }
+    prims.insert(prims.end(), task.prims.begin(), task.prims.end());
+    return;
+  }
+  int node_index = nodes.size();
+  nodes.emplace_back();
+  nodes[node_index].bounds = task.bounds;
+  nodes[node_index].num_prims = 0;
+  nodes[node_index].axis = task.axis;
+  AppendTask(context, tasks, task.first_child, nodes, prims);
+  nodes[node_index].offset = nodes.size();
+  AppendTask(context, tasks, task.first_child + 1, nodes, prims);
+}
+
+bool Bvh::Split(BuildContext &context, int begin, int end,
+                const Bounds3 &bounds, int depth, int &axis, int &mid) {
+  const auto &options = context.options;
+  int num_prims = end - begin;
+  if (num_prims == 1) {
+    return false;
+  }
+  Bounds3 centroid_bounds;
+  for (int i = begin; i < end; ++i) {
+    centroid_bounds.Expand(context.refs[i].bounds.Centroid());
+  }
+  PrimRef *first = &context.refs[begin];
+  PrimRef *last = first + num_prims;
+  axis = centroid_bounds.MaxExtent();
+  mid = begin;
+  if (centroid_bounds.max[axis] == centroid_bounds.min[axis] ||
+      depth >= kMaxDepth - 32) {
+    // all centroids are the same or the tree is already too deep, there's
+    // nothing better than halving
+    if (num_prims <= options.max_prims_in_node) {
+      return false;
+    }
+  } else if (options.split_method == BvhOptions::kMiddle) {
+    if (num_prims <= options.max_prims_in_node) {
+      return false;
+    }
+    Real middle = (centroid_bounds.min[axis] + centroid_bounds.max[axis]) / 2;
+    mid = begin + (std::partition(first, last,
+                                  [&](const PrimRef &ref) {
+                                    return ref.Centroid(axis) < middle;
+                                  }) -
+                   first);
+  } else {
+    // small nodes don't need more bins than primitives
+    CentroidBinner bin_of(centroid_bounds,
+                          std::min(options.num_bins, num_prims));
+    auto split = FindObjectSplit(first, num_prims, centroid_bounds, bin_of);
+    Real cost = kTraversalCost + split.cost / bounds.SurfaceArea();
+    if (num_prims <= options.max_prims_in_node && cost >= num_prims) {
+      return false;
+    }
+    axis = split.axis;
+    mid = begin + (std::partition(first, last,
+                                  [&](const PrimRef &ref) {
+                                    return bin_of(ref, axis) <= split.bin;
+                                  }) -
+                   first);
+  }
+  if (mid == begin || mid == end) {
+    mid = (begin + end) / 2;
+    std::nth_element(first, &context.refs[mid], last,
+                     [axis](const PrimRef &a, const PrimRef &b) {
+                       return a.Centroid(axis) < b.Centroid(axis);
+                     });
+  }
+  return true;
+}
+
+int Bvh::BuildSpatialRecursive(BuildContext &context,
+                               std::vector<PrimRef> &refs, int depth,
+                               std::vector<Node> &nodes,
+                               std::vector<int> &prims) {
+  int node_index = nodes.size();
+  nodes.emplace_back();
+  Bounds3 bounds;
+  for (const auto &ref : refs) {
+    bounds.Expand(ref.bounds);
+  }
+  nodes[node_index].bounds = bounds;
+  int axis;
+  std::vector<PrimRef> left;
+  std::vector<PrimRef> right;
+  if (!SplitSpatial(context, refs, bounds, depth, axis, left, right)) {
+    nodes[node_index].offset = prims.size();
+    nodes[node_index].num_prims = refs.size();
+    for (const auto &ref : refs) {
+      prims.push_back(ref.prim);
+    }
+    return node_index;
+  }
+  nodes[node_index].num_prims = 0;
+  nodes[node_index].axis = axis;
+  BuildSpatialRecursive(context, left, depth + 1, nodes, prims);
+  int second = BuildSpatialRecursive(context, right, depth + 1, nodes, prims);
+  nodes[node_index].offset = second;
+  return node_index;
+}
+
+bool Bvh::SplitSpatial(BuildContext &context, std::vector<PrimRef> &refs,
+                       const Bounds3 &bounds, int depth, int &axis,
+                       std::vector<PrimRef> &left,
+                       std::vector<PrimRef> &right) {
+  const auto &options = context.options;
+  int num_refs = refs.size();
+  if (num_refs == 1) {
+    return false;
+  }
+  Bounds3 centroid_bounds;
+  for (const auto &ref : refs) {
+    centroid_bounds.Expand(ref.bounds.Centroid());
+  }
+
+  int num_bins = std::min(options.num_bins, num_refs);
+  CentroidBinner bin_of(centroid_bounds, num_bins);
+  SplitCandidate object_split;
+  if (depth < kMaxDepth - 32) {
+    object_split =
+        FindObjectSplit(refs.data(), num_refs, centroid_bounds, bin_of);
+  }
+  // spatial splits only pay off where the children of the object split
+  // overlap, and the overlap is measured against the root so that the
+  // budget isn't spent on tiny nodes
+  SplitCandidate spatial_split;
+  Bounds3 overlap = Intersection(object_split.left, object_split.right);
+  if (object_split.axis >= 0 &&
+      overlap.SurfaceArea() > options.spatial_split_alpha * context.root_area &&
+      context.num_refs < context.max_refs) {
+    std::vector<SpatialBin> bins(num_bins);
+    std::vector<Real> cost_left(num_bins);
+    for (int a = 0; a < 3; ++a) {
+      Real width = (bounds.max[a] - bounds.min[a]) / num_bins;
+      if (width <= 0) {
+        continue;
+      }
+      auto spatial_bin_of = [&](Real x) {
+        int b = (x - bounds.min[a]) / width;
+        return std::max(0, std::min(b, num_bins - 1));
+      };
+      std::fill(bins.begin(), bins.end(), SpatialBin());
+      for (const auto &ref : refs) {
+        int first_bin = spatial_bin_of(ref.bounds.min[a]);
+        int last_bin = spatial_bin_of(ref.bounds.max[a]);
+        ++bins[first_bin].entries;
+        ++bins[last_bin].exits;
+        // chop the reference at the planes between its bins
+        Bounds3 rest = ref.bounds;
+        for (int b = first_bin; b < last_bin; ++b) {
+          Bounds3 left;
+          Bounds3 right;
+          (*context.clip)(ref.prim, rest, a, bounds.min[a] + (b + 1) * width,
+                          left, right);
+          bins[b].bounds.Expand(left);
+          rest = right;
+        }
+        bins[last_bin].bounds.Expand(rest);
+      }
+      Bounds3 left;
+      int count = 0;
+      for (int i = 0; i < num_bins - 1; ++i) {
+        left.Expand(bins[i].bounds);
+        count += bins[i].entries;
+        cost_left[i] = count * left.SurfaceArea();
+      }
+      Bounds3 right;
+      count = 0;
+      int best_bin = -1;
+      for (int i = num_bins - 1; i > 0; --i) {
+        right.Expand(bins[i].bounds);
+        count += bins[i].exits;
+        Real cost = cost_left[i - 1] + count * right.SurfaceArea();
+        if (cost < spatial_split.cost) {
+          spatial_split.cost = cost;
+          best_bin = i - 1;
+        }
+      }
+      if (best_bin < 0) {
+        continue;
+      }
+      spatial_split = SplitCandidate();
+      spatial_split.axis = a;
+      spatial_split.bin = best_bin;
+      spatial_split.pos = bounds.min[a] + (best_bin + 1) * width;
+      for (int i = 0; i < num_bins; ++i) {
+        if (i <= best_bin) {
+          spatial_split.left.Expand(bins[i].bounds);
+          spatial_split.num_left += bins[i].entries;
+        } else {
+          spatial_split.right.Expand(bins[i].bounds);
+          spatial_split.num_right += bins[i].exits;
+        }
+      }
+      spatial_split.cost =
+          spatial_split.num_left * spatial_split.left.SurfaceArea() +
+          spatial_split.num_right * spatial_split.right.SurfaceArea();
+    }
+  }
+
+  Real area = bounds.SurfaceArea();
+  Real object_cost = kTraversalCost + object_split.cost / area;
+  Real spatial_cost = kTraversalCost + spatial_split.cost / area;
+  if (num_refs <= options.max_prims_in_node &&
+      num_refs <= std::min(object_cost, spatial_cost)) {
+    return false;
+  }
+
+  axis = -1;
+  if (spatial_split.axis >= 0 && spatial_cost < object_cost) {
+    axis = spatial_split.axis;
+    Real pos = spatial_split.pos;
+    Bounds3 left_bounds = spatial_split.left;
+    Bounds3 right_bounds = spatial_split.right;
+    int num_left = spatial_split.num_left;
+    int num_right = spatial_split.num_right;
+    for (const auto &ref : refs) {
+      if (ref.bounds.max[axis] <= pos) {
+        left.push_back(ref);
+        continue;
+      }
+      if (ref.bounds.min[axis] >= pos) {
+        right.push_back(ref);
+        continue;
+      }
+      // reference unsplitting: move the whole reference to one side if it's
+      // cheaper than duplicating it
+      Bounds3 left_all = Union(left_bounds, ref.bounds);
+      Bounds3 right_all = Union(right_bounds, ref.bounds);
+      Real split_cost = left_bounds.SurfaceArea() * num_left +
+                        right_bounds.SurfaceArea() * num_right;
+      Real left_cost = left_all.SurfaceArea() * num_left +
+                       right_bounds.SurfaceArea() * (num_right - 1);
+      Real right_cost = left_bounds.SurfaceArea() * (num_left - 1) +
+                        right_all.SurfaceArea() * num_right;
+      PrimRef left_ref{Bounds3(), ref.prim};
+      PrimRef right_ref{Bounds3(), ref.prim};
+      if (left_cost < split_cost || right_cost < split_cost) {
+        left_ref.bounds = right_ref.bounds = ref.bounds;
+      } else {
+        (*context.clip)(ref.prim, ref.bounds, axis, pos, left_ref.bounds,
+                        right_ref.bounds);
+      }
+      if ((left_cost < split_cost && left_cost <= right_cost) ||
+          right_ref.bounds.IsEmpty()) {
+        left.push_back(left_ref);
+        left_bounds.Expand(left_ref.bounds);
+        --num_right;
+      } else if (right_cost < split_cost || left_ref.bounds.IsEmpty()) {
+        right.push_back(right_ref);
+        right_bounds.Expand(right_ref.bounds);
+        --num_left;
+      } else {
+        left.push_back(left_ref);
+        right.push_back(right_ref);
+      }
+    }
+    if (!left.empty() && !right.empty()) {
+      context.num_refs += left.size() + right.size() - num_refs;
+    }
+  }
+  if (left.empty() || right.empty()) {
+    left.clear();
+    right.clear();
+    if (object_split.axis >= 0) {
+      axis = object_split.axis;
+      for (const auto &ref : refs) {
+        if (bin_of(ref, axis) <= object_split.bin) {
+          left.push_back(ref);
+        } else {
+          right.push_back(ref);
+        }
+      }
+    }
+    if (left.empty() || right.empty()) {
+      if (num_refs <= options.max_prims_in_node) {
+        return false;
+      }
+      axis = centroid_bounds.MaxExtent();
+      int mid = num_refs / 2;
+      std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+                       [axis](const PrimRef &a, const PrimRef &b) {
+                         return a.Centroid(axis) < b.Centroid(axis);
+                       });
+      left.assign(refs.begin(), refs.begin() + mid);
+      right.assign(refs.begin() + mid, refs.end());
+    }
+  }
+  // the references of the node are no longer needed
+  std::vector<PrimRef>().swap(refs);
+  return true;
+}
+
+void Bvh::Refit(const std::vector<int> &prims,
+                const std::vector<Bounds3> &prim_bounds) {
+  if (nodes_.empty() && !empty()) {
+    // the binary nodes weren't kept, or it's a grid: rebuild over the
+    // primitives referenced so far, which leaves out the objects a Scene
+    // keeps out of its hierarchy
+    std::vector<int> built(prim_indices_);
+    std::sort(built.begin(), built.end());
+    built.erase(std::unique(built.begin(), built.end()), built.end());
+    std::vector<Bounds3> bounds;
+    bounds.reserve(built.size());
+    for (int prim : built) {
+      bounds.push_back(prim_bounds[prim]);
+    }
+    int num_refits = stats_.num_refits;
+    int num_rebuilds = stats_.num_rebuilds;
+    quantized_nodes_.clear();
+    wide4_nodes_.clear();
+    wide8_nodes_.clear();
+    grid_blocks_.clear();
+    grid_cells_.clear();
+    prim_indices_.clear();
+    Build(bounds, options_, nullptr);
+    for (int &prim : prim_indices_) {
+      prim = built[prim];
+    }
+    stats_.num_refits = num_refits + 1;
+    stats_.num_rebuilds = num_rebuilds + 1;
+    return;
+  }
+  if (nodes_.empty()) {
+    return;
+  }
+  if (parents_.empty()) {
+    PrepareRefit(prim_bounds.size());
+  }
+  std::vector<int> leaves;
+  for (int prim : prims) {
+    leaves.insert(leaves.end(), &prim_leaves_[prim_leaf_offsets_[prim]],
+                  &prim_leaves_[prim_leaf_offsets_[prim + 1]]);
+  }
+  std::sort(leaves.begin(), leaves.end());
+  leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+  // the children of a node have larger indices, so refitting the ancestors
+  // of the leaves from the largest index down visits every node after its
+  // children
+  std::vector<int> dirty(leaves);
+  for (int leaf : leaves) {
+    for (int node = parents_[leaf]; node >= 0; node = parents_[node]) {
+      dirty.push_back(node);
+    }
+  }
+  std::sort(dirty.begin(), dirty.end());
+  dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+  for (auto it = dirty.rbegin(); it != dirty.rend(); ++it) {
+    RefitNode(*it, prim_bounds);
+  }
+  ++stats_.num_refits;
+  // rebuilding the highest degraded subtree fixes the most
+  int rebuild = -1;
+  int rebuild_depth = 0;
+  for (int node : dirty) {
+    Real area = nodes_[node].bounds.SurfaceArea();
+    if (nodes_[node].num_prims > 0 || area == 0 ||
+        costs_[node] / area <=
+            options_.rebuild_threshold * build_quality_[node]) {
+      continue;
+    }
+    int depth = 0;
+    for (int n = parents_[node]; n >= 0; n = parents_[n]) {
+      ++depth;
+    }
+    if (rebuild < 0 || depth < rebuild_depth) {
+      rebuild = node;
+      rebuild_depth = depth;
+    }
+  }
+  if (rebuild >= 0) {
+    RebuildSubtree(rebuild, prim_bounds);
+    ++stats_.num_rebuilds;
+  }
+  Real root_area = nodes_[0].bounds.SurfaceArea();
+  stats_.sah_cost = root_area > 0 ? costs_[0] / root_area : 0;
+  // collapse the refitted binary nodes again
+  if (!wide4_nodes_.empty()) {
+    wide4_nodes_.clear();
+    Collapse(wide4_nodes_);
+  } else if (!wide8_nodes_.empty()) {
+    wide8_nodes_.clear();
+    Collapse(wide8_nodes_);
+  }
+  if (options_.report) {
+    std::clog << "bvh: refit " << stats_ << "\n";
+  }
+}
+
+void Bvh::PrepareRefit(int num_prims) {
+  parents_.assign(nodes_.size(), -1);
+  for (int i = 0; i < nodes_.size(); ++i) {
+    if (nodes_[i].num_prims == 0) {
+      parents_[i + 1] = i;
+      parents_[nodes_[i].offset] = i;
+    }
+  }
+  prim_leaf_offsets_.assign(num_prims + 1, 0);
+  for (const auto &node : nodes_) {
+    for (int i = 0; i < node.num_prims; ++i) {
+      ++prim_leaf_offsets_[prim_indices_[node.offset + i] + 1];
+    }
+  }
+  for (int p = 0; p < num_prims; ++p) {
+    prim_leaf_offsets_[p + 1] += prim_leaf_offsets_[p];
+  }
+  prim_leaves_.resize(prim_leaf_offsets_.back());
+  std::vector<int> next(prim_leaf_offsets_.begin(),
+                        prim_leaf_offsets_.end() - 1);
+  for (int n = 0; n < nodes_.size(); ++n) {
+    for (int i = 0; i < nodes_[n].num_prims; ++i) {
+      prim_leaves_[next[prim_indices_[nodes_[n].offset + i]]++] = n;
+    }
+  }
+  costs_.resize(nodes_.size());
+  for (int n = nodes_.size() - 1; n >= 0; --n) {
+    const auto &node = nodes_[n];
+    Real area = node.bounds.SurfaceArea();
+    costs_[n] = node.num_prims > 0
+                    ? area * node.num_prims
+                    : kTraversalCost * area + costs_[n + 1] +
+                          costs_[node.offset];
+  }
+  if (build_quality_.size() != nodes_.size()) {
+    build_quality_.resize(nodes_.size());
+    for (int n = 0; n < nodes_.size(); ++n) {
+      Real area = nodes_[n].bounds.SurfaceArea();
+      build_quality_[n] = area > 0 ? costs_[n] / area : 0;
+    }
+  }
+}
+
+void Bvh::RefitNode(int node, const std::vector<Bounds3> &prim_bounds) {
+  auto &n = nodes_[node];
+  if (n.num_prims > 0) {
+    n.bounds = Bounds3();
+    for (int i = 0; i < n.num_prims; ++i) {
+      n.bounds.Expand(prim_bounds[prim_indices_[n.offset + i]]);
+    }
+    costs_[node] = n.bounds.SurfaceArea() * n.num_prims;
+  } else {
+    n.bounds = Union(nodes_[node + 1].bounds, nodes_[n.offset].bounds);
+    costs_[node] = kTraversalCost * n.bounds.SurfaceArea() +
+                   costs_[node + 1] + costs_[n.offset];
+  }
+}
+
+void Bvh::RebuildSubtree(int node, const std::vector<Bounds3> &prim_bounds) {
+  // the nodes of a subtree are contiguous and so are the primitives of its
+  // leaves
+  int last = node;
+  while (nodes_[last].num_prims == 0) {
+    last = nodes_[last].offset;
+  }
+  int first_leaf = node;
+  while (nodes_[first_leaf].num_prims == 0) {
+    ++first_leaf;
+  }
+  int begin = nodes_[first_leaf].offset;
+  int end = nodes_[last].offset + nodes_[last].num_prims;
+  int depth = 0;
+  for (int n = parents_[node]; n >= 0; n = parents_[n]) {
+    ++depth;
+  }
+
+  // primitives split by spatial splits keep one reference per leaf
+  BuildContext context(options_);
+  context.refs.reserve(end - begin);
+  for (int i = begin; i < end; ++i) {
+    context.refs.push_back({prim_bounds[prim_indices_[i]], prim_indices_[i]});
+  }
+  std::vector<Node> subtree;
+  std::vector<PrimRef> refs;
+  std::vector<int> prims;
+  BuildParallel(context, 0, end - begin, refs, depth, subtree, prims);
+  for (int i = begin; i < end; ++i) {
+    prim_indices_[i] = context.refs[i - begin].prim;
+  }
+
+  // replace the old nodes, moving the ones after them
+  int old_end = last + 1;
+  int shift = node + static_cast<int>(subtree.size()) - old_end;
+  for (auto &n : subtree) {
+    n.offset += n.num_prims > 0 ? begin : node;
+  }
+  for (auto &n : nodes_) {
+    if (n.num_prims == 0 && n.offset >= old_end) {
+      n.offset += shift;
+    }
+  }
+  nodes_.erase(nodes_.begin() + node, nodes_.begin() + old_end);
+  nodes_.insert(nodes_.begin() + node, subtree.begin(), subtree.end());
+  // the rest of the tree keeps the quality it was built with
+  build_quality_.erase(build_quality_.begin() + node,
+                       build_quality_.begin() + old_end);
+  build_quality_.insert(build_quality_.begin() + node, subtree.size(), 0);
+  PrepareRefit(prim_leaf_offsets_.size() - 1);
+  for (int n = node; n < node + subtree.size(); ++n) {
+    Real area = nodes_[n].bounds.SurfaceArea();
+    build_quality_[n] = area > 0 ? costs_[n] / area : 0;
+  }
+
+  stats_.num_nodes = nodes_.size();
+  stats_.num_leaves = std::count_if(nodes_.begin(), nodes_.end(),
+                                    [](const Node &n) { return n.num_prims; });
+}
+
+Real Bvh::SahCost(int node) const {
+  const auto &n = nodes_[node];
+  Real area = n.bounds.SurfaceArea();
+  if (n.num_prims > 0) {
+    return area * n.num_prims;
+  }
+  return kTraversalCost * area + SahCost(node + 1) + SahCost(n.offset);
+}
+
+void Bvh::Compress() {
+  CompressedChild root{nodes_[0].bounds, 0, 0, 0};
+  if (nodes_[0].num_prims > 0) {
+    root = {nodes_[0].bounds, -1, nodes_[0].offset, nodes_[0].num_prims};
+  }
+  std::vector<int> prims;
+  prims.reserve(prim_indices_.size());
+  quantized_nodes_.reserve(nodes_.size() / 2 + 1);
+  CompressRecursive(root, prims);
+  quantized_nodes_.shrink_to_fit();
+  prim_indices_.swap(prims);
+  root_bounds_ = nodes_[0].bounds;
+  nodes_.clear();
+  nodes_.shrink_to_fit();
+}
+
+int Bvh::CompressRecursive(const CompressedChild &parent,
+                           std::vector<int> &prims) {
+  CompressedChild children[2];
+  if (parent.node >= 0 && nodes_[parent.node].num_prims == 0) {
+    int child_nodes[2] = {parent.node + 1, nodes_[parent.node].offset};
+    for (int i = 0; i < 2; ++i) {
+      const auto &child = nodes_[child_nodes[i]];
+      children[i] = child.num_prims > 0
+                        ? CompressedChild{child.bounds, -1, child.offset,
+                                          child.num_prims}
+                        : CompressedChild{child.bounds, child_nodes[i], 0, 0};
+    }
+  } else if (parent.num_prims < kInteriorChild) {
+    // a root with few primitives, the second child is left empty
+    children[0] = parent;
+    children[1] = {Bounds3(), -1, 0, 0};
+  } else {
+    int half = parent.num_prims / 2;
+    children[0] = {parent.bounds, -1, parent.begin, half};
+    children[1] = {parent.bounds, -1, parent.begin + half,
+                   parent.num_prims - half};
+  }
+
+  int index = quantized_nodes_.size();
+  quantized_nodes_.emplace_back();
+  QuantizedNode node;
+  const Bounds3 &bounds = parent.bounds;
+  for (int axis = 0; axis < 3; ++axis) {
+    // round the origin down and use the smallest cells covering the bounds
+    Real min = bounds.IsEmpty() ? 0 : bounds.min[axis];
+    Real max = bounds.IsEmpty() ? 0 : bounds.max[axis];
+    float origin = static_cast<float>(min);
+    if (origin > min) {
+      origin = std::nextafter(origin, -std::numeric_limits<float>::max());
+    }
+    int exponent = -126;
+    if (max > origin) {
+      std::frexp((max - origin) / 255, &exponent);
+      exponent = std::max(-126, std::min(127, exponent));
+    }
+    Real scale = std::ldexp(Real(1), exponent);
+    node.origin[axis] = origin;
+    node.exponent[axis] = exponent;
+    for (int i = 0; i < 2; ++i) {
+      if (children[i].bounds.IsEmpty()) {
+        node.lo[axis][i] = 255;
+        node.hi[axis][i] = 0;
+        continue;
+      }
+      Real lo = std::floor((children[i].bounds.min[axis] - origin) / scale);
+      Real hi = std::ceil((children[i].bounds.max[axis] - origin) / scale);
+      node.lo[axis][i] = std::max<Real>(0, std::min<Real>(255, lo));
+      node.hi[axis][i] = std::max<Real>(0, std::min<Real>(255, hi));
+    }
+  }
+  int num_prims[2];
+  for (int i = 0; i < 2; ++i) {
+    num_prims[i] = children[i].IsLeaf() ? children[i].num_prims
+                                        : kInteriorChild;
+  }
+  node.num_prims = num_prims[0] | num_prims[1] << 4;
+  // the primitives of the leaves are stored before descending so the ones
+  // of two sibling leaves are contiguous
+  node.offset = prims.size();
+  for (const auto &child : children) {
+    if (child.IsLeaf()) {
+      prims.insert(prims.end(), &prim_indices_[child.begin],
+                   &prim_indices_[child.begin] + child.num_prims);
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (!children[i].IsLeaf()) {
+      int child = CompressRecursive(children[i], prims);
+      if (i == 1 && num_prims[0] == kInteriorChild) {
+        node.offset = child;
+      }
+    }
+  }
+  quantized_nodes_[index] = node;
+  return index;
+}
+
+template <int N>
+void Bvh::Collapse(std::vector<WideNode<N>> &wide_nodes) {
+  wide_nodes.reserve(nodes_.size() / (N - 1) + 1);
+  CollapseRecursive(0, wide_nodes);
+  wide_nodes.shrink_to_fit();
+  root_bounds_ = nodes_[0].bounds;
+  if (!options_.keep_binary) {
+    nodes_.clear();
+    nodes_.shrink_to_fit();
+  }
+}
+
+template <int N>
+int Bvh::CollapseRecursive(int node, std::vector<WideNode<N>> &wide_nodes) {
+  int children[N];
+  int num_children = 0;
+  if (nodes_[node].num_prims > 0) {
+    // a root with few primitives
+    children[num_children++] = node;
+  } else {
+    children[num_children++] = node + 1;
+    children[num_children++] = nodes_[node].offset;
+  }
+  // open the interior child with the largest area until the node is full
+  while (num_children < N) {
+    int largest = -1;
+    Real largest_area = -1;
+    for (int i = 0; i < num_children; ++i) {
+      const auto &child = nodes_[children[i]];
+      Real area = child.bounds.SurfaceArea();
+      if (child.num_prims == 0 && area > largest_area) {
+        largest = i;
+        largest_area = area;
+      }
+    }
+    if (largest < 0) {
+      break;
+    }
+    int opened = children[largest];
+    children[largest] = opened + 1;
+    children[num_children++] = nodes_[opened].offset;
+  }
+
+  int index = wide_nodes.size();
+  wide_nodes.emplace_back();
+  WideNode<N> wide_node;
+  for (int i = 0; i < N; ++i) {
+    Bounds3 bounds = i < num_children ? nodes_[children[i]].bounds : Bounds3();
+    for (int axis = 0; axis < 3; ++axis) {
+      float min = bounds.min[axis];
+      float max = bounds.max[axis];
+      if (min > bounds.min[axis]) {
+        min = std::nextafter(min, -std::numeric_limits<float>::infinity());
+      }
+      if (max < bounds.max[axis]) {
+        max = std::nextafter(max, std::numeric_limits<float>::infinity());
+      }
+      wide_node.min[axis][i] = min;
+      wide_node.max[axis][i] = max;
+    }
+    wide_node.offset[i] = 0;
+    wide_node.num_prims[i] = 0;
+    if (i >= num_children) {
+      continue;
+    }
+    const auto &child = nodes_[children[i]];
+    if (child.num_prims > 0) {
+      wide_node.offset[i] = child.offset;
+      wide_node.num_prims[i] = child.num_prims;
+    } else {
+      wide_node.offset[i] = CollapseRecursive(children[i], wide_nodes);
+    }
+  }
+  wide_nodes[index] = wide_node;
+  return index;
+}
@@ -1,5 +1,6 @@
 #define _USE_MATH_DEFINES
 #include "ren/disk.h"
+#include <algorithm>
 #include <cmath>
 #include "ren/plane.h"
 #include "ren/rng.h"
@@ -7,15 +8,52 @@
 using namespace ren;
 
 Disk::Disk(const Mat4 &local_to_world, Real radius)
-    : Shape(local_to_world), radius_(radius) {}
+    : Shape(local_to_world), radius_(radius), radius2_(radius * radius) {
+  UpdateTransform();
+}
+
+void Disk::set_local_to_world(const Mat4 &local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  UpdateTransform();
+}
+
+void Disk::UpdateTransform() {
+  origin_ = Vec3(local_to_world_[3]);
+  x_ = local_to_world_ * Vec4(1, 0, 0, 0);
+  normal_ = local_to_world_ * Vec4(0, 1, 0, 0);
+  z_ = local_to_world_ * Vec4(0, 0, 1, 0);
+}
 
 bool Disk::Intersect(const Ray &ray, Real &t, SurfaceDiff &surface_diff) {
-  Plane p(local_to_world_);
-  if (!p.Intersect(ray, t, surface_diff)) {
+  Real den = Dot(normal_, ray.direction());
+  if (std::abs(den) <= 0.0001) {
     return false;
   }
-  Vec3 origin(local_to_world_[3]);
-  return Length(origin - surface_diff.p) <= radius_;
+  Real t_plane = Dot(origin_ - ray.origin(), normal_) / den;
+  if (t_plane < 0 || t_plane >= ray.tmax()) {
+    return false;
+  }
+  auto p = ray.GetPoint(t_plane);
+  if (Length2(origin_ - p) > radius2_) {
+    return false;
+  }
+  t = t_plane;
+  surface_diff.p =
+      Plane::ProjectToSurface(p, origin_, normal_, surface_diff.p_error);
+  surface_diff.x = x_;
+  surface_diff.y = normal_;
+  surface_diff.z = z_;
+  return true;
+}
+
+bool Disk::Occluded(const Ray &ray) const {
+  Real den = Dot(normal_, ray.direction());
+  if (std::abs(den) <= 0.0001) {
+    return false;
+  }
+  Real t = Dot(origin_ - ray.origin(), normal_) / den;
+  return t >= 0 && t < ray.tmax() &&
+         Length2(origin_ - ray.GetPoint(t)) <= radius2_;
 }
 
 SurfaceDiff Disk::SamplePoint(Real &pdf) {
@@ -23,8 +61,9 @@ SurfaceDiff Disk::SamplePoint(Real &pdf) {
   Real theta = 2 * M_PI * rng::Uniform();
   Real r = radius_ * std::sqrt(rng::Uniform());
   pdf = 1 / Area();
-  surface.p = local_to_world_ *
-              Vec4(Vec3(r * std::cos(theta), 0, r * std::sin(theta)), 1);
+  surface.p = TransformPoint(
+      local_to_world_, Vec3(r * std::cos(theta), 0, r * std::sin(theta)),
+      Vec3(Gamma(2) * r), surface.p_error);
   surface.y = local_to_world_ * Vec4(0, 1, 0, 0);
   surface.x = Normalize(NormalTo(surface.y));
   surface.z = Cross(surface.x, surface.y);
@@ -33,4 +72,15 @@ SurfaceDiff Disk::SamplePoint(Real &pdf) {
 
 Real Disk::Area() const { return M_PI * radius_ * radius_; }
 
+Bounds3 Disk::WorldBound() const {
+  Vec3 origin(local_to_world_[3]);
+  Vec3 normal = Normalize(Vec3(local_to_world_ * Vec4(0, 1, 0, 0)));
+  Vec3 extent;
+  for (int i = 0; i < 3; ++i) {
+    extent[i] =
+        radius_ * std::sqrt(std::max(Real(0), 1 - normal[i] * normal[i]));
+  }
+  return Bounds3(origin - extent, origin + extent);
+}
+
 Real Disk::Pdf() const { return 1 / Area(); }
@@ -0,0 +1,220 @@
+#define _USE_MATH_DEFINES
+#include "ren/disk_pool.h"
+#include <algorithm>
+#include <cmath>
+#include "ren/lanes.h"
+#include "ren/plane.h"
+#include "ren/rng.h"
+
+using namespace ren;
+
+namespace {
+const int kLanes = kSimdLanes;
+// rays closer than this to the plane of a disk miss it, like Disk
+const Real kMinCosine = 0.0001;
+}  // namespace
+
+DiskPool::DiskPool(const Mat4 &local_to_world,
+                   const std::vector<Vec3> &centers,
+                   const std::vector<Vec3> &normals,
+                   const std::vector<Real> &radii, const BvhOptions &options)
+    : Shape(local_to_world) {
+  std::vector<Bounds3> bounds;
+  bounds.reserve(centers.size());
+  for (int i = 0; i < centers.size(); ++i) {
+    auto normal = Normalize(normals[i]);
+    Vec3 extent;
+    for (int axis = 0; axis < 3; ++axis) {
+      extent[axis] = radii[i] * std::sqrt(std::max(
+                                    Real(0), 1 - normal[axis] * normal[axis]));
+    }
+    bounds.emplace_back(centers[i] - extent, centers[i] + extent);
+  }
+  // a grid would reference some disks several times, unlike the hierarchy
+  BvhOptions pool_options(options);
+  pool_options.grid_levels = 0;
+  bvh_ = Bvh(bounds, pool_options);
+  // store the disks in the order of the leaves, every disk is referenced once
+  // so the references are then the disks themselves
+  const auto &prims = bvh_.prim_indices();
+  std::vector<int> old_to_new(centers.size());
+  for (int axis = 0; axis < 3; ++axis) {
+    lane_centers_[axis].assign(centers.size() + kLanes, 0);
+    lane_normals_[axis].assign(centers.size() + kLanes, 0);
+  }
+  // the padding has a negative radius, which fails the test
+  lane_radii_.assign(centers.size() + kLanes, -1);
+  Real area = 0;
+  for (int i = 0; i < centers.size(); ++i) {
+    int disk = prims[i];
+    old_to_new[disk] = i;
+    centers_.push_back(centers[disk]);
+    normals_.push_back(Normalize(normals[disk]));
+    radii_.push_back(radii[disk]);
+    for (int axis = 0; axis < 3; ++axis) {
+      lane_centers_[axis][i] = centers_[i][axis];
+      lane_normals_[axis][i] = normals_[i][axis];
+    }
+    lane_radii_[i] = radii_[i];
+    area += M_PI * radii_[i] * radii_[i];
+    cdf_.push_back(area);
+  }
+  bvh_.RemapPrims(old_to_new);
+  UpdateTransform();
+}
+
+void DiskPool::set_local_to_world(const Mat4 &local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  UpdateTransform();
+}
+
+void DiskPool::UpdateTransform() {
+  identity_ = IsIdentity(local_to_world_);
+  Real local_area = cdf_.empty() ? 0 : cdf_.back();
+  if (identity_ || bvh_.empty()) {
+    area_ = local_area;
+    world_bound_ = bvh_.empty() ? Bounds3() : bvh_.bounds();
+    return;
+  }
+  area_ = local_area *
+          std::pow(LinearDeterminant(local_to_world_), 2.0 / 3.0);
+  world_bound_ = TransformBounds(local_to_world_, bvh_.bounds());
+}
+
+bool DiskPool::Intersect(const Ray &ray, Real &t, SurfaceDiff &surface_diff) {
+  // the direction isn't normalized after the transform so distances along
+  // the ray are the same in both spaces
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  LaneRay lane_ray(r);
+  int disk = -1;
+  bvh_.IntersectLeaves(r, [&](int begin, int end, Ray &r) {
+    bool hit = false;
+    for (int i = begin; i < end; i += kLanes) {
+      int candidates = IntersectLanes(lane_ray, i, r.tmax()) &
+                       ((1 << std::min(end - i, kLanes)) - 1);
+      for (int j = 0; candidates >> j != 0; ++j) {
+        Real t_disk;
+        if ((candidates >> j & 1) && Intersect(r, i + j, t_disk)) {
+          r.set_tmax(t_disk);
+          disk = i + j;
+          hit = true;
+        }
+      }
+    }
+    return hit;
+  });
+  if (disk < 0) {
+    return false;
+  }
+  // the shading frame is only computed for the closest disk
+  t = r.tmax();
+  Vec3 error;
+  auto p = Plane::ProjectToSurface(r.GetPoint(t), centers_[disk],
+                                   normals_[disk], error);
+  surface_diff = GetSurfaceDiff(disk, p, error);
+  return true;
+}
+
+bool DiskPool::Occluded(const Ray &ray) const {
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  LaneRay lane_ray(r);
+  return bvh_.OccludedLeaves(r, [&](int begin, int end) {
+    for (int i = begin; i < end; i += kLanes) {
+      int candidates = IntersectLanes(lane_ray, i, r.tmax()) &
+                       ((1 << std::min(end - i, kLanes)) - 1);
+      for (int j = 0; candidates >> j != 0; ++j) {
+        Real t;
+        if ((candidates >> j & 1) && Intersect(r, i + j, t)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  });
+}
+
+SurfaceDiff DiskPool::SamplePoint(Real &pdf) {
+  int disk = std::upper_bound(cdf_.begin(), cdf_.end(),
+                              rng::Uniform() * cdf_.back()) -
+             cdf_.begin();
+  disk = std::min(disk, size() - 1);
+  Real theta = 2 * M_PI * rng::Uniform();
+  Real r = radii_[disk] * std::sqrt(rng::Uniform());
+  auto x = Normalize(NormalTo(normals_[disk]));
+  auto z = Cross(x, normals_[disk]);
+  Vec3 p = centers_[disk] + x * (r * std::cos(theta)) +
+           z * (r * std::sin(theta));
+  pdf = 1 / area_;
+  return GetSurfaceDiff(disk, p, Gamma(5) * (Abs(centers_[disk]) + r));
+}
+
+Real DiskPool::Area() const { return area_; }
+
+Bounds3 DiskPool::WorldBound() const { return world_bound_; }
+
+int DiskPool::size() const { return centers_.size(); }
+
+const BvhStats &DiskPool::bvh_stats() const { return bvh_.stats(); }
+
+int DiskPool::IntersectLanes(const LaneRay &ray, int begin, Real tmax) const {
+  Lanes oc[3];
+  Lanes normal[3];
+  auto center_norm = Lanes(0.0f);
+  for (int axis = 0; axis < 3; ++axis) {
+    auto center = Lanes::Load(&lane_centers_[axis][begin]);
+    normal[axis] = Lanes::Load(&lane_normals_[axis][begin]);
+    oc[axis] = center - ray.origin[axis];
+    center_norm = center_norm + Abs(center);
+  }
+  auto den = normal[0] * ray.dir[0] + normal[1] * ray.dir[1] +
+             normal[2] * ray.dir[2];
+  auto inv_den = Lanes(1.0f) / den;
+  auto t = (normal[0] * oc[0] + normal[1] * oc[1] + normal[2] * oc[2]) *
+           inv_den;
+  Lanes p[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    p[axis] = t * ray.dir[axis] - oc[axis];
+  }
+  auto distance2 = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+  auto radius = Lanes::Load(&lane_radii_[begin]);
+  // the rounding of the coordinates moves the center relative to the origin
+  // by up to kLaneEpsilon times their magnitude, which moves the distance to
+  // the plane by as much times the L1 norm of the unit normal, at most 2,
+  // over the cosine, and the point on the plane by that times the direction
+  auto error = Lanes(kLaneEpsilon) * (ray.origin_norm + center_norm + radius);
+  auto t_error = Lanes(2.0f) * error * Abs(inv_den);
+  auto reach = radius + Lanes(2.0f) * (error + t_error * ray.dir_norm);
+  return LessEqual(Lanes(0.0f), radius) &
+         LessEqual(Lanes(0.99f * kMinCosine), Abs(den)) &
+         LessEqual(distance2, reach * reach) &
+         LessEqual(Lanes(0.0f) - t_error - t_error, t) &
+         LessEqual(t, Lanes(static_cast<float>(tmax)) + t_error + t_error);
+}
+
+bool DiskPool::Intersect(const Ray &ray, int i, Real &t) const {
+  // same test as Disk
+  Real den = Dot(normals_[i], ray.direction());
+  if (std::abs(den) <= kMinCosine) {
+    return false;
+  }
+  t = Dot(centers_[i] - ray.origin(), normals_[i]) / den;
+  return t >= 0 && t < ray.tmax() &&
+         Length2(centers_[i] - ray.GetPoint(t)) <= radii_[i] * radii_[i];
+}
+
+SurfaceDiff DiskPool::GetSurfaceDiff(int i, const Vec3 &p,
+                                     const Vec3 &p_error) const {
+  Vec3 normal = normals_[i];
+  SurfaceDiff surface_diff;
+  surface_diff.p = p;
+  surface_diff.p_error = p_error;
+  if (!identity_) {
+    normal = Normalize(Vec3(local_to_world_ * Vec4(normal, 0)));
+    surface_diff.p =
+        TransformPoint(local_to_world_, p, p_error, surface_diff.p_error);
+  }
+  surface_diff.y = normal;
+  surface_diff.x = Normalize(NormalTo(normal));
+  surface_diff.z = Cross(surface_diff.x, normal);
+  return surface_diff;
+}
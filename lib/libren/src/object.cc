@@ -16,6 +16,29 @@ bool Object::Intersect(const Ray& ray, Real& t, SurfaceDiff& surface_diff) {
   return false;
 }
 
+int Object::Intersect(RayPacket& packet, int rays,
+                      SurfaceDiff surface_diffs[]) {
+  int hits = shape_->Intersect(packet, rays, surface_diffs);
+  for (int i = 0; i < packet.size(); ++i) {
+    if (hits >> i & 1) {
+      surface_diffs[i].o = this;
+    }
+  }
+  return hits;
+}
+
+bool Object::Occluded(const Ray& ray) const {
+  return shape_->Occluded(ray);
+}
+
+Bounds3 Object::WorldBound() const { return shape_->WorldBound(); }
+
+void Object::set_local_to_world(const Mat4& local_to_world) {
+  shape_->set_local_to_world(local_to_world);
+}
+
+const Shape& Object::shape() const { return *shape_; }
+
 const Bsdf& Object::bsdf() const { return *bsdf_; }
 
 const AreaLight* Object::area_light() const { return area_light_; }
@@ -0,0 +1,431 @@
+#include "ren/out_of_core_mesh.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include "ren/lanes.h"
+#include "ren/rng.h"
+
+using namespace ren;
+
+namespace {
+const char kMagic[8] = "renmesh";
+// the layout of the file, bumped along with Bvh::kSerializeVersion since
+// the blocks hold hierarchies
+const uint32_t kVersion = 2;
+// the blocks of the clusters start on page boundaries so that their pages can
+// be released one cluster at a time
+const std::size_t kBlockAlignment = 4096;
+
+// The file starts with this header followed by a directory entry per cluster.
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  // sizeof(Real) of the build that wrote the file
+  uint32_t real_size;
+  uint64_t num_clusters;
+};
+
+struct DirectoryEntry {
+  Bounds3 bounds;
+  // the block of the cluster: the vertices, the indices and the hierarchy
+  uint64_t offset;
+  uint64_t size;
+  // the bytes the cluster takes in memory once read
+  uint64_t bytes;
+  int32_t num_vertices;
+  int32_t num_triangles;
+  Real area;
+};
+
+// Split the triangles [begin, end) at the median of their centroids along
+// the longest axis of their extent until at most cluster_size remain.
+// @param clusters the ranges of the clusters, in the order of the splits
+void SplitClusters(const std::vector<Vec3> &centroids, int begin, int end,
+                   int cluster_size, std::vector<int> &triangles,
+                   std::vector<std::pair<int, int>> &clusters) {
+  if (end - begin <= cluster_size) {
+    clusters.emplace_back(begin, end);
+    return;
+  }
+  Bounds3 bounds;
+  for (int i = begin; i < end; ++i) {
+    bounds.Expand(centroids[triangles[i]]);
+  }
+  auto extent = bounds.Diagonal();
+  int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                 : (extent.y > extent.z ? 1 : 2);
+  int mid = begin + (end - begin) / 2;
+  std::nth_element(&triangles[begin], &triangles[mid], &triangles[0] + end,
+                   [&centroids, axis](int a, int b) {
+                     return centroids[a][axis] < centroids[b][axis];
+                   });
+  SplitClusters(centroids, begin, mid, cluster_size, triangles, clusters);
+  SplitClusters(centroids, mid, end, cluster_size, triangles, clusters);
+}
+}  // namespace
+
+std::ostream &ren::operator<<(std::ostream &os, const OutOfCoreStats &stats) {
+  os << stats.requests << " requests, " << stats.hits << " hits ("
+     << (stats.requests > 0 ? 100.0 * stats.hits / stats.requests : 0)
+     << "%), " << stats.faults << " faults, " << stats.evictions
+     << " evictions, " << stats.resident_bytes / 1E6 << " MB resident ("
+     << stats.peak_resident_bytes / 1E6 << " MB at the most)";
+  return os;
+}
+
+void OutOfCoreMesh::Write(const std::string &path,
+                          const std::vector<Vec3> &vertices,
+                          const std::vector<int> &indices, int cluster_size,
+                          const BvhOptions &options) {
+  int num_triangles = indices.size() / 3;
+  std::vector<Vec3> centroids;
+  centroids.reserve(num_triangles);
+  for (int i = 0; i < indices.size(); i += 3) {
+    centroids.push_back((vertices[indices[i]] + vertices[indices[i + 1]] +
+                         vertices[indices[i + 2]]) /
+                        3);
+  }
+  std::vector<int> triangles(num_triangles);
+  std::iota(triangles.begin(), triangles.end(), 0);
+  std::vector<std::pair<int, int>> ranges;
+  if (num_triangles > 0) {
+    SplitClusters(centroids, 0, num_triangles, std::max(1, cluster_size),
+                  triangles, ranges);
+  }
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::runtime_error("Can't write the mesh file \"" + path + "\"");
+  }
+  FileHeader header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.real_size = sizeof(Real);
+  header.num_clusters = ranges.size();
+  std::vector<DirectoryEntry> directory(ranges.size());
+  std::size_t offset =
+      sizeof(FileHeader) + directory.size() * sizeof(DirectoryEntry);
+  file.seekp(offset);
+  // the vertices of the mesh renumbered within the cluster being written
+  std::vector<int> local_index(vertices.size(), -1);
+  for (int c = 0; c < ranges.size(); ++c) {
+    std::vector<Vec3> local_vertices;
+    std::vector<int> local_indices;
+    for (int i = ranges[c].first; i < ranges[c].second; ++i) {
+      for (int k = 0; k < 3; ++k) {
+        int vertex = indices[3 * triangles[i] + k];
+        if (local_index[vertex] < 0) {
+          local_index[vertex] = local_vertices.size();
+          local_vertices.push_back(vertices[vertex]);
+        }
+        local_indices.push_back(local_index[vertex]);
+      }
+    }
+    for (int i = ranges[c].first; i < ranges[c].second; ++i) {
+      for (int k = 0; k < 3; ++k) {
+        local_index[indices[3 * triangles[i] + k]] = -1;
+      }
+    }
+    TriangleMeshData data(local_vertices, local_indices, options);
+    std::vector<char> bvh(data.bvh().Serialize(nullptr));
+    data.bvh().Serialize(bvh.data());
+    offset = (offset + kBlockAlignment - 1) / kBlockAlignment *
+             kBlockAlignment;
+    file.seekp(offset);
+    file.write(reinterpret_cast<const char *>(data.vertices().data()),
+               data.vertices().size() * sizeof(Vec3));
+    file.write(reinterpret_cast<const char *>(data.indices().data()),
+               data.indices().size() * sizeof(int));
+    file.write(bvh.data(), bvh.size());
+    auto &entry = directory[c];
+    entry.bounds = data.bounds();
+    entry.offset = offset;
+    entry.size = data.vertices().size() * sizeof(Vec3) +
+                 data.indices().size() * sizeof(int) + bvh.size();
+    entry.bytes = data.MemoryUsage();
+    entry.num_vertices = data.vertices().size();
+    entry.num_triangles = data.indices().size() / 3;
+    entry.area = data.Area();
+    offset += entry.size;
+  }
+  file.seekp(0);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(directory.data()),
+             directory.size() * sizeof(DirectoryEntry));
+  if (!file) {
+    throw std::runtime_error("Can't write the mesh file \"" + path + "\"");
+  }
+}
+
+OutOfCoreMesh::OutOfCoreMesh(const Mat4 &local_to_world,
+                             const std::string &path, std::size_t budget)
+    : Shape(local_to_world),
+      fd_(-1),
+      map_(nullptr),
+      map_size_(0),
+      clock_(0),
+      requests_(0),
+      hits_(0),
+      budget_(budget),
+      total_bytes_(0) {
+  fd_ = open(path.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd_ < 0 || fstat(fd_, &file_stat) != 0) {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    throw std::runtime_error("Can't read the mesh file \"" + path + "\"");
+  }
+  map_size_ = file_stat.st_size;
+  FileHeader header;
+  if (map_size_ >= sizeof(header)) {
+    void *map = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    map_ = map == MAP_FAILED ? nullptr : static_cast<const char *>(map);
+  }
+  if (map_) {
+    std::memcpy(&header, map_, sizeof(header));
+  }
+  if (!map_ || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion || header.real_size != sizeof(Real) ||
+      sizeof(header) + header.num_clusters * sizeof(DirectoryEntry) >
+          map_size_) {
+    if (map_) {
+      munmap(const_cast<char *>(map_), map_size_);
+    }
+    close(fd_);
+    throw std::runtime_error("\"" + path +
+                             "\" isn't a mesh file written by this build");
+  }
+  std::vector<Bounds3> bounds;
+  Real area = 0;
+  for (int i = 0; i < header.num_clusters; ++i) {
+    DirectoryEntry entry;
+    std::memcpy(&entry, map_ + sizeof(header) + i * sizeof(entry),
+                sizeof(entry));
+    // the block must hold the vertices and indices it claims, within the
+    // mapping
+    if (entry.num_vertices < 0 || entry.num_triangles < 0 ||
+        entry.offset > map_size_ || entry.size > map_size_ - entry.offset ||
+        entry.size < entry.num_vertices * sizeof(Vec3) +
+                         3 * std::size_t(entry.num_triangles) * sizeof(int)) {
+      munmap(const_cast<char *>(map_), map_size_);
+      close(fd_);
+      throw std::runtime_error("\"" + path + "\" is corrupt");
+    }
+    Cluster cluster;
+    cluster.bounds = entry.bounds;
+    cluster.offset = entry.offset;
+    cluster.size = entry.size;
+    cluster.num_vertices = entry.num_vertices;
+    cluster.num_triangles = entry.num_triangles;
+    cluster.bytes = entry.bytes;
+    cluster.area = entry.area;
+    clusters_.push_back(cluster);
+    bounds.push_back(entry.bounds);
+    total_bytes_ += entry.bytes;
+    area += entry.area;
+    cdf_.push_back(area);
+  }
+  last_use_.reset(new std::atomic<long long>[clusters_.size()]);
+  for (int i = 0; i < clusters_.size(); ++i) {
+    last_use_[i] = 0;
+  }
+  bvh_ = Bvh(bounds);
+  UpdateTransform();
+}
+
+OutOfCoreMesh::~OutOfCoreMesh() {
+  munmap(const_cast<char *>(map_), map_size_);
+  close(fd_);
+}
+
+void OutOfCoreMesh::set_local_to_world(const Mat4 &local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  UpdateTransform();
+}
+
+void OutOfCoreMesh::UpdateTransform() {
+  identity_ = IsIdentity(local_to_world_);
+  Real local_area = cdf_.empty() ? 0 : cdf_.back();
+  if (identity_ || bvh_.empty()) {
+    area_ = local_area;
+    world_bound_ = bvh_.empty() ? Bounds3() : bvh_.bounds();
+    return;
+  }
+  area_ = local_area *
+          std::pow(LinearDeterminant(local_to_world_), 2.0 / 3.0);
+  world_bound_ = TransformBounds(local_to_world_, bvh_.bounds());
+}
+
+bool OutOfCoreMesh::Intersect(const Ray &ray, Real &t,
+                              SurfaceDiff &surface_diff) {
+  // the direction isn't normalized after the transform so distances along
+  // the ray are the same in both spaces
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  std::shared_ptr<const TriangleMeshData> hit_data;
+  int triangle = -1;
+  Vec3 barycentrics;
+  // the clusters are visited front to back so those behind the closest hit
+  // found so far aren't paged in
+  bvh_.Intersect(r, [&](int cluster, Ray &r) {
+    auto data = Acquire(cluster);
+    int hit = data->Intersect(r, barycentrics);
+    if (hit < 0) {
+      return false;
+    }
+    hit_data = std::move(data);
+    triangle = hit;
+    return true;
+  });
+  if (!hit_data) {
+    return false;
+  }
+  t = r.tmax();
+  Vec3 error;
+  auto p = hit_data->Interpolate(triangle, barycentrics, error);
+  SetSurfaceDiff(*hit_data, triangle, p, error, surface_diff);
+  return true;
+}
+
+bool OutOfCoreMesh::Occluded(const Ray &ray) const {
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  return bvh_.Occluded(
+      r, [this, &r](int cluster) { return Acquire(cluster)->Occluded(r); });
+}
+
+SurfaceDiff OutOfCoreMesh::SamplePoint(Real &pdf) {
+  SurfaceDiff surface_diff;
+  if (clusters_.empty()) {
+    pdf = 0;
+    return surface_diff;
+  }
+  int cluster = std::upper_bound(cdf_.begin(), cdf_.end(),
+                                 rng::Uniform() * cdf_.back()) -
+                cdf_.begin();
+  cluster = std::min(cluster, num_clusters() - 1);
+  auto data = Acquire(cluster);
+  int triangle;
+  Vec3 error;
+  auto p = data->SamplePoint(triangle, error);
+  SetSurfaceDiff(*data, triangle, p, error, surface_diff);
+  pdf = 1 / area_;
+  return surface_diff;
+}
+
+Real OutOfCoreMesh::Area() const { return area_; }
+
+Bounds3 OutOfCoreMesh::WorldBound() const { return world_bound_; }
+
+int OutOfCoreMesh::num_clusters() const { return clusters_.size(); }
+
+std::size_t OutOfCoreMesh::total_bytes() const { return total_bytes_; }
+
+OutOfCoreStats OutOfCoreMesh::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto stats = stats_;
+  stats.requests = requests_;
+  stats.hits = hits_;
+  return stats;
+}
+
+void OutOfCoreMesh::ResetStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  OutOfCoreStats stats;
+  stats.resident_bytes = stats_.resident_bytes;
+  stats.peak_resident_bytes = stats_.resident_bytes;
+  stats_ = stats;
+  requests_ = 0;
+  hits_ = 0;
+}
+
+std::shared_ptr<const TriangleMeshData> OutOfCoreMesh::Acquire(
+    int i) const {
+  auto &cluster = clusters_[i];
+  requests_.fetch_add(1, std::memory_order_relaxed);
+  last_use_[i].store(clock_.load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+  auto data = std::atomic_load(&cluster.data);
+  if (data) {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return data;
+  }
+  // the cluster is read while holding the lock, so the threads needing the
+  // same cluster wait for it instead of reading it again
+  std::lock_guard<std::mutex> lock(mutex_);
+  data = std::atomic_load(&cluster.data);
+  if (data) {
+    // paged in by another thread meanwhile
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return data;
+  }
+  ++stats_.faults;
+  data = Read(cluster);
+  std::atomic_store(&cluster.data, data);
+  last_use_[i] = ++clock_;
+  stats_.resident_bytes += cluster.bytes;
+  // the cluster just read joins the resident ones after the evictions, so
+  // it isn't evicted itself
+  while (stats_.resident_bytes > budget_ && !resident_.empty()) {
+    auto victim = std::min_element(
+        resident_.begin(), resident_.end(),
+        [this](int a, int b) { return last_use_[a] < last_use_[b]; });
+    auto &evicted = clusters_[*victim];
+    std::atomic_store(&evicted.data,
+                      std::shared_ptr<const TriangleMeshData>());
+    stats_.resident_bytes -= evicted.bytes;
+    *victim = resident_.back();
+    resident_.pop_back();
+    ++stats_.evictions;
+  }
+  resident_.push_back(i);
+  stats_.peak_resident_bytes =
+      std::max(stats_.peak_resident_bytes, stats_.resident_bytes);
+  return data;
+}
+
+std::shared_ptr<const TriangleMeshData> OutOfCoreMesh::Read(
+    const Cluster &cluster) const {
+  const char *block = map_ + cluster.offset;
+  std::vector<Vec3> vertices(cluster.num_vertices);
+  std::vector<int> indices(3 * cluster.num_triangles);
+  std::memcpy(vertices.data(), block, vertices.size() * sizeof(Vec3));
+  block += vertices.size() * sizeof(Vec3);
+  std::memcpy(indices.data(), block, indices.size() * sizeof(int));
+  block += indices.size() * sizeof(int);
+  auto data = std::make_shared<const TriangleMeshData>(
+      std::move(vertices), std::move(indices), Bvh::Deserialize(block));
+  // the copy is what stays resident, the pages of the file are dropped and
+  // read again if the cluster is paged in later
+  madvise(const_cast<char *>(map_ + cluster.offset), cluster.size,
+          MADV_DONTNEED);
+  return data;
+}
+
+void OutOfCoreMesh::SetSurfaceDiff(const TriangleMeshData &data,
+                                   int triangle, const Vec3 &p,
+                                   const Vec3 &p_error,
+                                   SurfaceDiff &surface_diff) const {
+  Vec3 e1;
+  Vec3 e2;
+  data.Edges(triangle, e1, e2);
+  surface_diff.p = p;
+  surface_diff.p_error = p_error;
+  if (!identity_) {
+    e1 = local_to_world_ * Vec4(e1, 0);
+    e2 = local_to_world_ * Vec4(e2, 0);
+    surface_diff.p =
+        TransformPoint(local_to_world_, p, p_error, surface_diff.p_error);
+  }
+  surface_diff.x = Normalize(e1);
+  surface_diff.y = Normalize(Cross(surface_diff.x, Normalize(e2)));
+  surface_diff.z = Cross(surface_diff.x, surface_diff.y);
+}
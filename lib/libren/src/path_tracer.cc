@@ -1,56 +1,68 @@
 #include "ren/path_tracer.h"
 #include <algorithm>
 #include <iostream>
-#include <thread>
 #include "ren/rng.h"
 
 using namespace ren;
 
+namespace {
+// the number of samples of a pixel whose camera rays are traced together,
+// as many as a packet holds
+const int kSamplesPerPacket =
+    RayPacket::kMaxSize / PinholeCamera::kRaysPerSample;
+}  // namespace
+
 PathTracer::PathTracer(Scene *scene, PinholeCamera *camera, int spp)
     : scene_(scene), camera_(camera), spp_(spp) {}
 
 void PathTracer::Render() {
-  std::vector<std::thread> threads;
-  auto num_threads = std::thread::hardware_concurrency();
-  // num_threads = 1;
-  auto dy = camera_->film().image_height() / num_threads;
-  for (int i = 0; i < num_threads; ++i) {
-    int min_y = i * dy;
-    int max_y = (i + 1) * dy;
-    threads.push_back(
-        std::thread(&PathTracer::RenderRange, this, min_y, max_y));
-  }
-
-  for (auto &t : threads) {
-    t.join();
-  }
+  RenderTiles(camera_->film().image_height(), camera_->film().image_width(),
+              [this](const Tile &tile, int) { RenderTile(tile); });
   camera_->film().SaveAsPpm();
 }
 
-void PathTracer::RenderRange(int min_y, int max_y) {
-  for (int i = min_y; i < max_y; ++i) {
-    for (int j = 0; j < camera_->film().image_width(); ++j) {
-      // for (int i = 353; i < 377; ++i) {
-      //   for (int j = 312; j < 369; ++j) {
+void PathTracer::RenderTile(const Tile &tile) {
+  for (int i = tile.min_row; i < tile.max_row; ++i) {
+    for (int j = tile.min_col; j < tile.max_col; ++j) {
       Vec3 total;
-      for (int spp = 0; spp < spp_; ++spp) {
-        total += Li(i, j);
+      for (int spp = 0; spp < spp_; spp += kSamplesPerPacket) {
+        int samples = std::min(kSamplesPerPacket, spp_ - spp);
+        total += Li(i, j, spp, samples) * samples;
       }
       camera_->film().Colorize(i, j, total / spp_);
     }
   }
 }
 
-Vec3 PathTracer::Li(int i, int j) {
+Vec3 PathTracer::Li(int i, int j, int first_sample, int samples) {
   Vec3 total_rays;
-  auto rays = camera_->GenRays(i, j);
-  for (auto ray : rays) {
+  Ray rays[RayPacket::kMaxSize];
+  int num_rays = 0;
+  uint32_t pixel = i * camera_->film().image_width() + j;
+  for (int sample = 0; sample < samples; ++sample) {
+    rng::SetPath(rng::kCameraSample, pixel, first_sample + sample);
+    for (const auto &ray : camera_->GenRays(i, j)) {
+      rays[num_rays++] = ray;
+    }
+  }
+  // the camera rays are coherent until their first hit so they are traced
+  // together, the paths diverge afterwards and continue one ray at a time
+  RayPacket packet(rays, num_rays);
+  SurfaceDiff first_hits[RayPacket::kMaxSize];
+  int hits = scene_->Intersect(packet, first_hits);
+  for (int r = 0; r < packet.size(); ++r) {
+    // the paths of a pixel are numbered by sample, then by ray of the
+    // sample
+    rng::SetPath(rng::kCameraPath, pixel,
+                 first_sample * PinholeCamera::kRaysPerSample + r);
+    Ray ray = packet[r];
     Vec3 acc_geo_brdf(1);
     Vec3 total;
     bool previous_bounce_was_specular = false;
     for (int bounces = 0;; ++bounces) {
-      SurfaceDiff surface;
-      if (!scene_->Intersect(ray, surface)) {
+      rng::SetBounce(bounces);
+      SurfaceDiff surface = first_hits[r];
+      if (bounces == 0 ? !(hits >> r & 1) : !scene_->Intersect(ray, surface)) {
         break;
       }
       if ((bounces == 0 || previous_bounce_was_specular) &&
@@ -71,7 +83,7 @@ Vec3 PathTracer::Li(int i, int j) {
       }
       acc_geo_brdf *= brdf * std::abs(Dot(surface.y, sampled_wi)) / pdf;
       if (bounces > 4) {
-        Real end_probability = std::max(Real(0.1), 1.0 - MaxComp(acc_geo_brdf));
+        Real end_probability = std::max(Real(0.1), 1 - MaxComp(acc_geo_brdf));
         if (rng::Uniform() < end_probability) {
           break;
         }
@@ -79,10 +91,14 @@ Vec3 PathTracer::Li(int i, int j) {
       }
       previous_bounce_was_specular =
           surface.o->bsdf().type_ & Bsdf::Type::kSpecular;
-      auto push = Dot(surface.y, sampled_wi) < 0 ? -surface.y : surface.y;
-      ray = Ray(surface.p + 1E-4 * push, sampled_wi);
+      auto cone = ray.cone().Scatter(Length(surface.p - ray.origin()), pdf,
+                                     previous_bounce_was_specular);
+      ray = surface.SpawnRay(sampled_wi);
+      if (ray_cones_) {
+        ray.set_cone(cone);
+      }
     }
     total_rays += total;
   }
-  return total_rays / rays.size();
+  return total_rays / packet.size();
 }
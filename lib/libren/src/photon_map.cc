@@ -0,0 +1,66 @@
+#include "ren/photon_map.h"
+#include <cmath>
+
+using namespace ren;
+
+static_assert(sizeof(Photon) == 8, "Photon isn't packed in 8 bytes");
+
+namespace {
+// @return a coordinate in [-1, 1] quantized to 16 bits
+uint16_t QuantizeSnorm(Real v) {
+  v = std::min(Real(1), std::max(Real(-1), v));
+  return static_cast<uint16_t>(std::lround((v * 0.5 + 0.5) * 0xFFFF));
+}
+
+Real DequantizeSnorm(uint16_t v) { return v * (Real(2) / 0xFFFF) - 1; }
+
+Real Sign(Real v) { return v < 0 ? -1 : 1; }
+}  // namespace
+
+Photon::Photon(const Vec3 &weight, const Vec3 &direction) {
+  // the mantissa of the largest component takes the 8 bits, the others are
+  // scaled by the same exponent
+  Real largest = MaxComp(weight);
+  rgbe = 0;
+  if (largest > 1E-32) {
+    int exponent;
+    std::frexp(largest, &exponent);
+    Real scale = std::ldexp(Real(1), 8 - exponent);
+    for (int i = 0; i < 3; ++i) {
+      auto mantissa = std::lround(std::max(Real(0), weight[i]) * scale);
+      rgbe |= static_cast<uint32_t>(std::min(255L, mantissa)) << (8 * i);
+    }
+    rgbe |= static_cast<uint32_t>(exponent + 128) << 24;
+  }
+  // project the direction onto the octahedron |x| + |y| + |z| = 1 and
+  // unfold its lower half over the upper one
+  Vec3 d = direction / (std::abs(direction.x) + std::abs(direction.y) +
+                        std::abs(direction.z));
+  Real u = d.x;
+  Real v = d.y;
+  if (d.z < 0) {
+    u = (1 - std::abs(d.y)) * Sign(d.x);
+    v = (1 - std::abs(d.x)) * Sign(d.y);
+  }
+  octahedral_dir[0] = QuantizeSnorm(u);
+  octahedral_dir[1] = QuantizeSnorm(v);
+}
+
+Vec3 Photon::power() const {
+  if (rgbe == 0) {
+    return Vec3(0);
+  }
+  Real scale = std::ldexp(Real(1), static_cast<int>(rgbe >> 24) - 128 - 8);
+  return Vec3(rgbe & 0xFF, rgbe >> 8 & 0xFF, rgbe >> 16 & 0xFF) * scale;
+}
+
+Vec3 Photon::dir() const {
+  Real u = DequantizeSnorm(octahedral_dir[0]);
+  Real v = DequantizeSnorm(octahedral_dir[1]);
+  Vec3 d(u, v, 1 - std::abs(u) - std::abs(v));
+  if (d.z < 0) {
+    d.x = (1 - std::abs(v)) * Sign(u);
+    d.y = (1 - std::abs(u)) * Sign(v);
+  }
+  return Normalize(d);
+}
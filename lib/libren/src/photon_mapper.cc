@@ -1,7 +1,8 @@
 #define _USE_MATH_DEFINES
 #include "ren/photon_mapper.h"
+#include <algorithm>
+#include <atomic>
 #include <fstream>
-#include <thread>
 #include "ren/rng.h"
 #include "ren/sampling.h"
 #include "ren/scene.h"
@@ -9,6 +10,19 @@
 
 using namespace ren;
 
+namespace {
+// the number of samples of a pixel whose camera rays are traced together,
+// as many as a packet holds
+const int kSamplesPerPacket =
+    RayPacket::kMaxSize / PinholeCamera::kRaysPerSample;
+// the iterations of photon emission traced by a thread at a time
+const int kPhotonBatchSize = 1024;
+// the most batches of a round of photon emission per thread
+const int kMaxBatchesPerThread = 16;
+// the gather points of a tile whose photons are queried together
+const int kGatherBatchSize = 256;
+}  // namespace
+
 PhotonMapper::PhotonMapper(Scene *scene, PinholeCamera *camera, int spp,
                            int num_caustic_photons, int num_indirect_photons,
                            int num_neighbour_photons)
@@ -22,124 +36,273 @@ PhotonMapper::PhotonMapper(Scene *scene, PinholeCamera *camera, int spp,
 
 void PhotonMapper::Render() {
   auto photon_map = BuildPhotonMap(*scene_);
-  std::vector<std::thread> threads;
-  auto num_threads = std::thread::hardware_concurrency();
-  auto dy = camera_->film().image_height() / num_threads;
-  for (int i = 0; i < num_threads; ++i) {
-    int min_y = i * dy;
-    int max_y = (i + 1) * dy;
-    threads.push_back(std::thread(&PhotonMapper::RenderRange, this, min_y,
-                                  max_y, std::ref(photon_map)));
-  }
-  for (auto &t : threads) {
-    t.join();
+  // each NUMA node gathers from a copy of its own, if asked to
+  std::unique_ptr<NodeReplicas<PhotonMap>> replicas;
+  if (replicate_) {
+    replicas =
+        std::make_unique<NodeReplicas<PhotonMap>>(thread_pool(), photon_map);
   }
+  RenderTiles(camera_->film().image_height(), camera_->film().image_width(),
+              [&](const Tile &tile, int thread) {
+                RenderTile(tile, replicas ? replicas->Get(thread) : photon_map);
+              });
   camera_->film().SaveAsPpm();
 }
 
 PhotonMap PhotonMapper::BuildPhotonMap(const Scene &scene) {
   int num_caustic_photons_generated = 0;
   int num_indirect_photons_generated = 0;
-  int num_sampled_photons = 0;
+  int num_iterations = 0;
+  int num_lights = scene.lights().size();
   std::vector<Photon> caustic_photons;
   std::vector<Photon> indirect_photons;
+  std::vector<Vec3f> caustic_positions;
+  std::vector<Vec3f> indirect_positions;
   caustic_photons.reserve(num_caustic_photons_);
   indirect_photons.reserve(num_indirect_photons_ + num_caustic_photons_);
+  caustic_positions.reserve(num_caustic_photons_);
+  indirect_positions.reserve(num_indirect_photons_ + num_caustic_photons_);
   bool has_any_specular_object = scene.AnyObjectWithBsdf(
       Bsdf::Type(Bsdf::Type::kSpecular | Bsdf::Type::kTransmissive));
   bool has_any_diffuse_object = scene.AnyObjectWithBsdf(
       Bsdf::Type(Bsdf::Type::kDiffuse | Bsdf::Type::kReflective));
-  while ((has_any_specular_object &&
-          num_caustic_photons_generated < num_caustic_photons_) ||
-         (has_any_diffuse_object &&
-          num_indirect_photons_generated < num_indirect_photons_)) {
-    // TODO: this should be changed later on if multiple lights is to
-    // be taken into account; sampling lights based on the emitted
-    // power should be enough
-    for (const auto &light : scene.lights()) {
-      Real pdf_dir;
-      Real pdf_point;
-      Vec3 acc(1);
-      SurfaceDiff sampled_point;
-      Vec3 dir;
-      auto le = light->SampleLe(sampled_point, dir, pdf_point, pdf_dir);
-      ++num_sampled_photons;
-      acc = le * Dot(sampled_point.y, dir) / pdf_dir / pdf_point;
-      Ray ray(sampled_point.p + 1E-4 * sampled_point.y, dir);
-      int bounces = 0;
-      bool previous_bounce_was_specular = false;
-      for (;;) {
-        SurfaceDiff surface_diff;
-        if (!scene.Intersect(ray, surface_diff)) {
+  auto more_photons_needed = [&] {
+    return (has_any_specular_object &&
+            num_caustic_photons_generated < num_caustic_photons_) ||
+           (has_any_diffuse_object &&
+            num_indirect_photons_generated < num_indirect_photons_);
+  };
+  if (num_lights == 0) {
+    return PhotonMap(std::move(indirect_positions),
+                     std::move(indirect_photons), thread_pool());
+  }
+  // Every iteration emits a photon from each light. The iterations are
+  // traced in batches by the threads, each into a buffer of its own, and
+  // the buffers are then taken in order as if a single thread had traced
+  // them, stopping at the iteration that fills the budgets. The photons
+  // don't depend on the number of threads, and the budgets are exact.
+  auto &pool = thread_pool();
+  int num_batches = pool.num_threads();
+  // the candidates to caustic photons and all the photons found so far, to
+  // size the next round
+  long long num_caustic_candidates = 0;
+  long long num_candidates = 0;
+  while (more_photons_needed()) {
+    std::vector<Batch> batches(num_batches);
+    std::atomic<int> next_batch{0};
+    int first_iteration = num_iterations;
+    pool.Run([&](int) {
+      for (int b; (b = next_batch++) < num_batches;) {
+        auto &batch = batches[b];
+        int begin = first_iteration + b * kPhotonBatchSize;
+        for (int i = begin; i < begin + kPhotonBatchSize; ++i) {
+          for (int l = 0; l < num_lights; ++l) {
+            TracePhoton(scene, l, i, batch.photons);
+          }
+          batch.iteration_ends.push_back(batch.photons.size());
+        }
+      }
+    });
+    for (const auto &batch : batches) {
+      auto photon = batch.photons.begin();
+      for (int end : batch.iteration_ends) {
+        if (!more_photons_needed()) {
           break;
         }
-        ++bounces;
-        if (bounces > 1 &&
-            surface_diff.o->bsdf().type_ & Bsdf::Type::kDiffuse) {
-          Photon p(surface_diff.p, acc, -dir);
-          if (previous_bounce_was_specular &&
+        ++num_iterations;
+        for (; photon != batch.photons.begin() + end; ++photon) {
+          num_caustic_candidates += photon->caustic;
+          ++num_candidates;
+          if (photon->caustic &&
               num_caustic_photons_generated < num_caustic_photons_) {
             ++num_caustic_photons_generated;
-            caustic_photons.push_back(p);
+            caustic_photons.push_back(photon->photon);
+            caustic_positions.push_back(photon->pos);
           } else if (num_indirect_photons_generated < num_indirect_photons_) {
             ++num_indirect_photons_generated;
-            indirect_photons.push_back(p);
+            indirect_photons.push_back(photon->photon);
+            indirect_positions.push_back(photon->pos);
           }
         }
-        Vec3 new_dir;
-        Real pdf;
-        auto bsdf = surface_diff.o->bsdf().SampleF(surface_diff, -dir, new_dir,
-                                                   pdf, true);
-        if (pdf == 0 || IsZero(bsdf)) {
-          break;
-        }
-        previous_bounce_was_specular =
-            surface_diff.o->bsdf().type_ & Bsdf::Type::kSpecular;
-        auto cos_theta_o = Dot(new_dir, surface_diff.y);
-        auto acc_new = acc * bsdf * std::abs(cos_theta_o) / pdf;
-        auto push_dir = cos_theta_o < 0 ? -surface_diff.y : surface_diff.y;
-        ray = Ray(surface_diff.p + 1E-4 * push_dir, new_dir);
-        auto survival_probability =
-            std::min(Real(1), MaxComp(acc_new) / MaxComp(acc));
-        if (rng::Uniform() > survival_probability) {
-          break;
-        }
-        acc = acc_new / survival_probability;
       }
     }
+    // enough batches to fill the budgets at the rate seen so far, with some
+    // margin
+    double iterations = 0;
+    if (has_any_specular_object && num_caustic_candidates > 0) {
+      iterations = std::max(
+          iterations, double(num_caustic_photons_ -
+                             num_caustic_photons_generated) *
+                          num_iterations / num_caustic_candidates);
+    }
+    if (has_any_diffuse_object && num_candidates > 0) {
+      iterations = std::max(
+          iterations, double(num_indirect_photons_ -
+                             num_indirect_photons_generated) *
+                          num_iterations / num_candidates);
+    }
+    // a round holds its photons until they are merged, so it is capped to
+    // keep them a small fraction of the photon map
+    num_batches = std::max<int>(
+        pool.num_threads(),
+        std::min(1.1 * iterations / kPhotonBatchSize + 1,
+                 double(kMaxBatchesPerThread) * pool.num_threads()));
   }
-  num_sampled_photons_ = num_sampled_photons;
+  num_sampled_photons_ = num_iterations * num_lights;
   indirect_photons.insert(indirect_photons.end(), caustic_photons.begin(),
                           caustic_photons.end());
-  return PhotonMap(indirect_photons);
+  indirect_positions.insert(indirect_positions.end(),
+                            caustic_positions.begin(),
+                            caustic_positions.end());
+  caustic_photons = std::vector<Photon>();
+  caustic_positions = std::vector<Vec3f>();
+  return PhotonMap(std::move(indirect_positions), std::move(indirect_photons),
+                   pool);
 }
 
-void PhotonMapper::RenderRange(int min_y, int max_y,
-                               const PhotonMap &photon_map) {
-  std::vector<PhotonMap::QueryResult> query_results;
-  query_results.reserve(num_neighbour_photons_);
-  for (int i = min_y; i < max_y; ++i) {
-    for (int j = 0; j < camera_->film().image_width(); ++j) {
-      Vec3 total;
-      for (int spp = 0; spp < spp_; ++spp) {
-        total += Li(i, j, photon_map, query_results);
+void PhotonMapper::TracePhoton(const Scene &scene, int light,
+                               uint32_t iteration,
+                               std::vector<StoredPhoton> &photons) const {
+  // TODO: this should be changed later on if multiple lights is to
+  // be taken into account; sampling lights based on the emitted
+  // power should be enough
+  rng::SetPath(rng::kPhoton, iteration, light);
+  Real pdf_dir;
+  Real pdf_point;
+  Vec3 acc(1);
+  SurfaceDiff sampled_point;
+  Vec3 dir;
+  auto le =
+      scene.lights()[light]->SampleLe(sampled_point, dir, pdf_point, pdf_dir);
+  acc = le * Dot(sampled_point.y, dir) / pdf_dir / pdf_point;
+  Ray ray = sampled_point.SpawnRay(dir);
+  if (ray_cones_) {
+    // the photons leave the light like rays scattered by a diffuse
+    // surface
+    ray.set_cone(RayCone().Scatter(0, pdf_dir, false));
+  }
+  int bounces = 0;
+  bool previous_bounce_was_specular = false;
+  for (;;) {
+    rng::SetBounce(bounces + 1);
+    SurfaceDiff surface_diff;
+    if (!scene.Intersect(ray, surface_diff)) {
+      break;
+    }
+    ++bounces;
+    if (bounces > 1 && surface_diff.o->bsdf().type_ & Bsdf::Type::kDiffuse) {
+      const auto &p = surface_diff.p;
+      photons.push_back({Vec3f(p.x, p.y, p.z), Photon(acc, -dir),
+                         previous_bounce_was_specular});
+    }
+    Vec3 new_dir;
+    Real pdf;
+    auto bsdf =
+        surface_diff.o->bsdf().SampleF(surface_diff, -dir, new_dir, pdf, true);
+    if (pdf == 0 || IsZero(bsdf)) {
+      break;
+    }
+    previous_bounce_was_specular =
+        surface_diff.o->bsdf().type_ & Bsdf::Type::kSpecular;
+    auto cos_theta_o = Dot(new_dir, surface_diff.y);
+    auto acc_new = acc * bsdf * std::abs(cos_theta_o) / pdf;
+    auto cone = ray.cone().Scatter(Length(surface_diff.p - ray.origin()), pdf,
+                                   previous_bounce_was_specular);
+    ray = surface_diff.SpawnRay(new_dir);
+    if (ray_cones_) {
+      ray.set_cone(cone);
+    }
+    auto survival_probability =
+        std::min(Real(1), MaxComp(acc_new) / MaxComp(acc));
+    if (rng::Uniform() > survival_probability) {
+      break;
+    }
+    acc = acc_new / survival_probability;
+  }
+}
+
+void PhotonMapper::RenderTile(const Tile &tile, const PhotonMap &photon_map) {
+  int width = tile.max_col - tile.min_col;
+  std::vector<Vec3> radiance((tile.max_row - tile.min_row) * width);
+  GatherBatch batch;
+  for (int i = tile.min_row; i < tile.max_row; ++i) {
+    for (int j = tile.min_col; j < tile.max_col; ++j) {
+      int pixel = (i - tile.min_row) * width + j - tile.min_col;
+      for (int spp = 0; spp < spp_; spp += kSamplesPerPacket) {
+        int samples = std::min(kSamplesPerPacket, spp_ - spp);
+        radiance[pixel] += Li(i, j, spp, samples, pixel, batch.gather_points);
+        if (batch.gather_points.size() >= kGatherBatchSize) {
+          Gather(photon_map, batch, radiance);
+        }
       }
-      camera_->film().Colorize(i, j, total / Real(spp_));
     }
   }
+  Gather(photon_map, batch, radiance);
+  for (int i = tile.min_row; i < tile.max_row; ++i) {
+    for (int j = tile.min_col; j < tile.max_col; ++j) {
+      int pixel = (i - tile.min_row) * width + j - tile.min_col;
+      camera_->film().Colorize(i, j, radiance[pixel] / Real(spp_));
+    }
+  }
+}
+
+void PhotonMapper::Gather(const PhotonMap &photon_map, GatherBatch &batch,
+                          std::vector<Vec3> &radiance) const {
+  batch.points.clear();
+  for (const auto &gather_point : batch.gather_points) {
+    batch.points.push_back(gather_point.surface.p);
+  }
+  photon_map.QueryNearest(batch.points, num_neighbour_photons_,
+                          batch.results);
+  // added in the order of the paths, whatever the order of the queries
+  for (int g = 0; g < batch.gather_points.size(); ++g) {
+    const auto &gather_point = batch.gather_points[g];
+    const auto &surface = gather_point.surface;
+    const auto &query_results = batch.results[g];
+    Vec3 total_flux;
+    auto radius = query_results.front().distance2;
+    for (const auto &query_result : query_results) {
+      const auto &photon = photon_map[query_result.index];
+      total_flux += surface.o->bsdf().F(surface, gather_point.wo,
+                                        photon.dir()) *
+                    photon.power();
+    }
+    radiance[gather_point.pixel] += total_flux / 2.0 / M_PI / radius /
+                                    num_sampled_photons_ *
+                                    gather_point.weight;
+  }
+  batch.gather_points.clear();
 }
 
-Vec3 PhotonMapper::Li(int i, int j, const PhotonMap &photon_map,
-                      std::vector<PhotonMap::QueryResult> &query_results) {
+Vec3 PhotonMapper::Li(int i, int j, int first_sample, int samples,
+                      int tile_pixel, std::vector<GatherPoint> &gather_points) {
   Vec3 total_rays;
-  auto rays = camera_->GenRays(i, j);
-  for (auto ray : rays) {
+  Ray rays[RayPacket::kMaxSize];
+  int num_rays = 0;
+  uint32_t pixel = i * camera_->film().image_width() + j;
+  for (int sample = 0; sample < samples; ++sample) {
+    rng::SetPath(rng::kCameraSample, pixel, first_sample + sample);
+    for (const auto &ray : camera_->GenRays(i, j)) {
+      rays[num_rays++] = ray;
+    }
+  }
+  // the camera rays are traced together up to their first hit
+  RayPacket packet(rays, num_rays);
+  SurfaceDiff first_hits[RayPacket::kMaxSize];
+  int hits = scene_->Intersect(packet, first_hits);
+  for (int r = 0; r < packet.size(); ++r) {
+    // the paths of a pixel are numbered by sample, then by ray of the
+    // sample
+    rng::SetPath(rng::kCameraPath, pixel,
+                 first_sample * PinholeCamera::kRaysPerSample + r);
+    Ray ray = packet[r];
     Vec3 total;
     Vec3 throughput(1);
     bool previous_bounce_was_specular = false;
     for (int bounces = 0;; ++bounces) {
-      SurfaceDiff surface;
-      if (!scene_->Intersect(ray, surface)) {
+      rng::SetBounce(bounces);
+      SurfaceDiff surface = first_hits[r];
+      if (bounces == 0 ? !(hits >> r & 1) : !scene_->Intersect(ray, surface)) {
         break;
       }
       if ((bounces == 0 || previous_bounce_was_specular) &&
@@ -149,19 +312,11 @@ Vec3 PhotonMapper::Li(int i, int j, const PhotonMap &photon_map,
         total += surface.o->area_light()->L(surface_tmp, surface) * throughput;
       }
       if (surface.o->bsdf().type_ & Bsdf::Type::kDiffuse) {
-        photon_map.QueryNearest(surface.p, num_neighbour_photons_,
-                                query_results);
-        Vec3 total_flux;
-        auto radius = query_results.front().distance2;
-        for (const auto &query_result : query_results) {
-          total_flux += surface.o->bsdf().F(surface, -ray.direction(),
-                                            query_result.data.dir) *
-                        query_result.data.power;
-        }
         total += EstimateDirectRadiance(*scene_, surface, -ray.direction()) *
                  throughput;
-        total += total_flux / 2.0 / M_PI / radius / num_sampled_photons_ *
-                 throughput;
+        gather_points.push_back({surface, -ray.direction(),
+                                 throughput * samples / packet.size(),
+                                 tile_pixel});
         break;
       }
       total += EstimateDirectRadiance(*scene_, surface, -ray.direction()) *
@@ -175,12 +330,11 @@ Vec3 PhotonMapper::Li(int i, int j, const PhotonMap &photon_map,
       }
       auto cos_theta_i = Dot(surface.y, sampled_wi);
       throughput *= bsdf * std::abs(cos_theta_i) / pdf;
-      auto push_dir = cos_theta_i < 0 ? -surface.y : surface.y;
-      ray = Ray(surface.p + 1E-4 * push_dir, sampled_wi);
+      ray = surface.SpawnRay(sampled_wi);
       previous_bounce_was_specular =
           surface.o->bsdf().type_ & Bsdf::Type::kSpecular;
       if (bounces > 4) {
-        Real end_probability = std::max(Real(0.1), 1.0 - MaxComp(throughput));
+        Real end_probability = std::max(Real(0.1), 1 - MaxComp(throughput));
         if (rng::Uniform() < end_probability) {
           break;
         }
@@ -189,5 +343,5 @@ Vec3 PhotonMapper::Li(int i, int j, const PhotonMap &photon_map,
     }
     total_rays += total;
   }
-  return total_rays / rays.size();
+  return total_rays * samples / packet.size();
 }
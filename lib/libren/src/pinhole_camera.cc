@@ -1,4 +1,5 @@
 #include "ren/pinhole_camera.h"
+#include <cmath>
 #include <iostream>
 #include "ren/rng.h"
 #include "ren/transform.h"
@@ -24,7 +25,12 @@ Film &PinholeCamera::film() { return film_; }
 Ray PinholeCamera::GenRay(int row, int col) {
   Vec3 dir(top_left_film_ + d_x_ * col + d_y_ * row + offset_);
   dir = Normalize(dir);
-  return Ray(dir).Transform(camera_to_world_);
+  Ray ray(dir);
+  // the cone of the ray covers the pixel
+  RayCone cone;
+  cone.spread = std::abs(d_y_.y / top_left_film_.z);
+  ray.set_cone(cone);
+  return ray.Transform(camera_to_world_);
 }
 
 std::vector<Ray> PinholeCamera::GenRays(int row, int col) {
@@ -32,15 +38,19 @@ std::vector<Ray> PinholeCamera::GenRays(int row, int col) {
   auto new_dx = d_x_ / 2.0;
   auto new_dy = d_y_ / 2.0;
   std::vector<Vec3> samples;
-  for (int i = 0; i < 4; ++i) {
+  for (int i = 0; i < kRaysPerSample; ++i) {
     samples.emplace_back(rng::Uniform() * new_dx.x, rng::Uniform() * new_dy.y,
                          Real(0));
   }
   Vec3 dir(top_left_film_ + d_x_ * col + d_y_ * row);
+  // the cone of each ray covers a quarter of the pixel
+  RayCone cone;
+  cone.spread = std::abs(new_dy.y / top_left_film_.z);
   int sample = 0;
   for (int i = 0; i < 2; ++i) {
     for (int j = 0; j < 2; ++j) {
       Ray r(Normalize(dir + new_dx * j + new_dy * i + samples[sample]));
+      r.set_cone(cone);
       ++sample;
       rays.push_back(r.Transform(camera_to_world_));
     }
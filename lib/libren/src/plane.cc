@@ -1,4 +1,5 @@
 #include "ren/plane.h"
+#include <limits>
 #include "ren/vec.h"
 
 using namespace ren;
@@ -14,6 +15,14 @@ Plane::Plane(const Mat4& local_to_world)
       x_(local_to_world * Vec4(1, 0, 0, 0)),
       z_(local_to_world * Vec4(0, 0, 1, 0)) {}
 
+void Plane::set_local_to_world(const Mat4& local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  point_ = local_to_world * Vec4(kPoint, 1);
+  y_or_normal_ = local_to_world * Vec4(kNormal, 0);
+  x_ = local_to_world * Vec4(1, 0, 0, 0);
+  z_ = local_to_world * Vec4(0, 0, 1, 0);
+}
+
 Vec3 Plane::point() const { return point_; }
 
 Vec3 Plane::normal() const { return y_or_normal_; }
@@ -23,7 +32,8 @@ bool Plane::Intersect(const Ray& ray, Real& t, SurfaceDiff& surface_diff) {
   if (std::abs(den) > 0.0001) {
     t = Dot(point_ - ray.origin(), y_or_normal_) / den;
     if (t >= 0 && t < ray.tmax()) {
-      surface_diff.p = ray.GetPoint(t);
+      surface_diff.p = ProjectToSurface(ray.GetPoint(t), point_, y_or_normal_,
+                                        surface_diff.p_error);
       surface_diff.x = x_;
       surface_diff.y = y_or_normal_;
       surface_diff.z = z_;
@@ -34,6 +44,28 @@ bool Plane::Intersect(const Ray& ray, Real& t, SurfaceDiff& surface_diff) {
   return false;
 }
 
+bool Plane::Occluded(const Ray& ray) const {
+  Real den = Dot(y_or_normal_, ray.direction());
+  if (std::abs(den) > 0.0001) {
+    Real t = Dot(point_ - ray.origin(), y_or_normal_) / den;
+    return t >= 0 && t < ray.tmax();
+  }
+  return false;
+}
+
+Vec3 Plane::ProjectToSurface(const Vec3& p, const Vec3& point,
+                             const Vec3& normal, Vec3& error) {
+  auto projected =
+      p - (Dot(p - point, normal) / Dot(normal, normal)) * normal;
+  error = Gamma(7) * (Abs(projected) + Abs(point));
+  return projected;
+}
+
 SurfaceDiff Plane::SamplePoint(Real& pdf) { return SurfaceDiff(); }
 
 Real ren::Plane::Area() const { return 0.0f; }
+
+Bounds3 Plane::WorldBound() const {
+  return Bounds3(Vec3(-std::numeric_limits<Real>::infinity()),
+                 Vec3(std::numeric_limits<Real>::infinity()));
+}
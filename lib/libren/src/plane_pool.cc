@@ -0,0 +1,143 @@
+#include "ren/plane_pool.h"
+#include <algorithm>
+#include <limits>
+#include "ren/lanes.h"
+#include "ren/plane.h"
+
+using namespace ren;
+
+namespace {
+const int kLanes = kSimdLanes;
+// rays closer than this to a plane miss it, like Plane
+const Real kMinCosine = 0.0001;
+}  // namespace
+
+PlanePool::PlanePool(const Mat4 &local_to_world,
+                     const std::vector<Vec3> &points,
+                     const std::vector<Vec3> &normals)
+    : Shape(local_to_world), points_(points) {
+  for (int axis = 0; axis < 3; ++axis) {
+    // the padding has no normal, which fails the test
+    lane_points_[axis].assign(points.size() + kLanes, 0);
+    lane_normals_[axis].assign(points.size() + kLanes, 0);
+  }
+  for (int i = 0; i < points.size(); ++i) {
+    normals_.push_back(Normalize(normals[i]));
+    for (int axis = 0; axis < 3; ++axis) {
+      lane_points_[axis][i] = points_[i][axis];
+      lane_normals_[axis][i] = normals_[i][axis];
+    }
+  }
+  UpdateTransform();
+}
+
+void PlanePool::set_local_to_world(const Mat4 &local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  UpdateTransform();
+}
+
+void PlanePool::UpdateTransform() {
+  identity_ = IsIdentity(local_to_world_);
+}
+
+bool PlanePool::Intersect(const Ray &ray, Real &t,
+                          SurfaceDiff &surface_diff) {
+  // the direction isn't normalized after the transform so distances along
+  // the ray are the same in both spaces
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  LaneRay lane_ray(r);
+  int plane = -1;
+  for (int i = 0; i < size(); i += kLanes) {
+    int candidates = IntersectLanes(lane_ray, i, r.tmax()) &
+                     ((1 << std::min(size() - i, kLanes)) - 1);
+    for (int j = 0; candidates >> j != 0; ++j) {
+      Real t_plane;
+      if ((candidates >> j & 1) && Intersect(r, i + j, t_plane)) {
+        r.set_tmax(t_plane);
+        plane = i + j;
+      }
+    }
+  }
+  if (plane < 0) {
+    return false;
+  }
+  // the shading frame is only computed for the closest plane
+  t = r.tmax();
+  Vec3 normal = normals_[plane];
+  Vec3 error;
+  auto p = Plane::ProjectToSurface(r.GetPoint(t), points_[plane], normal,
+                                   error);
+  surface_diff.p = p;
+  surface_diff.p_error = error;
+  if (!identity_) {
+    normal = Normalize(Vec3(local_to_world_ * Vec4(normal, 0)));
+    surface_diff.p =
+        TransformPoint(local_to_world_, p, error, surface_diff.p_error);
+  }
+  surface_diff.y = normal;
+  surface_diff.x = Normalize(NormalTo(normal));
+  surface_diff.z = Cross(surface_diff.x, normal);
+  return true;
+}
+
+bool PlanePool::Occluded(const Ray &ray) const {
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  LaneRay lane_ray(r);
+  for (int i = 0; i < size(); i += kLanes) {
+    int candidates = IntersectLanes(lane_ray, i, r.tmax()) &
+                     ((1 << std::min(size() - i, kLanes)) - 1);
+    for (int j = 0; candidates >> j != 0; ++j) {
+      Real t;
+      if ((candidates >> j & 1) && Intersect(r, i + j, t)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+SurfaceDiff PlanePool::SamplePoint(Real &pdf) { return SurfaceDiff(); }
+
+Real PlanePool::Area() const { return 0.0; }
+
+Bounds3 PlanePool::WorldBound() const {
+  return Bounds3(Vec3(-std::numeric_limits<Real>::infinity()),
+                 Vec3(std::numeric_limits<Real>::infinity()));
+}
+
+int PlanePool::size() const { return points_.size(); }
+
+int PlanePool::IntersectLanes(const LaneRay &ray, int begin, Real tmax) const {
+  Lanes op[3];
+  Lanes normal[3];
+  auto point_norm = Lanes(0.0f);
+  for (int axis = 0; axis < 3; ++axis) {
+    auto point = Lanes::Load(&lane_points_[axis][begin]);
+    normal[axis] = Lanes::Load(&lane_normals_[axis][begin]);
+    op[axis] = point - ray.origin[axis];
+    point_norm = point_norm + Abs(point);
+  }
+  auto den = normal[0] * ray.dir[0] + normal[1] * ray.dir[1] +
+             normal[2] * ray.dir[2];
+  auto inv_den = Lanes(1.0f) / den;
+  auto t = (normal[0] * op[0] + normal[1] * op[1] + normal[2] * op[2]) *
+           inv_den;
+  // the rounding of the coordinates moves the point relative to the origin by
+  // up to kLaneEpsilon times their magnitude, which moves the distance to the
+  // plane by as much times the L1 norm of the unit normal over the cosine
+  auto t_error = Lanes(2 * kLaneEpsilon) * (ray.origin_norm + point_norm) *
+                 Abs(inv_den);
+  return LessEqual(Lanes(0.99f * kMinCosine), Abs(den)) &
+         LessEqual(Lanes(0.0f) - t_error - t_error, t) &
+         LessEqual(t, Lanes(static_cast<float>(tmax)) + t_error + t_error);
+}
+
+bool PlanePool::Intersect(const Ray &ray, int i, Real &t) const {
+  // same test as Plane
+  Real den = Dot(normals_[i], ray.direction());
+  if (std::abs(den) <= kMinCosine) {
+    return false;
+  }
+  t = Dot(points_[i] - ray.origin(), normals_[i]) / den;
+  return t >= 0 && t < ray.tmax();
+}
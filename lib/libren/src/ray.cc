@@ -1,8 +1,68 @@
+#define _USE_MATH_DEFINES
 #include "ren/ray.h"
+#include <algorithm>
 #include <cmath>
+#include <limits>
 
 using namespace ren;
 
+Vec3 ren::OffsetRayOrigin(const Vec3 &p, const Vec3 &p_error, const Vec3 &n,
+                          const Vec3 &w) {
+  // the distance along the normal to the farthest corner of the box of
+  // possible points
+  Real d = std::abs(n.x) * p_error.x + std::abs(n.y) * p_error.y +
+           std::abs(n.z) * p_error.z;
+  Vec3 offset = d * n;
+  if (Dot(w, n) < 0) {
+    offset = -offset;
+  }
+  Vec3 origin = p + offset;
+  // round away from p so that the sum can't fall back into the box
+  for (int i = 0; i < 3; ++i) {
+    if (offset[i] > 0) {
+      origin[i] =
+          std::nextafter(origin[i], std::numeric_limits<Real>::infinity());
+    } else if (offset[i] < 0) {
+      origin[i] =
+          std::nextafter(origin[i], -std::numeric_limits<Real>::infinity());
+    }
+  }
+  return origin;
+}
+
+Vec3 ren::TransformPoint(const Mat4 &m, const Vec3 &p, const Vec3 &p_error,
+                         Vec3 &error) {
+  Vec3 result;
+  for (int i = 0; i < 3; ++i) {
+    Real sum = m[3][i];
+    Real magnitude = std::abs(m[3][i]);
+    Real carried = 0;
+    for (int j = 0; j < 3; ++j) {
+      sum += m[j][i] * p[j];
+      magnitude += std::abs(m[j][i] * p[j]);
+      carried += std::abs(m[j][i]) * p_error[j];
+    }
+    result[i] = sum;
+    error[i] = Gamma(3) * magnitude + (1 + Gamma(3)) * carried;
+  }
+  return result;
+}
+
+RayCone RayCone::Scatter(Real distance, Real pdf, bool specular) const {
+  RayCone cone;
+  cone.width = WidthAt(distance);
+  cone.spread = spread;
+  if (!specular && pdf > 0) {
+    // the cone of solid angle 1 / pdf, pi * (spread / 2)^2 for narrow cones,
+    // no wider than a hemisphere
+    cone.spread =
+        std::max(spread, std::min(Real(M_PI), 2 / std::sqrt(Real(M_PI) * pdf)));
+  }
+  return cone;
+}
+
+Ray::Ray() : tmax_(0) {}
+
 Ray::Ray(const Vec3 &origin, const Vec3 &direction, Real tmax)
     : origin_(origin), direction_(direction), tmax_(tmax) {}
 
@@ -21,6 +81,13 @@ Real Ray::tmax() const { return tmax_; }
 
 void Ray::set_tmax(Real tmax) { tmax_ = tmax; }
 
+const RayCone &Ray::cone() const { return cone_; }
+
+void Ray::set_cone(const RayCone &cone) { cone_ = cone; }
+
 Ray Ray::Transform(const Mat4 &transform) const {
-  return Ray(transform * Vec4(origin_, 1), transform * Vec4(direction_, 0));
+  Ray ray(transform * Vec4(origin_, 1), transform * Vec4(direction_, 0),
+          tmax_);
+  ray.cone_ = cone_;
+  return ray;
 }
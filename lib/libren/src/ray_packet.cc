@@ -0,0 +1,58 @@
+#include "ren/ray_packet.h"
+#include <algorithm>
+
+using namespace ren;
+
+RayPacket::RayPacket(const Ray rays[], int size) : size_(size) {
+  std::copy(rays, rays + size, rays_);
+  coherent_ = size_ > 0;
+  for (int i = 0; i < size_; ++i) {
+    auto dir = rays_[i].direction();
+    inv_dirs_[i] = Vec3(1 / dir.x, 1 / dir.y, 1 / dir.z);
+    origins_.Expand(rays_[i].origin());
+    inv_dirs_bounds_.Expand(inv_dirs_[i]);
+    for (int axis = 0; axis < 3; ++axis) {
+      ray_dir_is_neg_[i][axis] = inv_dirs_[i][axis] < 0;
+      coherent_ = coherent_ &&
+                  ray_dir_is_neg_[i][axis] == ray_dir_is_neg_[0][axis];
+    }
+  }
+  for (int axis = 0; axis < 3 && coherent_; ++axis) {
+    dir_is_neg_[axis] = ray_dir_is_neg_[0][axis];
+  }
+}
+
+bool RayPacket::coherent() const { return coherent_; }
+
+const int *RayPacket::dir_is_neg() const { return dir_is_neg_; }
+
+bool RayPacket::FrustumIntersectP(const Bounds3 &bounds) const {
+  Real tmax = 0;
+  for (const auto &ray : rays_) {
+    tmax = std::max(tmax, ray.tmax());
+  }
+  // interval arithmetic over the origins and the inverse directions gives
+  // the range of the distances to each slab of the box
+  Real t0 = 0;
+  Real t1 = tmax;
+  const Vec3 *b = &bounds.min;
+  for (int axis = 0; axis < 3; ++axis) {
+    Real inv_min = inv_dirs_bounds_.min[axis];
+    Real inv_max = inv_dirs_bounds_.max[axis];
+    if (std::isinf(inv_min) || std::isinf(inv_max)) {
+      // rays parallel to the slab
+      continue;
+    }
+    Real near = b[dir_is_neg_[axis]][axis];
+    Real far = b[1 - dir_is_neg_[axis]][axis];
+    Real near_min = near - origins_.max[axis];
+    Real near_max = near - origins_.min[axis];
+    Real far_min = far - origins_.max[axis];
+    Real far_max = far - origins_.min[axis];
+    t0 = std::max(t0, std::min({near_min * inv_min, near_min * inv_max,
+                                near_max * inv_min, near_max * inv_max}));
+    t1 = std::min(t1, std::max({far_min * inv_min, far_min * inv_max,
+                                far_max * inv_min, far_max * inv_max}));
+  }
+  return t0 <= t1;
+}
@@ -14,12 +14,9 @@ Vec3 Renderer::EstimateDirectRadiance(const Scene &scene,
       if (pdf == 0 || IsZero(radiance)) {
         continue;
       }
-      auto wi = surface_light.p - surface.p;
-      auto length = Length(wi);
-      wi = Normalize(wi);
-      Ray r(surface.p + 1E-4 * surface.y, wi, length * (1 - 1E-4));
-      SurfaceDiff tmp_surface;
-      if (!scene.Intersect(r, tmp_surface)) {
+      Ray r = surface.SpawnRayTo(surface_light);
+      auto wi = r.direction();
+      if (!scene.Occluded(r)) {
         total += radiance * std::abs(Dot(wi, surface.y)) *
                  surface.o->bsdf().F(surface, wo, wi) / pdf;
       }
@@ -28,3 +25,30 @@ Vec3 Renderer::EstimateDirectRadiance(const Scene &scene,
   }
   return total;
 }
+
+void Renderer::set_ray_cones(bool ray_cones) { ray_cones_ = ray_cones; }
+
+void Renderer::set_tiles(int tile_size, TileScheduler::Order order) {
+  tile_size_ = tile_size;
+  tile_order_ = order;
+}
+
+const std::vector<TileStats> &Renderer::tile_stats() const {
+  return tile_stats_;
+}
+
+void Renderer::set_thread_pool(ThreadPool *pool) { pool_ = pool; }
+
+void Renderer::set_replicate(bool replicate) { replicate_ = replicate; }
+
+void Renderer::RenderTiles(
+    int height, int width,
+    const std::function<void(const Tile &, int thread)> &render) {
+  TileScheduler scheduler(height, width, tile_size_, tile_order_);
+  scheduler.Run(thread_pool(), render);
+  tile_stats_ = scheduler.stats();
+}
+
+ThreadPool &Renderer::thread_pool() const {
+  return pool_ ? *pool_ : DefaultThreadPool();
+}
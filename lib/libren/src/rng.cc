@@ -1,8 +1,105 @@
 #include "ren/rng.h"
-#include <random>
+#include <atomic>
 
-ren::Real ren::rng::Uniform() {
-  static std::default_random_engine generator((std::random_device())());
-  static std::uniform_real_distribution<Real> distribution(0.0, 1.0);
-  return distribution(generator);
+using namespace ren;
+
+namespace {
+// the same seed for every run, so that images are reproducible
+const uint32_t kSeed = 0x5EED1234;
+
+// A stream of random numbers: the counter of the next block of numbers and
+// the last block hashed.
+struct Stream {
+  // the block, the bounce, the sample and the index of the path
+  uint32_t counter[4];
+  // the domain of the path and the seed
+  uint32_t key[2];
+  uint32_t block[4];
+  // the next word of block to return, 4 once it's used up
+  int next = 4;
+};
+
+void MulHiLo(uint32_t a, uint32_t b, uint32_t &hi, uint32_t &lo) {
+  uint64_t product = static_cast<uint64_t>(a) * b;
+  hi = product >> 32;
+  lo = static_cast<uint32_t>(product);
+}
+
+// Hash a counter with Philox 4x32 and 10 rounds.
+void Philox(const uint32_t counter[4], const uint32_t key[2],
+            uint32_t out[4]) {
+  const uint32_t kMul0 = 0xD2511F53;
+  const uint32_t kMul1 = 0xCD9E8D57;
+  const uint32_t kWeyl0 = 0x9E3779B9;
+  const uint32_t kWeyl1 = 0xBB67AE85;
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int round = 0; round < 10; ++round) {
+    uint32_t hi0, lo0, hi1, lo1;
+    MulHiLo(kMul0, c0, hi0, lo0);
+    MulHiLo(kMul1, c2, hi1, lo1);
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += kWeyl0;
+    k1 += kWeyl1;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+// @return the stream of the calling thread, a stream of its own until the
+// thread starts a path
+Stream &ThreadStream() {
+  static std::atomic<uint32_t> num_threads{0};
+  thread_local Stream stream = [] {
+    Stream s;
+    s.counter[0] = s.counter[1] = s.counter[2] = 0;
+    s.counter[3] = num_threads++;
+    s.key[0] = rng::kThread;
+    s.key[1] = kSeed;
+    return s;
+  }();
+  return stream;
+}
+
+uint32_t NextWord(Stream &stream) {
+  if (stream.next == 4) {
+    Philox(stream.counter, stream.key, stream.block);
+    ++stream.counter[0];
+    stream.next = 0;
+  }
+  return stream.block[stream.next++];
+}
+}  // namespace
+
+void rng::SetPath(Domain domain, uint32_t index, uint32_t sample) {
+  auto &stream = ThreadStream();
+  stream.counter[0] = 0;
+  stream.counter[1] = 0;
+  stream.counter[2] = sample;
+  stream.counter[3] = index;
+  stream.key[0] = domain;
+  stream.next = 4;
+}
+
+void rng::SetBounce(uint32_t bounce) {
+  auto &stream = ThreadStream();
+  stream.counter[0] = 0;
+  stream.counter[1] = bounce;
+  stream.next = 4;
+}
+
+Real rng::Uniform() {
+  auto &stream = ThreadStream();
+  // as many random bits as the mantissa holds, so the result is below 1
+  if (sizeof(Real) == sizeof(float)) {
+    return (NextWord(stream) >> 8) * Real(1.0 / (1 << 24));
+  }
+  uint64_t bits = static_cast<uint64_t>(NextWord(stream)) << 32;
+  bits |= NextWord(stream);
+  return (bits >> 11) * Real(1.0 / (uint64_t(1) << 53));
 }
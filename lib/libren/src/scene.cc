@@ -9,19 +9,118 @@ using namespace ren;
 
 bool Scene::Intersect(const Ray &ray, SurfaceDiff &surface_diff) const {
   Ray r(ray);
-  bool intersected = false;
-  for (const auto &object : objects_) {
-    SurfaceDiff tmp_surface_diff;
-    Real tmp_t;
-    if (object->Intersect(r, tmp_t, tmp_surface_diff)) {
-      surface_diff = tmp_surface_diff;
-      r.set_tmax(tmp_t);
-      intersected = true;
+  // objects only write to the surface when they are hit closer than tmax so
+  // there is no need for a temporary per candidate
+  auto intersect = [this, &surface_diff](int i, Ray &r) {
+    Real t;
+    if (objects_[i]->Intersect(r, t, surface_diff)) {
+      r.set_tmax(t);
+      return true;
     }
+    return false;
+  };
+  bool intersected = false;
+  for (int i : unbounded_) {
+    intersected |= intersect(i, r);
   }
+  intersected |= bvh_.Intersect(r, intersect);
   return intersected;
 }
 
+int Scene::Intersect(RayPacket &packet, SurfaceDiff surface_diffs[]) const {
+  int hits = 0;
+  for (int i : unbounded_) {
+    hits |= objects_[i]->Intersect(packet, (1 << packet.size()) - 1,
+                                   surface_diffs);
+  }
+  auto intersect = [this, &packet, surface_diffs, &hits](int i, int rays) {
+    int object_hits = objects_[i]->Intersect(packet, rays, surface_diffs);
+    hits |= object_hits;
+    return object_hits != 0;
+  };
+  bvh_.Intersect(packet, intersect);
+  return hits;
+}
+
+bool Scene::Occluded(const Ray &ray) const {
+  // shadow rays traced one after the other tend to be blocked by the same
+  // object, e.g., those towards an area light from nearby points, so the last
+  // object that blocked a ray on this thread is tested first
+  thread_local const Scene *last_scene = nullptr;
+  thread_local int last_occluder = -1;
+  if (last_scene == this && last_occluder >= 0 &&
+      last_occluder < static_cast<int>(objects_.size()) &&
+      objects_[last_occluder]->Occluded(ray)) {
+    return true;
+  }
+  auto occluded = [this, &ray](int i) {
+    if (objects_[i]->Occluded(ray)) {
+      last_scene = this;
+      last_occluder = i;
+      return true;
+    }
+    return false;
+  };
+  for (int i : unbounded_) {
+    if (occluded(i)) {
+      return true;
+    }
+  }
+  return bvh_.Occluded(ray, occluded);
+}
+
+void Scene::Build(const BvhOptions &options) {
+  std::vector<Bounds3> bounds;
+  std::vector<int> bounded;
+  bounds_.clear();
+  unbounded_.clear();
+  moved_.clear();
+  for (int i = 0; i < objects_.size(); ++i) {
+    bounds_.push_back(objects_[i]->WorldBound());
+    if (bounds_[i].IsFinite()) {
+      bounds.push_back(bounds_[i]);
+      bounded.push_back(i);
+    } else {
+      unbounded_.push_back(i);
+    }
+  }
+  // objects are much more expensive to intersect than a box so they always
+  // get a leaf of their own
+  BvhOptions object_options(options);
+  object_options.max_prims_in_node = 1;
+  // there are few objects and moving them refits the hierarchy, which needs
+  // the uncompressed binary nodes, kept alongside the wide ones if any
+  object_options.compressed = false;
+  object_options.keep_binary = true;
+  bvh_ = Bvh(bounds, object_options);
+  // make the hierarchy reference the objects by their index in objects_
+  bvh_.RemapPrims(bounded);
+}
+
+void Scene::SetObjectTransform(int object, const Mat4 &local_to_world) {
+  objects_[object]->set_local_to_world(local_to_world);
+  if (bounds_[object].IsFinite()) {
+    moved_.push_back(object);
+  }
+}
+
+void Scene::Update() {
+  if (moved_.empty()) {
+    return;
+  }
+  for (int i : moved_) {
+    bounds_[i] = objects_[i]->WorldBound();
+  }
+  bvh_.Refit(moved_, bounds_);
+  moved_.clear();
+}
+
+const std::vector<std::unique_ptr<Object>> &Scene::objects() const {
+  return objects_;
+}
+
+const BvhStats &Scene::bvh_stats() const { return bvh_.stats(); }
+
 const std::vector<std::unique_ptr<Light>> &Scene::lights() const {
   return lights_;
 }
@@ -0,0 +1,252 @@
+#include "ren/scene_cache.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using namespace ren;
+
+namespace {
+const char kMagic[8] = "rencach";
+// part of the hash of every file, so bumping it when the format of a block
+// or the builders change leaves the old files unused
+const uint32_t kVersion = 2;
+const char kExtension[] = ".rencache";
+// what a file holds, part of its hash
+enum Kind : uint32_t { kMesh = 1, kSpheres = 2 };
+
+// The header of a file, followed by the block of the geometry.
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  // sizeof(Real) of the build that wrote the file
+  uint32_t real_size;
+  uint64_t key;
+  uint64_t size;
+};
+
+// 64 bit hash of a sequence of bytes added in pieces, 8 bytes at a time.
+// Fast enough to key the cache by geometry of millions of triangles.
+class Hash {
+ public:
+  void Add(const void *data, std::size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    std::size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i, sizeof(word));
+      Mix(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    Mix(tail ^ size);
+  }
+  template <typename T>
+  void Add(const T &value) {
+    Add(&value, sizeof(value));
+  }
+  template <typename T>
+  void AddVector(const std::vector<T> &v) {
+    Add(v.data(), v.size() * sizeof(T));
+  }
+  void AddOptions(const BvhOptions &options) {
+    // the number of threads doesn't change the hierarchy
+    Add(static_cast<int>(options.split_method));
+    Add(options.max_prims_in_node);
+    Add(options.num_bins);
+    Add(options.spatial_splits);
+    Add(options.spatial_split_alpha);
+    Add(options.spatial_split_budget);
+    Add(options.rebuild_threshold);
+    Add(options.compressed);
+    Add(options.width);
+    Add(options.grid_levels);
+    Add(options.grid_density);
+  }
+  // @return the hash of the bytes added so far
+  uint64_t value() const {
+    // the finalizer of MurmurHash3
+    uint64_t h = state_;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+ private:
+  void Mix(uint64_t word) {
+    state_ ^= word;
+    state_ = (state_ << 31 | state_ >> 33) * 0x9E3779B97F4A7C15ULL;
+  }
+  uint64_t state_ = 0x243F6A8885A308D3ULL;
+};
+
+// Start the hash of a file with what every file depends on.
+Hash FileHash(Kind kind) {
+  Hash hash;
+  hash.Add(kVersion);
+  hash.Add(Bvh::kSerializeVersion);
+  hash.Add(static_cast<uint32_t>(sizeof(Real)));
+  hash.Add(kind);
+  return hash;
+}
+}  // namespace
+
+std::ostream &ren::operator<<(std::ostream &os,
+                              const SceneCacheStats &stats) {
+  os << stats.hits << " hits, " << stats.misses << " misses, "
+     << stats.bytes_read / 1E6 << " MB read, " << stats.bytes_written / 1E6
+     << " MB written";
+  return os;
+}
+
+SceneCache::SceneCache(const std::string &directory) : directory_(directory) {
+  if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Can't create the cache directory \"" +
+                             directory_ + "\"");
+  }
+}
+
+std::shared_ptr<TriangleMeshData> SceneCache::Mesh(
+    const std::vector<Vec3> &vertices, const std::vector<int> &indices,
+    bool levels_of_detail, const BvhOptions &options) {
+  auto hash = FileHash(kMesh);
+  hash.AddOptions(options);
+  hash.Add(levels_of_detail);
+  hash.Add(static_cast<uint64_t>(vertices.size()));
+  hash.AddVector(vertices);
+  hash.AddVector(indices);
+  uint64_t key = hash.value();
+  std::shared_ptr<TriangleMeshData> mesh;
+  if (Read(key, [&mesh](const char *data) {
+        mesh = TriangleMeshData::Deserialize(data);
+      })) {
+    return mesh;
+  }
+  mesh = std::make_shared<TriangleMeshData>(vertices, indices, options);
+  if (levels_of_detail) {
+    mesh->BuildLevelsOfDetail(options);
+  }
+  Write(key, mesh->Serialize(nullptr),
+        [&mesh](char *out) { mesh->Serialize(out); });
+  return mesh;
+}
+
+std::unique_ptr<SpherePool> SceneCache::Spheres(
+    const Mat4 &local_to_world, const std::vector<Vec3> &centers,
+    const std::vector<Real> &radii, const BvhOptions &options) {
+  // the spheres are stored in their local space, the transform isn't part
+  // of the hash
+  auto hash = FileHash(kSpheres);
+  hash.AddOptions(options);
+  hash.Add(static_cast<uint64_t>(centers.size()));
+  hash.AddVector(centers);
+  hash.AddVector(radii);
+  uint64_t key = hash.value();
+  std::unique_ptr<SpherePool> pool;
+  if (Read(key, [&](const char *data) {
+        pool = SpherePool::Deserialize(local_to_world, data);
+      })) {
+    return pool;
+  }
+  pool = std::make_unique<SpherePool>(local_to_world, centers, radii, options);
+  Write(key, pool->Serialize(nullptr),
+        [&pool](char *out) { pool->Serialize(out); });
+  return pool;
+}
+
+void SceneCache::Clear() {
+  DIR *dir = opendir(directory_.c_str());
+  if (!dir) {
+    return;
+  }
+  std::size_t extension = sizeof(kExtension) - 1;
+  while (dirent *entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.size() > extension &&
+        name.compare(name.size() - extension, extension, kExtension) == 0) {
+      std::remove((directory_ + "/" + name).c_str());
+    }
+  }
+  closedir(dir);
+}
+
+const SceneCacheStats &SceneCache::stats() const { return stats_; }
+
+bool SceneCache::Read(uint64_t key,
+                      const std::function<void(const char *)> &read) {
+  int fd = open(Path(key).c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  const char *map = nullptr;
+  std::size_t map_size = 0;
+  if (fstat(fd, &file_stat) == 0 &&
+      static_cast<std::size_t>(file_stat.st_size) >= sizeof(FileHeader)) {
+    map_size = file_stat.st_size;
+    void *m = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    map = m == MAP_FAILED ? nullptr : static_cast<const char *>(m);
+  }
+  // the mapping outlives the descriptor
+  close(fd);
+  if (!map) {
+    return false;
+  }
+  FileHeader header;
+  std::memcpy(&header, map, sizeof(header));
+  bool valid = std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+               header.version == kVersion &&
+               header.real_size == sizeof(Real) && header.key == key &&
+               sizeof(header) + header.size == map_size;
+  if (valid) {
+    // the block is read once from start to end
+    madvise(const_cast<char *>(map), map_size, MADV_SEQUENTIAL);
+    read(map + sizeof(header));
+    ++stats_.hits;
+    stats_.bytes_read += map_size;
+  }
+  munmap(const_cast<char *>(map), map_size);
+  return valid;
+}
+
+void SceneCache::Write(uint64_t key, std::size_t size,
+                       const std::function<void(char *)> &write) {
+  FileHeader header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.real_size = sizeof(Real);
+  header.key = key;
+  header.size = size;
+  std::vector<char> block(size);
+  write(block.data());
+  // written under another name and then renamed, so that a process reading
+  // the cache meanwhile never sees half a file
+  auto path = Path(key);
+  auto temp_path = path + ".tmp" + std::to_string(getpid());
+  std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(block.data(), block.size());
+  file.close();
+  if (!file || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    throw std::runtime_error("Can't write the cache file \"" + path + "\"");
+  }
+  ++stats_.misses;
+  stats_.bytes_written += sizeof(header) + size;
+}
+
+std::string SceneCache::Path(uint64_t key) const {
+  char name[17];
+  std::snprintf(name, sizeof(name), "%016llx",
+                static_cast<unsigned long long>(key));
+  return directory_ + "/" + name + kExtension;
+}
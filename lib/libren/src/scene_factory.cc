@@ -1,27 +1,69 @@
 #define _USE_MATH_DEFINES
 #include "ren/scene_factory.h"
+#include <cmath>
+#include <random>
 #include "ren/area_light.h"
 #include "ren/disk.h"
 #include "ren/plane.h"
 #include "ren/point_light.h"
 #include "ren/sphere.h"
+#include "ren/sphere_pool.h"
 #include "ren/transform.h"
 #include "ren/triangle.h"
 
 using namespace ren;
 
+namespace {
+// Tessellate a sphere with 2 * segments * segments triangles whose radius
+// ripples by 2% across its surface.
+void RippledSphere(const Vec3 &center, Real radius, int segments,
+                   std::vector<Vec3> &vertices, std::vector<int> &indices) {
+  vertices.clear();
+  indices.clear();
+  int rings = segments;
+  int sectors = 2 * segments;
+  for (int i = 0; i <= rings; ++i) {
+    Real phi = M_PI * i / rings;
+    for (int j = 0; j < sectors; ++j) {
+      Real theta = 2 * M_PI * j / sectors;
+      Real r = radius * (1 + 0.02 * std::sin(24 * phi) * std::sin(24 * theta));
+      vertices.push_back(center + r * Vec3(std::sin(phi) * std::cos(theta),
+                                           std::cos(phi),
+                                           std::sin(phi) * std::sin(theta)));
+    }
+  }
+  for (int i = 0; i < rings; ++i) {
+    for (int j = 0; j < sectors; ++j) {
+      int a = i * sectors + j;
+      int b = i * sectors + (j + 1) % sectors;
+      int c = a + sectors;
+      int d = b + sectors;
+      indices.insert(indices.end(), {a, b, d});
+      indices.insert(indices.end(), {d, c, a});
+    }
+  }
+}
+}  // namespace
+
 std::unique_ptr<SceneFactory> SceneFactory::instance_ = nullptr;
 
 SceneFactory::SceneFactory() : scenes_() {
-  scenes_.insert(std::make_pair("cbox_blocks", CboxBlocks()));
-  scenes_.insert(std::make_pair("cbox_spheres", CboxSpheres()));
-  scenes_.insert(std::make_pair("cbox_sphere_inside", CboxSphereInside()));
-  scenes_.insert(std::make_pair("cbox_blocks_disk", CboxBlocksDisk()));
+  builders_["cbox_blocks"] = &SceneFactory::CboxBlocks;
+  builders_["cbox_spheres"] = &SceneFactory::CboxSpheres;
+  builders_["cbox_sphere_inside"] = &SceneFactory::CboxSphereInside;
+  builders_["cbox_blocks_disk"] = &SceneFactory::CboxBlocksDisk;
+  builders_["cbox_particles"] = &SceneFactory::CboxParticles;
+  builders_["cbox_meshes"] = &SceneFactory::CboxMeshes;
 }
 
 Scene *SceneFactory::GetScene(const std::string &name) {
   if (scenes_.find(name) == scenes_.end()) {
-    return nullptr;
+    auto builder = builders_.find(name);
+    if (builder == builders_.end()) {
+      return nullptr;
+    }
+    scenes_.insert(std::make_pair(name, (this->*builder->second)()));
+    scenes_[name].Build();
   }
   return &scenes_[name];
 }
@@ -33,6 +75,30 @@ SceneFactory &SceneFactory::GetInstance() {
   return *instance_;
 }
 
+void SceneFactory::set_cache_directory(const std::string &directory) {
+  cache_ = std::make_unique<SceneCache>(directory);
+}
+
+const SceneCache *SceneFactory::cache() const { return cache_.get(); }
+
+std::shared_ptr<TriangleMeshData> SceneFactory::MeshData(
+    const std::vector<Vec3> &vertices, const std::vector<int> &indices) {
+  if (cache_) {
+    return cache_->Mesh(vertices, indices, true);
+  }
+  auto data = std::make_shared<TriangleMeshData>(vertices, indices);
+  data->BuildLevelsOfDetail();
+  return data;
+}
+
+std::unique_ptr<SpherePool> SceneFactory::Spheres(
+    const std::vector<Vec3> &centers, const std::vector<Real> &radii) {
+  if (cache_) {
+    return cache_->Spheres(Mat4(), centers, radii);
+  }
+  return std::make_unique<SpherePool>(Mat4(), centers, radii);
+}
+
 Scene SceneFactory::Cbox() {
   Scene scene;
   std::vector<Vec3> vertices;
@@ -128,14 +194,15 @@ Scene SceneFactory::Cbox() {
     0, 1, 2, 2, 3, 0
   };
   // clang-format on
-  auto light_geometry =
-      std::make_unique<TriangleMesh>(Mat4(), vertices, indices);
+  // the light and the object emitting it share the geometry
+  auto light_geometry = std::make_shared<TriangleMeshData>(vertices, indices);
   auto area_light = std::make_unique<AreaLight>(
-      Mat4(), Vec3(40, 30.902, 22.4314), std::move(light_geometry));
+      Mat4(), Vec3(40, 30.902, 22.4314),
+      std::make_unique<TriangleMesh>(Mat4(), light_geometry));
   auto ptr_area_light = area_light.get();
   scene.AddLight(std::move(area_light));
   scene.AddObject(std::make_unique<Object>(
-      std::make_unique<TriangleMesh>(Mat4(), vertices, indices),
+      std::make_unique<TriangleMesh>(Mat4(), light_geometry),
       std::make_unique<LambertianBrdf>(Vec3(0.78, 0.78, 0.78)),
       ptr_area_light));
   return scene;
@@ -143,6 +210,10 @@ Scene SceneFactory::Cbox() {
 
 Scene SceneFactory::CboxBlocks() {
   Scene scene = Cbox();
+  // the faces of the rotated blocks have bounds that overlap a lot, which
+  // spatial splits avoid
+  BvhOptions block_options = DefaultBvhOptions();
+  block_options.spatial_splits = true;
   std::vector<Vec3> vertices;
   std::vector<int> indices;
   // short block
@@ -182,7 +253,7 @@ Scene SceneFactory::CboxBlocks() {
   };
   // clang-format on
   scene.AddObject(std::make_unique<Object>(
-      std::make_unique<TriangleMesh>(Mat4(), vertices, indices),
+      std::make_unique<TriangleMesh>(Mat4(), vertices, indices, block_options),
       std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
 
   // tall block
@@ -222,7 +293,7 @@ Scene SceneFactory::CboxBlocks() {
   };
   // clang-format on
   scene.AddObject(std::make_unique<Object>(
-      std::make_unique<TriangleMesh>(Mat4(), vertices, indices),
+      std::make_unique<TriangleMesh>(Mat4(), vertices, indices, block_options),
       std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
   return scene;
 }
@@ -253,9 +324,49 @@ Scene SceneFactory::CboxSphereInside() {
 Scene SceneFactory::CboxBlocksDisk() {
   auto cbox = CboxBlocks();
   cbox.AddObject(std::make_unique<Object>(
-      std::make_unique<Disk>(Translate(Rotate(Mat4(), M_PI / 2, Vec3(1, 0, 0)),
-                                       Vec3(250, 150, 50)),
-                             90),
+      std::make_unique<Disk>(
+          Translate(Rotate(Mat4(), Real(M_PI / 2), Vec3(1, 0, 0)),
+                    Vec3(250, 150, 50)),
+          90),
       std::make_unique<SpecularReflectionTransmission>(1, 1.5)));
   return cbox;
 }
+
+Scene SceneFactory::CboxParticles() {
+  auto cbox = Cbox();
+  // the particles fill about 4% of a ball in the middle of the box
+  const int kNumParticles = 1000000;
+  const Vec3 kCenter(278, 274, 280);
+  const Real kRadius = 150;
+  std::mt19937 generator(1234);
+  std::uniform_real_distribution<Real> uniform(-1, 1);
+  std::vector<Vec3> centers;
+  while (centers.size() < kNumParticles) {
+    Vec3 p(uniform(generator), uniform(generator), uniform(generator));
+    if (Length2(p) <= 1) {
+      centers.push_back(kCenter + p * kRadius);
+    }
+  }
+  std::vector<Real> radii(kNumParticles, 0.5);
+  cbox.AddObject(std::make_unique<Object>(
+      Spheres(centers, radii),
+      std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+  return cbox;
+}
+
+Scene SceneFactory::CboxMeshes() {
+  auto cbox = Cbox();
+  std::vector<Vec3> vertices;
+  std::vector<int> indices;
+  RippledSphere(Vec3(150, 100, 300), 100, 512, vertices, indices);
+  auto left = MeshData(vertices, indices);
+  cbox.AddObject(std::make_unique<Object>(
+      std::make_unique<TriangleMesh>(Mat4(), std::move(left)),
+      std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+  RippledSphere(Vec3(380, 120, 220), 120, 512, vertices, indices);
+  auto right = MeshData(vertices, indices);
+  cbox.AddObject(std::make_unique<Object>(
+      std::make_unique<TriangleMesh>(Mat4(), std::move(right)),
+      std::make_unique<LambertianBrdf>(Vec3(0.5, 0.6, 0.8))));
+  return cbox;
+}
@@ -6,6 +6,24 @@ Shape::Shape(const Mat4 &local_to_world)
     : local_to_world_(local_to_world),
       world_to_local_(Inverse(local_to_world)) {}
 
+int Shape::Intersect(RayPacket &packet, int rays,
+                     SurfaceDiff surface_diffs[]) {
+  int hits = 0;
+  for (int i = 0; i < packet.size(); ++i) {
+    Real t;
+    if ((rays >> i & 1) && Intersect(packet[i], t, surface_diffs[i])) {
+      packet[i].set_tmax(t);
+      hits |= 1 << i;
+    }
+  }
+  return hits;
+}
+
 const Mat4 &Shape::world_to_local() const { return world_to_local_; }
 
 const Mat4 &Shape::local_to_world() const { return local_to_world_; }
+
+void Shape::set_local_to_world(const Mat4 &local_to_world) {
+  local_to_world_ = local_to_world;
+  world_to_local_ = Inverse(local_to_world);
+}
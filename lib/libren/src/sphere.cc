@@ -9,37 +9,24 @@ const Vec3 Sphere::kOrigin(0, 0, 0);
 Sphere::Sphere(const Mat4& local_to_world, Real radius)
     : Shape(local_to_world),
       origin_(local_to_world * Vec4(kOrigin, 1)),
-      radius_(radius) {}
+      radius_(radius),
+      radius2_(radius * radius) {}
+
+void Sphere::set_local_to_world(const Mat4& local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  origin_ = local_to_world * Vec4(kOrigin, 1);
+}
 
 Vec3 Sphere::origin() const { return origin_; }
 
 Real Sphere::radius() const { return radius_; }
 
 bool Sphere::Intersect(const Ray& ray, Real& t, SurfaceDiff& surface_diff) {
-  auto tmpV = ray.origin() - origin_;
-  Real a = Dot(ray.direction(), ray.direction());
-  Real b = Dot(2.0 * ray.direction(), tmpV);
-  Real c = Dot(tmpV, tmpV) - pow(radius_, 2.0);
-  Real d = pow(b, 2.0) - 4.0 * a * c;
-  if (d < 0.0) {
+  if (!Intersect(ray, origin_, radius2_, t)) {
     return false;
   }
-  Real t0 = (-b - std::sqrt(d)) / (2.0 * a);
-  Real t1 = (-b + std::sqrt(d)) / (2.0 * a);
-  if (t0 > t1) {
-    std::swap(t0, t1);
-  }
-  if (t0 < 0) {
-    t0 = t1;
-    if (t0 < 0) {
-      return false;
-    }
-  }
-  t = t0;
-  if (t > ray.tmax()) {
-    return false;
-  }
-  auto point = ray.GetPoint(t);
+  auto point =
+      ProjectToSurface(ray.GetPoint(t), origin_, radius_, surface_diff.p_error);
   auto normal = Normalize(point - origin_);
   auto x = Normalize(NormalTo(normal));
   auto z = Cross(normal, x);
@@ -50,6 +37,48 @@ bool Sphere::Intersect(const Ray& ray, Real& t, SurfaceDiff& surface_diff) {
   return true;
 }
 
+bool Sphere::Occluded(const Ray& ray) const {
+  Real t;
+  return Intersect(ray, origin_, radius2_, t);
+}
+
+bool Sphere::Intersect(const Ray& ray, const Vec3& center, Real radius2,
+                       Real& t) {
+  auto oc = ray.origin() - center;
+  auto dir = ray.direction();
+  Real a = Dot(dir, dir);
+  Real b = 2 * Dot(dir, oc);
+  Real c = Dot(oc, oc) - radius2;
+  // b^2 - 4ac = 4a (r^2 - l^2) where l is the distance from the center to
+  // the line of the ray
+  auto l = oc - (b / (2 * a)) * dir;
+  Real d = 4 * a * (radius2 - Dot(l, l));
+  if (d < 0) {
+    return false;
+  }
+  // the roots are computed without subtracting numbers of the same sign
+  Real q = b < 0 ? (std::sqrt(d) - b) / 2 : -(std::sqrt(d) + b) / 2;
+  Real t0 = q / a;
+  Real t1 = c / q;
+  if (t0 > t1) {
+    std::swap(t0, t1);
+  }
+  t = t0 < 0 ? t1 : t0;
+  return t >= 0 && t <= ray.tmax();
+}
+
+Vec3 Sphere::ProjectToSurface(const Vec3& p, const Vec3& center, Real radius,
+                              Vec3& error) {
+  auto offset = p - center;
+  offset *= radius / Length(offset);
+  error = Gamma(6) * (Abs(offset) + Abs(center));
+  return center + offset;
+}
+
 SurfaceDiff Sphere::SamplePoint(Real& pdf) { return SurfaceDiff(); }
 
 Real Sphere::Area() const { return 0.0; }
+
+Bounds3 Sphere::WorldBound() const {
+  return Bounds3(origin_ - radius_, origin_ + radius_);
+}
@@ -0,0 +1,224 @@
+#include "ren/sphere_pool.h"
+#include <algorithm>
+#include <cmath>
+#include "ren/lanes.h"
+#include "ren/serialize.h"
+#include "ren/sphere.h"
+
+using namespace ren;
+
+namespace {
+const int kLanes = kSimdLanes;
+}  // namespace
+
+struct SpherePool::LaneRay : ren::LaneRay {
+  explicit LaneRay(const Ray &ray)
+      : ren::LaneRay(ray),
+        inv_length2(1 / Length2(ray.direction())),
+        inv_length(1 / Length(ray.direction())) {}
+  Lanes inv_length2;
+  Lanes inv_length;
+};
+
+SpherePool::SpherePool(const Mat4 &local_to_world,
+                       const std::vector<Vec3> &centers,
+                       const std::vector<Real> &radii,
+                       const BvhOptions &options)
+    : Shape(local_to_world) {
+  std::vector<Bounds3> bounds;
+  bounds.reserve(centers.size());
+  for (int i = 0; i < centers.size(); ++i) {
+    bounds.emplace_back(centers[i] - radii[i], centers[i] + radii[i]);
+  }
+  // a grid would reference some spheres several times, unlike the hierarchy
+  BvhOptions pool_options(options);
+  pool_options.grid_levels = 0;
+  bvh_ = Bvh(bounds, pool_options);
+  // store the spheres in the order of the leaves, every sphere is referenced
+  // once so the references are then the spheres themselves
+  const auto &prims = bvh_.prim_indices();
+  std::vector<int> old_to_new(centers.size());
+  centers_.reserve(centers.size());
+  radii2_.reserve(centers.size());
+  for (int i = 0; i < centers.size(); ++i) {
+    old_to_new[prims[i]] = i;
+    centers_.push_back(centers[prims[i]]);
+    radii2_.push_back(radii[prims[i]] * radii[prims[i]]);
+  }
+  BuildLanes();
+  bvh_.RemapPrims(old_to_new);
+  UpdateTransform();
+}
+
+SpherePool::SpherePool(const Mat4 &local_to_world) : Shape(local_to_world) {}
+
+std::size_t SpherePool::Serialize(char *out) const {
+  std::size_t size = 0;
+  serialize::PutVector(out, size, centers_);
+  serialize::PutVector(out, size, radii2_);
+  size += bvh_.Serialize(out ? out + size : nullptr);
+  return size;
+}
+
+std::unique_ptr<SpherePool> SpherePool::Deserialize(
+    const Mat4 &local_to_world, const char *data) {
+  std::unique_ptr<SpherePool> pool(new SpherePool(local_to_world));
+  serialize::GetVector(data, pool->centers_);
+  serialize::GetVector(data, pool->radii2_);
+  pool->bvh_ = Bvh::Deserialize(data);
+  // the lanes are padded to the register width of this build, which may
+  // not be the one of the build that wrote the block
+  pool->BuildLanes();
+  pool->UpdateTransform();
+  return pool;
+}
+
+void SpherePool::BuildLanes() {
+  for (int axis = 0; axis < 3; ++axis) {
+    lane_centers_[axis].assign(centers_.size() + kLanes, 0);
+  }
+  // the padding has a negative radius, which fails the test
+  lane_radii_.assign(centers_.size() + kLanes, -1);
+  for (int i = 0; i < centers_.size(); ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      lane_centers_[axis][i] = centers_[i][axis];
+    }
+    lane_radii_[i] = std::sqrt(radii2_[i]);
+  }
+}
+
+void SpherePool::set_local_to_world(const Mat4 &local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  UpdateTransform();
+}
+
+void SpherePool::UpdateTransform() {
+  identity_ = IsIdentity(local_to_world_);
+  if (identity_ || bvh_.empty()) {
+    world_bound_ = bvh_.empty() ? Bounds3() : bvh_.bounds();
+    return;
+  }
+  world_bound_ = TransformBounds(local_to_world_, bvh_.bounds());
+}
+
+bool SpherePool::Intersect(const Ray &ray, Real &t,
+                           SurfaceDiff &surface_diff) {
+  // the direction isn't normalized after the transform so distances along
+  // the ray are the same in both spaces
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  LaneRay lane_ray(r);
+  int sphere = -1;
+  bvh_.IntersectLeaves(r, [&](int begin, int end, Ray &r) {
+    bool hit = false;
+    for (int i = begin; i < end; i += kLanes) {
+      int candidates = IntersectLanes(lane_ray, i, r.tmax()) &
+                       ((1 << std::min(end - i, kLanes)) - 1);
+      for (int j = 0; candidates >> j != 0; ++j) {
+        Real t_sphere;
+        if ((candidates >> j & 1) && Intersect(r, i + j, t_sphere)) {
+          r.set_tmax(t_sphere);
+          sphere = i + j;
+          hit = true;
+        }
+      }
+    }
+    return hit;
+  });
+  if (sphere < 0) {
+    return false;
+  }
+  // the shading frame is only computed for the closest sphere
+  t = r.tmax();
+  Vec3 center = centers_[sphere];
+  Vec3 error;
+  auto point = Sphere::ProjectToSurface(r.GetPoint(t), center,
+                                        std::sqrt(radii2_[sphere]), error);
+  surface_diff.p_error = error;
+  if (!identity_) {
+    center = local_to_world_ * Vec4(center, 1);
+    point = TransformPoint(local_to_world_, point, error,
+                           surface_diff.p_error);
+  }
+  auto normal = Normalize(point - center);
+  auto x = Normalize(NormalTo(normal));
+  surface_diff.p = point;
+  surface_diff.x = x;
+  surface_diff.y = normal;
+  surface_diff.z = Cross(normal, x);
+  return true;
+}
+
+bool SpherePool::Occluded(const Ray &ray) const {
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  LaneRay lane_ray(r);
+  return bvh_.OccludedLeaves(r, [&](int begin, int end) {
+    for (int i = begin; i < end; i += kLanes) {
+      int candidates = IntersectLanes(lane_ray, i, r.tmax()) &
+                       ((1 << std::min(end - i, kLanes)) - 1);
+      for (int j = 0; candidates >> j != 0; ++j) {
+        Real t;
+        if ((candidates >> j & 1) && Intersect(r, i + j, t)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  });
+}
+
+int SpherePool::IntersectLanes(const LaneRay &ray, int begin,
+                               Real tmax) const {
+  // the distance from the center to the line of the ray is compared with
+  // the radius, which unlike the discriminant of the quadratic doesn't
+  // cancel out in single precision for small spheres far from the origin
+  Lanes oc[3];
+  auto center_norm = Lanes(0.0f);
+  for (int axis = 0; axis < 3; ++axis) {
+    auto center = Lanes::Load(&lane_centers_[axis][begin]);
+    oc[axis] = center - ray.origin[axis];
+    center_norm = center_norm + Abs(center);
+  }
+  auto t_center = (oc[0] * ray.dir[0] + oc[1] * ray.dir[1] +
+                   oc[2] * ray.dir[2]) *
+                  ray.inv_length2;
+  Lanes l[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    l[axis] = oc[axis] - t_center * ray.dir[axis];
+  }
+  auto distance2 = l[0] * l[0] + l[1] * l[1] + l[2] * l[2];
+  auto radius = Lanes::Load(&lane_radii_[begin]);
+  // the rounding of the coordinates moves the center relative to the origin
+  // by up to kLaneEpsilon times their magnitude, and the distances along the
+  // ray by as much divided by the length of the direction
+  auto error =
+      Lanes(kLaneEpsilon) * (ray.origin_norm + center_norm + radius);
+  auto reach = radius + error + error;
+  auto t_reach = reach * ray.inv_length;
+  return LessEqual(Lanes(0.0f), radius) & LessEqual(distance2, reach * reach) &
+         LessEqual(Lanes(0.0f), t_center + t_reach) &
+         LessEqual(t_center - t_reach, Lanes(static_cast<float>(tmax)));
+}
+
+bool SpherePool::Intersect(const Ray &ray, int i, Real &t) const {
+  return Sphere::Intersect(ray, centers_[i], radii2_[i], t);
+}
+
+SurfaceDiff SpherePool::SamplePoint(Real &pdf) { return SurfaceDiff(); }
+
+Real SpherePool::Area() const { return 0.0; }
+
+Bounds3 SpherePool::WorldBound() const { return world_bound_; }
+
+int SpherePool::size() const { return centers_.size(); }
+
+const BvhStats &SpherePool::bvh_stats() const { return bvh_.stats(); }
+
+std::size_t SpherePool::MemoryUsage() const {
+  std::size_t lanes = lane_radii_.capacity();
+  for (int axis = 0; axis < 3; ++axis) {
+    lanes += lane_centers_[axis].capacity();
+  }
+  return sizeof(*this) + centers_.capacity() * sizeof(Vec3) +
+         radii2_.capacity() * sizeof(Real) + lanes * sizeof(float) +
+         bvh_.MemoryUsage();
+}
@@ -11,4 +11,17 @@ using namespace ren;
 //                                const Vec3 &point) {
 //  world_to_local = Basis(Translate(Mat4(), point), x, y, z);
 //  local_to_world = Inverse(world_to_local);
-//}
\ No newline at end of file
+//}
+Ray SurfaceDiff::SpawnRay(const Vec3 &w) const {
+  return Ray(OffsetRayOrigin(p, p_error, y, w), w);
+}
+
+Ray SurfaceDiff::SpawnRayTo(const SurfaceDiff &to) const {
+  auto origin = OffsetRayOrigin(p, p_error, y, to.p - p);
+  auto target = OffsetRayOrigin(to.p, to.p_error, to.y, p - to.p);
+  auto d = target - origin;
+  auto length = Length(d);
+  // the distance to the surface of the target is computed with a relative
+  // error well within this, so the ray can't reach it
+  return Ray(origin, d / length, length * (1 - Gamma(16)));
+}
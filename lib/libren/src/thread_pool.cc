@@ -0,0 +1,198 @@
+#include "ren/thread_pool.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace ren;
+
+namespace {
+// Parse a list of CPUs like "0-3,8,10-11".
+std::vector<int> ParseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    auto dash = range.find('-');
+    try {
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception &) {
+      // an empty or malformed range
+    }
+  }
+  return cpus;
+}
+
+// @return the CPUs of each NUMA node the process may run on, the nodes
+// without any left out
+std::vector<std::vector<int>> NodeCpus() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return {};
+  }
+  std::vector<std::vector<int>> nodes;
+  const std::string path = "/sys/devices/system/node";
+  if (DIR *dir = opendir(path.c_str())) {
+    std::vector<int> ids;
+    while (dirent *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+          std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+        ids.push_back(std::stoi(name.substr(4)));
+      }
+    }
+    closedir(dir);
+    std::sort(ids.begin(), ids.end());
+    for (int id : ids) {
+      std::ifstream file(path + "/node" + std::to_string(id) + "/cpulist");
+      std::string list;
+      std::getline(file, list);
+      std::vector<int> cpus;
+      for (int cpu : ParseCpuList(list)) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (!cpus.empty()) {
+        nodes.push_back(cpus);
+      }
+    }
+  }
+  if (nodes.empty()) {
+    nodes.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        nodes.back().push_back(cpu);
+      }
+    }
+  }
+  return nodes;
+}
+}  // namespace
+
+ThreadPool::ThreadPool(int num_threads, Affinity affinity)
+    : affinity_(affinity) {
+  if (num_threads <= 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  num_threads = std::max(1, num_threads);
+  // the CPU of each thread, -1 if it isn't pinned
+  std::vector<int> cpus(num_threads, -1);
+  nodes_.assign(num_threads, 0);
+  auto node_cpus = affinity == kNone ? std::vector<std::vector<int>>()
+                                     : NodeCpus();
+  if (!node_cpus.empty()) {
+    // the order in which the threads take the CPUs, cycled through if there
+    // are more threads than CPUs
+    std::vector<std::pair<int, int>> order;
+    if (affinity == kCompact) {
+      for (int node = 0; node < node_cpus.size(); ++node) {
+        for (int cpu : node_cpus[node]) {
+          order.emplace_back(cpu, node);
+        }
+      }
+    } else {
+      // the nodes with fewer CPUs drop out of the rounds once they are all
+      // taken, rather than having two threads on one of their CPUs
+      std::size_t num_cpus = 0;
+      for (const auto &node_cpu : node_cpus) {
+        num_cpus += node_cpu.size();
+      }
+      for (int i = 0; order.size() < num_cpus; ++i) {
+        for (int node = 0; node < node_cpus.size(); ++node) {
+          if (i < node_cpus[node].size()) {
+            order.emplace_back(node_cpus[node][i], node);
+          }
+        }
+      }
+    }
+    for (int thread = 0; thread < num_threads; ++thread) {
+      cpus[thread] = order[thread % order.size()].first;
+      nodes_[thread] = order[thread % order.size()].second;
+    }
+    num_nodes_ = node_cpus.size();
+  }
+  bool any_pinned = false;
+  for (int thread = 0; thread < num_threads; ++thread) {
+    threads_.emplace_back(&ThreadPool::Work, this, thread);
+    if (cpus[thread] >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[thread], &set);
+      // the CPU may be outside of a cgroup set after the list was read, the
+      // thread then runs unpinned
+      if (pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set),
+                                 &set) == 0) {
+        any_pinned = true;
+      } else {
+        nodes_[thread] = 0;
+      }
+    }
+  }
+  if (!any_pinned) {
+    num_nodes_ = 1;
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  for (auto &t : threads_) {
+    t.join();
+  }
+}
+
+void ThreadPool::Run(const std::function<void(int thread)> &task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = &task;
+  running_ = threads_.size();
+  ++generation_;
+  start_.notify_all();
+  done_.wait(lock, [this] { return running_ == 0; });
+  task_ = nullptr;
+}
+
+int ThreadPool::num_threads() const { return threads_.size(); }
+
+ThreadPool::Affinity ThreadPool::affinity() const { return affinity_; }
+
+int ThreadPool::num_nodes() const { return num_nodes_; }
+
+int ThreadPool::node(int thread) const { return nodes_[thread]; }
+
+void ThreadPool::Work(int thread) {
+  long long generation = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    start_.wait(lock, [&] { return stop_ || generation_ != generation; });
+    if (stop_) {
+      return;
+    }
+    generation = generation_;
+    const auto &task = *task_;
+    lock.unlock();
+    task(thread);
+    lock.lock();
+    if (--running_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
+ThreadPool &ren::DefaultThreadPool() {
+  static ThreadPool pool;
+  return pool;
+}
@@ -0,0 +1,178 @@
+#include "ren/tile_scheduler.h"
+#include <algorithm>
+#include <chrono>
+
+using namespace ren;
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+
+uint64_t Pack(uint32_t begin, uint32_t end) {
+  return static_cast<uint64_t>(begin) << 32 | end;
+}
+
+uint32_t Begin(uint64_t range) { return range >> 32; }
+
+uint32_t End(uint64_t range) { return range & 0xFFFFFFFF; }
+
+// @return the position of the cell (x, y) along the Morton curve
+uint64_t MortonIndex(uint32_t x, uint32_t y) {
+  uint64_t index = 0;
+  for (int bit = 0; bit < 32; ++bit) {
+    index |= static_cast<uint64_t>(x >> bit & 1) << (2 * bit);
+    index |= static_cast<uint64_t>(y >> bit & 1) << (2 * bit + 1);
+  }
+  return index;
+}
+
+// @param n the side of the grid, a power of 2
+// @return the position of the cell (x, y) along the Hilbert curve filling a
+// grid of n x n cells
+uint64_t HilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+  uint64_t index = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    index += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+    // rotate the quadrant so that the curve within it starts where the
+    // curve of the parent enters it
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return index;
+}
+}  // namespace
+
+std::ostream &ren::operator<<(std::ostream &os, const TileStats &stats) {
+  os << stats.tiles << " tiles, " << stats.steals << " steals, "
+     << stats.busy_ms << " ms busy, " << stats.idle_ms << " ms idle";
+  return os;
+}
+
+TileScheduler::TileScheduler(int height, int width, int tile_size,
+                             Order order) {
+  tile_size = std::max(1, tile_size);
+  int rows = (height + tile_size - 1) / tile_size;
+  int cols = (width + tile_size - 1) / tile_size;
+  uint32_t side = 1;
+  while (side < static_cast<uint32_t>(std::max(rows, cols))) {
+    side *= 2;
+  }
+  std::vector<std::pair<uint64_t, Tile>> keyed_tiles;
+  for (int row = 0; row < rows; ++row) {
+    for (int col = 0; col < cols; ++col) {
+      Tile tile = {row * tile_size, std::min(height, (row + 1) * tile_size),
+                   col * tile_size, std::min(width, (col + 1) * tile_size)};
+      uint64_t key = order == kMorton    ? MortonIndex(col, row)
+                     : order == kHilbert ? HilbertIndex(side, col, row)
+                                         : row * cols + col;
+      keyed_tiles.emplace_back(key, tile);
+    }
+  }
+  std::sort(keyed_tiles.begin(), keyed_tiles.end(),
+            [](const std::pair<uint64_t, Tile> &a,
+               const std::pair<uint64_t, Tile> &b) {
+              return a.first < b.first;
+            });
+  for (const auto &keyed_tile : keyed_tiles) {
+    tiles_.push_back(keyed_tile.second);
+  }
+}
+
+void TileScheduler::Run(
+    ThreadPool &pool,
+    const std::function<void(const Tile &, int thread)> &render) {
+  int num_threads = pool.num_threads();
+  num_ranges_ = num_threads;
+  ranges_.reset(new Range[num_threads]);
+  uint32_t num_tiles = tiles_.size();
+  for (int i = 0; i < num_threads; ++i) {
+    ranges_[i].packed = Pack(num_tiles * uint64_t(i) / num_threads,
+                             num_tiles * uint64_t(i + 1) / num_threads);
+  }
+  stats_.assign(num_threads, TileStats());
+  std::vector<Clock::time_point> finish(num_threads);
+  auto begin = Clock::now();
+  auto work = [&](int thread) {
+    auto &stats = stats_[thread];
+    for (;;) {
+      int tile;
+      if (!Pop(ranges_[thread], tile)) {
+        if (!Steal(thread)) {
+          break;
+        }
+        ++stats.steals;
+        continue;
+      }
+      auto tile_begin = Clock::now();
+      render(tiles_[tile], thread);
+      stats.busy_ms += std::chrono::duration<double, std::milli>(
+                           Clock::now() - tile_begin)
+                           .count();
+      ++stats.tiles;
+    }
+    finish[thread] = Clock::now();
+  };
+  pool.Run(work);
+  auto end = *std::max_element(finish.begin(), finish.end());
+  double total_ms =
+      std::chrono::duration<double, std::milli>(end - begin).count();
+  for (auto &stats : stats_) {
+    stats.idle_ms = std::max(0.0, total_ms - stats.busy_ms);
+  }
+}
+
+const std::vector<Tile> &TileScheduler::tiles() const { return tiles_; }
+
+const std::vector<TileStats> &TileScheduler::stats() const { return stats_; }
+
+bool TileScheduler::Pop(Range &range, int &tile) {
+  uint64_t packed = range.packed.load();
+  for (;;) {
+    uint32_t begin = Begin(packed);
+    uint32_t end = End(packed);
+    if (begin >= end) {
+      return false;
+    }
+    if (range.packed.compare_exchange_weak(packed, Pack(begin + 1, end))) {
+      tile = begin;
+      return true;
+    }
+  }
+}
+
+bool TileScheduler::Steal(int thread) {
+  for (;;) {
+    // the victim is the thread with the most tiles left
+    int victim = -1;
+    uint64_t victim_packed = 0;
+    uint32_t most = 0;
+    for (int i = 0; i < num_ranges_; ++i) {
+      uint64_t packed = ranges_[i].packed.load();
+      uint32_t left = End(packed) - std::min(Begin(packed), End(packed));
+      if (i != thread && left > most) {
+        victim = i;
+        victim_packed = packed;
+        most = left;
+      }
+    }
+    if (victim < 0) {
+      return false;
+    }
+    // the victim keeps the first half, which is next to the tile it renders
+    uint32_t begin = Begin(victim_packed);
+    uint32_t end = End(victim_packed);
+    uint32_t middle = begin + (end - begin) / 2;
+    if (ranges_[victim].packed.compare_exchange_strong(victim_packed,
+                                                       Pack(begin, middle))) {
+      // nobody steals from an empty range, so this is the only writer
+      ranges_[thread].packed = Pack(middle, end);
+      return true;
+    }
+  }
+}
@@ -1,41 +1,256 @@
 #include "ren/triangle.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include "ren/lanes.h"
 #include "ren/rng.h"
+#include "ren/serialize.h"
 
 using namespace ren;
 
-TriangleMesh::TriangleMesh(const Mat4 &local_to_world,
-                           const std::vector<Vec3> &vertices,
-                           const std::vector<int> &indices)
-    : Shape(local_to_world), vertices_(vertices), indices_(indices) {
-  surface_area_ = 0;
+namespace {
+// the number of triangles tested together
+const int kLanes = kSimdLanes;
+
+// the levels of detail stop once the cells of their grid are as large as
+// this fraction of the extent of the mesh
+const int kMinLevelCells = 16;
+
+// @return the distance from a point to the closest point of a box, 0 if the
+// point is inside
+Real Distance(const Bounds3 &bounds, const Vec3 &p) {
+  Vec3 d;
+  for (int axis = 0; axis < 3; ++axis) {
+    d[axis] = std::max({bounds.min[axis] - p[axis], Real(0),
+                        p[axis] - bounds.max[axis]});
+  }
+  return Length(d);
+}
+
+// Simplify a mesh by merging the vertices in the same cell of a grid into
+// their mean and dropping the triangles with two vertices in the same cell.
+// @param origin the corner of the grid
+// @param cell_size the width of the cells of the grid
+void ClusterVertices(const std::vector<Vec3> &vertices,
+                     const std::vector<int> &indices, const Vec3 &origin,
+                     Real cell_size, std::vector<Vec3> &cluster_vertices,
+                     std::vector<int> &cluster_indices) {
+  const uint64_t kMaxCell = (1 << 21) - 1;
+  std::unordered_map<uint64_t, int> cells;
+  std::vector<int> vertex_cluster(vertices.size());
+  std::vector<int> counts;
+  cluster_vertices.clear();
+  cluster_indices.clear();
+  for (int i = 0; i < vertices.size(); ++i) {
+    uint64_t key = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      auto cell = static_cast<uint64_t>(
+          std::max(Real(0), (vertices[i][axis] - origin[axis]) / cell_size));
+      key = key << 21 | std::min(cell, kMaxCell);
+    }
+    auto cluster = cells.emplace(key, cluster_vertices.size());
+    if (cluster.second) {
+      cluster_vertices.emplace_back();
+      counts.push_back(0);
+    }
+    vertex_cluster[i] = cluster.first->second;
+    cluster_vertices[vertex_cluster[i]] += vertices[i];
+    ++counts[vertex_cluster[i]];
+  }
+  for (int i = 0; i < cluster_vertices.size(); ++i) {
+    cluster_vertices[i] /= Real(counts[i]);
+  }
+  for (int i = 0; i < indices.size(); i += 3) {
+    int a = vertex_cluster[indices[i]];
+    int b = vertex_cluster[indices[i + 1]];
+    int c = vertex_cluster[indices[i + 2]];
+    if (a != b && b != c && c != a) {
+      cluster_indices.insert(cluster_indices.end(), {a, b, c});
+    }
+  }
+}
+}  // namespace
+
+TriangleMeshData::TriangleMeshData(const std::vector<Vec3> &vertices,
+                                   const std::vector<int> &indices,
+                                   const BvhOptions &options)
+    : vertices_(vertices), indices_(indices) {
+  int num_triangles = indices_.size() / 3;
+  std::vector<Bounds3> bounds;
+  bounds.reserve(num_triangles);
   for (int i = 0; i < indices_.size(); i += 3) {
-    surface_area_ += Area(indices_[i], indices_[i + 1], indices_[i + 2]);
+    bounds.push_back(Union(Bounds3(vertices_[indices_[i]],
+                                   vertices_[indices_[i + 1]]),
+                           vertices_[indices_[i + 2]]));
+  }
+  if (options.spatial_splits) {
+    using namespace std::placeholders;
+    bvh_ = Bvh(bounds, options, std::bind(&TriangleMeshData::Clip, this, _1,
+                                          _2, _3, _4, _5, _6));
+  } else {
+    bvh_ = Bvh(bounds, options);
+  }
+  // store the triangles in the order they are first visited by the leaves,
+  // triangles referenced by several leaves are stored once
+  std::vector<int> old_to_new(num_triangles, -1);
+  std::vector<int> sorted_indices;
+  sorted_indices.reserve(indices_.size());
+  for (int triangle : bvh_.prim_indices()) {
+    if (old_to_new[triangle] >= 0) {
+      continue;
+    }
+    old_to_new[triangle] = sorted_indices.size() / 3;
+    sorted_indices.insert(sorted_indices.end(), &indices_[3 * triangle],
+                          &indices_[3 * triangle + 3]);
   }
+  indices_ = std::move(sorted_indices);
+  bvh_.RemapPrims(old_to_new);
+  Prepare();
+}
+
+TriangleMeshData::TriangleMeshData(std::vector<Vec3> vertices,
+                                   std::vector<int> indices, Bvh bvh)
+    : vertices_(std::move(vertices)),
+      indices_(std::move(indices)),
+      bvh_(std::move(bvh)) {
+  Prepare();
+}
+
+void TriangleMeshData::Prepare() {
+  BuildLanes();
+  surface_area_ = 0;
+  probabilities_.reserve(indices_.size() / 3);
   for (int i = 0; i < indices_.size(); i += 3) {
     probabilities_.push_back(
-        Area(indices_[i], indices_[i + 1], indices_[i + 2]) / surface_area_);
+        Area(indices_[i], indices_[i + 1], indices_[i + 2]));
+    surface_area_ += probabilities_.back();
+  }
+  for (auto &probability : probabilities_) {
+    probability /= surface_area_;
   }
 }
 
-bool TriangleMesh::Intersect(const Ray &ray, Real &t,
-                             SurfaceDiff &surface_diff) {
-  t = std::numeric_limits<Real>::max();
-  int triangle = -1;
+void TriangleMeshData::BuildLevelsOfDetail(const BvhOptions &options) {
+  levels_.clear();
+  if (indices_.empty()) {
+    return;
+  }
+  // the cells of the first level are twice as large as the average edge
+  Real edges = 0;
   for (int i = 0; i < indices_.size(); i += 3) {
-    Real t_tmp;
-    SurfaceDiff surface_tmp;
-    if (Intersect(ray, indices_[i], indices_[i + 1], indices_[i + 2], t_tmp,
-                  surface_tmp) &&
-        t_tmp < t) {
-      surface_diff = surface_tmp;
-      t = t_tmp;
-      triangle = i;
+    Vec3 e1;
+    Vec3 e2;
+    Edges(i / 3, e1, e2);
+    edges += Length(e1) + Length(e2) + Length(e2 - e1);
+  }
+  Real cell_size = 2 * edges / indices_.size();
+  Real max_cell_size = MaxComp(bounds().Diagonal()) / kMinLevelCells;
+  int num_triangles = indices_.size() / 3;
+  std::vector<Vec3> vertices;
+  std::vector<int> indices;
+  for (; cell_size <= max_cell_size; cell_size *= 2) {
+    ClusterVertices(vertices_, indices_, bounds().min, cell_size, vertices,
+                    indices);
+    // a level is only worth it if it has a lot fewer triangles than the
+    // previous one
+    if (indices.size() / 3 > num_triangles * 3 / 4) {
+      continue;
+    }
+    if (indices.empty()) {
+      break;
     }
+    num_triangles = indices.size() / 3;
+    levels_.push_back(
+        std::make_unique<TriangleMeshData>(vertices, indices, options));
+    // a vertex moves at most to the opposite corner of its cell
+    levels_.back()->level_error_ = std::sqrt(Real(3)) * cell_size;
   }
-  return triangle > -1;
 }
 
-SurfaceDiff TriangleMesh::SamplePoint(Real &pdf) {
+const TriangleMeshData &TriangleMeshData::LevelOfDetail(
+    Real footprint) const {
+  for (int i = levels_.size() - 1; i >= 0; --i) {
+    if (levels_[i]->level_error_ < footprint) {
+      return *levels_[i];
+    }
+  }
+  return *this;
+}
+
+int TriangleMeshData::num_levels() const { return levels_.size() + 1; }
+
+Real TriangleMeshData::level_error() const { return level_error_; }
+
+int TriangleMeshData::Intersect(Ray &ray, Vec3 &barycentrics) const {
+  int triangle = -1;
+  LaneRay lane_ray(ray);
+  const auto &prims = bvh_.prim_indices();
+  bvh_.IntersectLeaves(ray, [&](int begin, int end, Ray &r) {
+    bool hit = false;
+    for (int i = begin; i < end; i += kLanes) {
+      int candidates = IntersectLanes(lane_ray, i, r.tmax()) &
+                       ((1 << std::min(end - i, kLanes)) - 1);
+      // the candidates are tested in order so ties are broken as before
+      for (int j = 0; candidates >> j != 0; ++j) {
+        Real t;
+        const int *index = &indices_[3 * prims[i + j]];
+        if ((candidates >> j & 1) &&
+            Intersect(r, index[0], index[1], index[2], t, &barycentrics)) {
+          r.set_tmax(t);
+          triangle = prims[i + j];
+          hit = true;
+        }
+      }
+    }
+    return hit;
+  });
+  return triangle;
+}
+
+void TriangleMeshData::Intersect(RayPacket &packet, int triangles[],
+                                 Vec3 barycentrics[]) const {
+  bvh_.Intersect(packet, [&](int i, int rays) {
+    // the vertices are loaded once for the rays
+    const int *index = &indices_[3 * i];
+    const auto &v0 = vertices_[index[0]];
+    const auto &v1 = vertices_[index[1]];
+    const auto &v2 = vertices_[index[2]];
+    bool hit = false;
+    for (int j = 0; j < packet.size(); ++j) {
+      Real t;
+      if ((rays >> j & 1) &&
+          Intersect(packet[j], v0, v1, v2, t, &barycentrics[j])) {
+        packet[j].set_tmax(t);
+        triangles[j] = i;
+        hit = true;
+      }
+    }
+    return hit;
+  });
+}
+
+bool TriangleMeshData::Occluded(const Ray &ray) const {
+  LaneRay lane_ray(ray);
+  const auto &prims = bvh_.prim_indices();
+  return bvh_.OccludedLeaves(ray, [&](int begin, int end) {
+    for (int i = begin; i < end; i += kLanes) {
+      int candidates = IntersectLanes(lane_ray, i, ray.tmax()) &
+                       ((1 << std::min(end - i, kLanes)) - 1);
+      for (int j = 0; candidates >> j != 0; ++j) {
+        Real t;
+        const int *index = &indices_[3 * prims[i + j]];
+        if ((candidates >> j & 1) &&
+            Intersect(ray, index[0], index[1], index[2], t)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  });
+}
+
+Vec3 TriangleMeshData::SamplePoint(int &triangle, Vec3 &error) const {
   Real cdf = 0;
   auto xi0 = rng::Uniform();
   int triangle_index = -1;
@@ -49,58 +264,433 @@ SurfaceDiff TriangleMesh::SamplePoint(Real &pdf) {
 
   auto xi1 = rng::Uniform();
   auto xi2 = rng::Uniform();
-  auto p =
-      (1.0 - std::sqrt(xi1)) * vertices_[indices_[triangle_index]] +
-      std::sqrt(xi1) * (1.0 - xi2) * vertices_[indices_[triangle_index + 1]] +
-      xi2 * std::sqrt(xi1) * vertices_[indices_[triangle_index + 2]];
-  SurfaceDiff surface_diff;
-  auto e1 = vertices_[indices_[triangle_index + 1]] -
-            vertices_[indices_[triangle_index]];
-  auto e2 = vertices_[indices_[triangle_index + 2]] -
-            vertices_[indices_[triangle_index]];
-  surface_diff.p = p;
-  surface_diff.x = Normalize(e1);
-  surface_diff.y = Normalize(Cross(surface_diff.x, Normalize(e2)));
-  surface_diff.z = Cross(surface_diff.x, surface_diff.y);
-  pdf = 1.0 / surface_area_;
-  return surface_diff;
+  triangle = triangle_index / 3;
+  Vec3 barycentrics(1 - std::sqrt(xi1), std::sqrt(xi1) * (1 - xi2),
+                    xi2 * std::sqrt(xi1));
+  return Interpolate(triangle, barycentrics, error);
+}
+
+Vec3 TriangleMeshData::Interpolate(int triangle, const Vec3 &barycentrics,
+                                   Vec3 &error) const {
+  const int *index = &indices_[3 * triangle];
+  Vec3 p0 = barycentrics.x * vertices_[index[0]];
+  Vec3 p1 = barycentrics.y * vertices_[index[1]];
+  Vec3 p2 = barycentrics.z * vertices_[index[2]];
+  error = Gamma(7) * (Abs(p0) + Abs(p1) + Abs(p2));
+  return p0 + p1 + p2;
 }
 
-Real TriangleMesh::Area() const { return surface_area_; }
+void TriangleMeshData::Edges(int triangle, Vec3 &e1, Vec3 &e2) const {
+  const auto &v0 = vertices_[indices_[3 * triangle]];
+  e1 = vertices_[indices_[3 * triangle + 1]] - v0;
+  e2 = vertices_[indices_[3 * triangle + 2]] - v0;
+}
 
-bool TriangleMesh::Intersect(const Ray &ray, int i0, int i1, int i2, Real &t,
-                             SurfaceDiff &surface_diff) {
-  auto e1 = vertices_[i1] - vertices_[i0];
-  auto e2 = vertices_[i2] - vertices_[i0];
-  auto q = Cross(ray.direction(), e2);
-  auto a = Dot(e1, q);
-  if (a > -1E-4 && a < 1E-4) {
+Real TriangleMeshData::Area() const { return surface_area_; }
+
+const Bounds3 &TriangleMeshData::bounds() const {
+  static const Bounds3 kEmpty;
+  return bvh_.empty() ? kEmpty : bvh_.bounds();
+}
+
+const std::vector<Vec3> &TriangleMeshData::vertices() const {
+  return vertices_;
+}
+
+const std::vector<int> &TriangleMeshData::indices() const { return indices_; }
+
+const Bvh &TriangleMeshData::bvh() const { return bvh_; }
+
+const BvhStats &TriangleMeshData::bvh_stats() const { return bvh_.stats(); }
+
+std::size_t TriangleMeshData::MemoryUsage() const {
+  std::size_t lanes = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    lanes += lanes_.v0[axis].capacity() + lanes_.e1[axis].capacity() +
+             lanes_.e2[axis].capacity();
+  }
+  std::size_t levels = 0;
+  for (const auto &level : levels_) {
+    levels += level->MemoryUsage();
+  }
+  return sizeof(*this) + vertices_.capacity() * sizeof(Vec3) +
+         indices_.capacity() * sizeof(int) + lanes * sizeof(float) +
+         probabilities_.capacity() * sizeof(Real) + bvh_.MemoryUsage() +
+         levels;
+}
+
+std::size_t TriangleMeshData::BvhMemoryUsage() const {
+  return bvh_.MemoryUsage();
+}
+
+std::size_t TriangleMeshData::Serialize(char *out) const {
+  std::size_t size = 0;
+  serialize::PutVector(out, size, vertices_);
+  serialize::PutVector(out, size, indices_);
+  size += bvh_.Serialize(out ? out + size : nullptr);
+  serialize::PutVector(out, size, probabilities_);
+  serialize::Put(out, size, &surface_area_, sizeof(surface_area_));
+  serialize::Put(out, size, &level_error_, sizeof(level_error_));
+  uint64_t num_levels = levels_.size();
+  serialize::Put(out, size, &num_levels, sizeof(num_levels));
+  for (const auto &level : levels_) {
+    size += level->Serialize(out ? out + size : nullptr);
+  }
+  return size;
+}
+
+std::unique_ptr<TriangleMeshData> TriangleMeshData::Deserialize(
+    const char *data) {
+  std::unique_ptr<TriangleMeshData> mesh(new TriangleMeshData());
+  serialize::GetVector(data, mesh->vertices_);
+  serialize::GetVector(data, mesh->indices_);
+  mesh->bvh_ = Bvh::Deserialize(data);
+  data += mesh->bvh_.Serialize(nullptr);
+  // the lanes are padded to the register width of this build, which may
+  // not be the one of the build that wrote the block
+  mesh->BuildLanes();
+  serialize::GetVector(data, mesh->probabilities_);
+  serialize::Get(data, &mesh->surface_area_, sizeof(mesh->surface_area_));
+  serialize::Get(data, &mesh->level_error_, sizeof(mesh->level_error_));
+  uint64_t num_levels;
+  serialize::Get(data, &num_levels, sizeof(num_levels));
+  for (int i = 0; i < num_levels; ++i) {
+    mesh->levels_.push_back(Deserialize(data));
+    data += mesh->levels_.back()->Serialize(nullptr);
+  }
+  return mesh;
+}
+
+void TriangleMeshData::BuildLanes() {
+  const auto &prims = bvh_.prim_indices();
+  for (int axis = 0; axis < 3; ++axis) {
+    // the padding is zeros, whose determinant of 0 fails the test
+    lanes_.v0[axis].assign(prims.size() + kLanes, 0);
+    lanes_.e1[axis].assign(prims.size() + kLanes, 0);
+    lanes_.e2[axis].assign(prims.size() + kLanes, 0);
+  }
+  for (int i = 0; i < prims.size(); ++i) {
+    const int *index = &indices_[3 * prims[i]];
+    const auto &v0 = vertices_[index[0]];
+    auto e1 = vertices_[index[1]] - v0;
+    auto e2 = vertices_[index[2]] - v0;
+    for (int axis = 0; axis < 3; ++axis) {
+      lanes_.v0[axis][i] = v0[axis];
+      lanes_.e1[axis][i] = e1[axis];
+      lanes_.e2[axis][i] = e2[axis];
+    }
+  }
+}
+
+int TriangleMeshData::IntersectLanes(const LaneRay &ray, int begin,
+                                     Real tmax) const {
+  Lanes v0[3];
+  Lanes e1[3];
+  Lanes e2[3];
+  Lanes s[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    v0[axis] = Lanes::Load(&lanes_.v0[axis][begin]);
+    e1[axis] = Lanes::Load(&lanes_.e1[axis][begin]);
+    e2[axis] = Lanes::Load(&lanes_.e2[axis][begin]);
+    s[axis] = ray.origin[axis] - v0[axis];
+  }
+  // same steps as the double precision test without early exits
+  Lanes q[3] = {ray.dir[1] * e2[2] - ray.dir[2] * e2[1],
+                ray.dir[2] * e2[0] - ray.dir[0] * e2[2],
+                ray.dir[0] * e2[1] - ray.dir[1] * e2[0]};
+  Lanes r[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+                s[0] * e1[1] - s[1] * e1[0]};
+  auto a = e1[0] * q[0] + e1[1] * q[1] + e1[2] * q[2];
+  auto f = Lanes(1.0f) / a;
+  auto u = f * (s[0] * q[0] + s[1] * q[1] + s[2] * q[2]);
+  auto v = f * (ray.dir[0] * r[0] + ray.dir[1] * r[1] + ray.dir[2] * r[2]);
+  auto t = f * (e2[0] * r[0] + e2[1] * r[1] + e2[2] * r[2]);
+  // the rounding of the coordinates moves s by up to kLaneEpsilon times
+  // their magnitude, which moves the barycentric coordinates by up to
+  // |s error| |q| / |a| and the distance by up to |s error| |e1 x e2| / |a|
+  auto edges = Abs(e1[0]) + Abs(e1[1]) + Abs(e1[2]) + Abs(e2[0]) +
+               Abs(e2[1]) + Abs(e2[2]);
+  auto s_error = Lanes(kLaneEpsilon) *
+                 (ray.origin_norm + Abs(v0[0]) + Abs(v0[1]) + Abs(v0[2]) +
+                  edges) *
+                 Abs(f) * edges;
+  auto uv_error = s_error * ray.dir_norm;
+  auto t_error = s_error * edges;
+  // NaNs, from degenerate triangles or rays in their plane, fail every test
+  return LessEqual(Lanes(0.0f) - uv_error, u) &
+         LessEqual(Lanes(0.0f) - uv_error, v) &
+         LessEqual(u + v, Lanes(1.0f) + uv_error + uv_error) &
+         LessEqual(Lanes(0.0f) - t_error, t) &
+         LessEqual(t, Lanes(static_cast<float>(tmax)) + t_error);
+}
+
+bool TriangleMeshData::Intersect(const Ray &ray, int i0, int i1, int i2,
+                                 Real &t, Vec3 *barycentrics) const {
+  return Intersect(ray, vertices_[i0], vertices_[i1], vertices_[i2], t,
+                   barycentrics);
+}
+
+bool TriangleMeshData::Intersect(const Ray &ray, const Vec3 &v0,
+                                 const Vec3 &v1, const Vec3 &v2, Real &t,
+                                 Vec3 *barycentrics) {
+  // the axis along which the direction is the largest becomes z
+  auto dir = ray.direction();
+  int kz = std::abs(dir.x) > std::abs(dir.y)
+               ? (std::abs(dir.x) > std::abs(dir.z) ? 0 : 2)
+               : (std::abs(dir.y) > std::abs(dir.z) ? 1 : 2);
+  int kx = kz == 2 ? 0 : kz + 1;
+  int ky = kx == 2 ? 0 : kx + 1;
+  if (dir[kz] == 0) {
+    return false;
+  }
+  // shear the vertices relative to the origin so that the ray goes along z
+  Real sx = -dir[kx] / dir[kz];
+  Real sy = -dir[ky] / dir[kz];
+  Real sz = 1 / dir[kz];
+  auto p0 = v0 - ray.origin();
+  auto p1 = v1 - ray.origin();
+  auto p2 = v2 - ray.origin();
+  Real x0 = p0[kx] + sx * p0[kz];
+  Real y0 = p0[ky] + sy * p0[kz];
+  Real x1 = p1[kx] + sx * p1[kz];
+  Real y1 = p1[ky] + sy * p1[kz];
+  Real x2 = p2[kx] + sx * p2[kz];
+  Real y2 = p2[ky] + sy * p2[kz];
+  // the edge functions only depend on the two vertices of their edge, so a
+  // ray through an edge is seen on the same side by both triangles sharing it
+  Real e0 = x1 * y2 - y1 * x2;
+  Real e1 = x2 * y0 - y2 * x0;
+  Real e2 = x0 * y1 - y0 * x1;
+  if (e0 == 0 || e1 == 0 || e2 == 0) {
+    // in single precision, tell the side of a ray through an edge or vertex
+    // from the exact products
+    e0 = static_cast<double>(x1) * y2 - static_cast<double>(y1) * x2;
+    e1 = static_cast<double>(x2) * y0 - static_cast<double>(y2) * x0;
+    e2 = static_cast<double>(x0) * y1 - static_cast<double>(y0) * x1;
+  }
+  if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) {
     return false;
   }
-  auto f = 1.0 / a;
-  auto s = ray.origin() - vertices_[i0];
-  auto u = f * Dot(s, q);
-  if (u < 0.0) {
+  Real det = e0 + e1 + e2;
+  if (det == 0) {
     return false;
   }
-  auto r = Cross(s, e1);
-  auto v = f * Dot(ray.direction(), r);
-  if (v < 0.0 || u + v > 1.0) {
+  // the scaled distance is only divided by the determinant once the hit is
+  // known to be in range
+  Real z0 = sz * p0[kz];
+  Real z1 = sz * p1[kz];
+  Real z2 = sz * p2[kz];
+  Real t_scaled = e0 * z0 + e1 * z1 + e2 * z2;
+  if (det < 0 ? t_scaled >= 0 || t_scaled < ray.tmax() * det
+              : t_scaled <= 0 || t_scaled > ray.tmax() * det) {
     return false;
   }
-  t = f * Dot(e2, r);
-  if (t > 0 && t < ray.tmax()) {
-    surface_diff.x = Normalize(e1);
-    surface_diff.y = Normalize(Cross(surface_diff.x, Normalize(e2)));
-    surface_diff.z = Cross(surface_diff.x, surface_diff.y);
-    surface_diff.p = ray.GetPoint(t);
-    return true;
+  Real inv_det = 1 / det;
+  t = t_scaled * inv_det;
+  if (t >= ray.tmax()) {
+    return false;
+  }
+  // reject the hits whose distance is within its rounding error of 0, as
+  // bounded by Woop et al.
+  Real max_z = std::max({std::abs(z0), std::abs(z1), std::abs(z2)});
+  Real max_x = std::max({std::abs(x0), std::abs(x1), std::abs(x2)});
+  Real max_y = std::max({std::abs(y0), std::abs(y1), std::abs(y2)});
+  Real z_error = Gamma(3) * max_z;
+  Real x_error = Gamma(5) * (max_x + max_z);
+  Real y_error = Gamma(5) * (max_y + max_z);
+  Real e_error =
+      2 * (Gamma(2) * max_x * max_y + y_error * max_x + x_error * max_y);
+  Real max_e = std::max({std::abs(e0), std::abs(e1), std::abs(e2)});
+  Real t_error =
+      3 * (Gamma(3) * max_e * max_z + e_error * max_z + z_error * max_e) *
+      std::abs(inv_det);
+  if (t <= t_error) {
+    return false;
   }
-  return false;
+  if (barycentrics) {
+    *barycentrics = Vec3(e0 * inv_det, e1 * inv_det, e2 * inv_det);
+  }
+  return true;
 }
 
-Real TriangleMesh::Area(int i0, int i1, int i2) const {
+Real TriangleMeshData::Area(int i0, int i1, int i2) const {
   auto e1 = vertices_[i1] - vertices_[i0];
   auto e2 = vertices_[i2] - vertices_[i0];
   return Length(Cross(e1, e2)) * 0.5;
 }
+
+void TriangleMeshData::Clip(int triangle, const Bounds3 &bounds, int axis,
+                            Real pos, Bounds3 &left, Bounds3 &right) const {
+  left = Bounds3();
+  right = Bounds3();
+  for (int i = 0; i < 3; ++i) {
+    const auto &a = vertices_[indices_[3 * triangle + i]];
+    const auto &b = vertices_[indices_[3 * triangle + (i + 1) % 3]];
+    if (a[axis] <= pos) {
+      left.Expand(a);
+    }
+    if (a[axis] >= pos) {
+      right.Expand(a);
+    }
+    // the edges crossing the plane contribute to both sides
+    if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+      Real t = (pos - a[axis]) / (b[axis] - a[axis]);
+      Vec3 p = a + (b - a) * t;
+      p[axis] = pos;
+      left.Expand(p);
+      right.Expand(p);
+    }
+  }
+  for (int i = 0; i < 3; ++i) {
+    left.min[i] = std::max(left.min[i], bounds.min[i]);
+    left.max[i] = std::min(left.max[i], bounds.max[i]);
+    right.min[i] = std::max(right.min[i], bounds.min[i]);
+    right.max[i] = std::min(right.max[i], bounds.max[i]);
+  }
+}
+
+TriangleMesh::TriangleMesh(const Mat4 &local_to_world,
+                           const std::vector<Vec3> &vertices,
+                           const std::vector<int> &indices,
+                           const BvhOptions &options)
+    : TriangleMesh(local_to_world, std::make_shared<TriangleMeshData>(
+                                       vertices, indices, options)) {}
+
+TriangleMesh::TriangleMesh(const Mat4 &local_to_world,
+                           std::shared_ptr<const TriangleMeshData> data)
+    : Shape(local_to_world), data_(std::move(data)) {
+  UpdateTransform();
+}
+
+void TriangleMesh::set_local_to_world(const Mat4 &local_to_world) {
+  Shape::set_local_to_world(local_to_world);
+  UpdateTransform();
+}
+
+void TriangleMesh::UpdateTransform() {
+  identity_ = IsIdentity(local_to_world_);
+  const auto &bounds = data_->bounds();
+  if (identity_ || bounds.IsEmpty()) {
+    area_ = data_->Area();
+    world_bound_ = bounds;
+    scale_ = 1;
+    return;
+  }
+  Real determinant = LinearDeterminant(local_to_world_);
+  area_ = data_->Area() * std::pow(determinant, 2.0 / 3.0);
+  scale_ = std::cbrt(determinant);
+  world_bound_ = TransformBounds(local_to_world_, bounds);
+}
+
+bool TriangleMesh::Intersect(const Ray &ray, Real &t,
+                             SurfaceDiff &surface_diff) {
+  // the direction isn't normalized after the transform so distances along
+  // the ray are the same in both spaces
+  Ray r = identity_ ? ray : ray.Transform(world_to_local_);
+  const auto &data = LevelOfDetail(ray);
+  Vec3 barycentrics;
+  int triangle = data.Intersect(r, barycentrics);
+  if (triangle < 0) {
+    return false;
+  }
+  t = r.tmax();
+  Vec3 error;
+  auto p = data.Interpolate(triangle, barycentrics, error);
+  // the point of a coarser level may be as far from the surface of the mesh
+  // as its error, the rays leaving it start out of that distance so they
+  // don't hit the surface of the mesh from behind
+  SetSurfaceDiff(data, triangle, p, error + data.level_error(), surface_diff);
+  return true;
+}
+
+int TriangleMesh::Intersect(RayPacket &packet, int rays,
+                            SurfaceDiff surface_diffs[]) {
+  Ray local_rays[RayPacket::kMaxSize];
+  int num_local_rays = 0;
+  int packet_indices[RayPacket::kMaxSize];
+  for (int i = 0; i < packet.size(); ++i) {
+    if (rays >> i & 1) {
+      local_rays[num_local_rays] =
+          identity_ ? packet[i] : packet[i].Transform(world_to_local_);
+      packet_indices[num_local_rays++] = i;
+    }
+  }
+  RayPacket local_packet(local_rays, num_local_rays);
+  int triangles[RayPacket::kMaxSize];
+  std::fill(triangles, triangles + local_packet.size(), -1);
+  Vec3 barycentrics[RayPacket::kMaxSize];
+  data_->Intersect(local_packet, triangles, barycentrics);
+  int hits = 0;
+  for (int k = 0; k < local_packet.size(); ++k) {
+    if (triangles[k] < 0) {
+      continue;
+    }
+    int i = packet_indices[k];
+    packet[i].set_tmax(local_packet[k].tmax());
+    Vec3 error;
+    auto p = data_->Interpolate(triangles[k], barycentrics[k], error);
+    SetSurfaceDiff(*data_, triangles[k], p, error, surface_diffs[i]);
+    hits |= 1 << i;
+  }
+  return hits;
+}
+
+bool TriangleMesh::Occluded(const Ray &ray) const {
+  return LevelOfDetail(ray).Occluded(
+      identity_ ? ray : ray.Transform(world_to_local_));
+}
+
+SurfaceDiff TriangleMesh::SamplePoint(Real &pdf) {
+  int triangle;
+  Vec3 error;
+  auto p = data_->SamplePoint(triangle, error);
+  SurfaceDiff surface_diff;
+  SetSurfaceDiff(*data_, triangle, p, error, surface_diff);
+  pdf = 1.0 / area_;
+  return surface_diff;
+}
+
+Real TriangleMesh::Area() const { return area_; }
+
+Bounds3 TriangleMesh::WorldBound() const { return world_bound_; }
+
+const BvhStats &TriangleMesh::bvh_stats() const { return data_->bvh_stats(); }
+
+const std::shared_ptr<const TriangleMeshData> &TriangleMesh::data() const {
+  return data_;
+}
+
+const TriangleMeshData &TriangleMesh::LevelOfDetail(const Ray &ray) const {
+  const auto &cone = ray.cone();
+  if (data_->num_levels() == 1 || (cone.width == 0 && cone.spread == 0)) {
+    return *data_;
+  }
+  // rays starting inside the bounds, like those leaving the mesh, get its
+  // full detail since a coarser surface could hide the point they leave
+  Real distance = Distance(world_bound_, ray.origin());
+  if (distance == 0) {
+    return *data_;
+  }
+  // the bounds are no farther than any triangle, which keeps the choice on
+  // the fine side
+  return data_->LevelOfDetail(cone.WidthAt(distance) / scale_);
+}
+
+void TriangleMesh::SetSurfaceDiff(const TriangleMeshData &data, int triangle,
+                                  const Vec3 &p, const Vec3 &p_error,
+                                  SurfaceDiff &surface_diff) const {
+  Vec3 e1;
+  Vec3 e2;
+  data.Edges(triangle, e1, e2);
+  surface_diff.p = p;
+  surface_diff.p_error = p_error;
+  if (!identity_) {
+    e1 = local_to_world_ * Vec4(e1, 0);
+    e2 = local_to_world_ * Vec4(e2, 0);
+    surface_diff.p =
+        TransformPoint(local_to_world_, p, p_error, surface_diff.p_error);
+  }
+  surface_diff.x = Normalize(e1);
+  surface_diff.y = Normalize(Cross(surface_diff.x, Normalize(e2)));
+  surface_diff.z = Cross(surface_diff.x, surface_diff.y);
+}
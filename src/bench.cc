@@ -0,0 +1,991 @@
+#define _USE_MATH_DEFINES
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include "ren/ren.h"
+
+using namespace ren;
+
+static const char kUsage[] =
+    R"(Ren benchmarks.
+
+    Usage:
+      ren_bench mesh [-n <integer>] [-accel <string>] [-bvh <string>] [-leaf <integer>] [-bins <integer>] [-bt <integer>] [-sbvh] [-qbvh] [-bvh-stats]
+      ren_bench shadows [-n <integer>] [-s <string>]
+      ren_bench animation [-n <integer>] [-frames <integer>] [-accel <string>]
+      ren_bench instances [-n <integer>] [-accel <string>] [-bvh <string>] [-leaf <integer>] [-bins <integer>] [-bt <integer>] [-sbvh] [-qbvh] [-bvh-stats]
+      ren_bench accel [-n <integer>] [-bvh <string>] [-bt <integer>]
+      ren_bench packets [-s <string>] [-accel <string>]
+      ren_bench particles [-n <integer>] [-accel <string>] [-bvh <string>] [-bt <integer>]
+      ren_bench ooc [-n <integer>] [-accel <string>] [-bvh <string>] [-leaf <integer>] [-bins <integer>] [-bt <integer>] [-sbvh] [-qbvh]
+      ren_bench cache [-accel <string>] [-bvh <string>] [-leaf <integer>] [-bins <integer>] [-bt <integer>] [-sbvh] [-qbvh]
+      ren_bench threads [-s <string>] [-affinity <string>]
+      ren_bench kdtree [-bt <integer>]
+      ren_bench knn [-n <integer>] [-bt <integer>]
+      ren_bench -h
+
+    Benchmarks:
+      mesh
+           Rays per second against the number of triangles of a tessellated
+           sphere.
+
+      shadows
+           Shadow rays per second towards the lights of a scene using closest
+           hit and occlusion queries.
+
+      animation
+           Time to update the hierarchy of cbox_spheres while its spheres
+           move, refitting it or rebuilding it every frame.
+
+      instances
+           Rays per second and memory against the number of instances of a
+           tessellated sphere sharing its geometry.
+
+      accel
+           Rays per second against the number of spheres of a scene for each
+           acceleration structure.
+
+      packets
+           Camera rays per second of a 512x512 image with 16 rays per pixel
+           traced one at a time and in packets of a pixel, for a scene and
+           for a sphere of half a million triangles.
+
+      particles
+           Rays per second against the number of spheres and disks of a
+           scene, with an object per primitive and with a pool of them.
+
+      ooc
+           Rays per second, page faults and cluster hit rate of a sphere of a
+           million triangles traced out of core, against the memory budget
+           of its clusters and for rays in random and in spatial order. A
+           tenth of the rays are traced since every fault decodes a cluster.
+
+      cache
+           Time to build a tessellated sphere with levels of detail against
+           the number of its triangles, without a scene cache, adding it to
+           the cache and reading it back from the cache.
+
+      threads
+           Time to path trace a scene at 128x128 with 4 samples per pixel
+           against the number of threads, up to the hardware threads, with
+           the speedup, parallel efficiency and share of time the threads
+           spent idle.
+
+      kdtree
+           Time to build a photon map against the number of photons, in
+           total and per million photons, with the memory it takes.
+
+      knn
+           Nearest photon queries per second on a photon map of a million
+           photons against the number of photons per query, one query at a
+           time and in batches of points close together. A tenth of the
+           queries are run since a query gathers hundreds of photons.
+
+    Options:
+      -n <integer>
+           Number of rays traced or photon map queries per measurement.
+           [default: 1000000]
+
+      -s <cbox_blocks|cbox_spheres|cbox_sphere_inside|cbox_blocks_disk|cbox_particles|cbox_meshes>
+           Scene traced by the shadows, packets and threads benchmarks.
+           [default: cbox_blocks]
+
+      -affinity <none|compact|scatter>
+           Pinning of the threads of the threads benchmark. [default: none]
+
+      -frames <integer>
+           Number of frames of the animation benchmark. The rays are split
+           evenly among them. [default: 100]
+
+      -accel <bvh|bvh4|bvh8|grid|grid2>
+           Acceleration structure of the scenes and the meshes, a binary or a
+           4 or 8 wide hierarchy, or a uniform or two-level grid.
+           [default: bvh]
+
+      -bvh <sah|middle>
+           Split method used to build the hierarchies. [default: sah]
+
+      -leaf <integer>
+           Maximum number of triangles in a leaf of the mesh hierarchy. [default: 4]
+
+      -bins <integer>
+           Number of bins per axis of the SAH builder. [default: 16]
+
+      -bt <integer>
+           Number of threads used to build the hierarchies and the photon
+           maps, 0 for all the hardware threads. [default: 0]
+
+      -sbvh
+           Build the mesh hierarchies with spatial splits.
+
+      -qbvh
+           Store the mesh hierarchies with the bounds of the nodes quantized
+           to 8 bits.
+
+      -bvh-stats
+           Print the statistics of every hierarchy built.
+
+      -h
+           Show this screen.
+)";
+
+int num_rays = 1000000;
+std::string split_method = "sah";
+std::string accel = "bvh";
+std::string scene_name = "cbox_blocks";
+std::string affinity = "none";
+int num_frames = 100;
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+// Tessellate the unit sphere with 2 * segments * segments triangles.
+void SphereMesh(int segments, std::vector<Vec3> &vertices,
+                std::vector<int> &indices) {
+  vertices.clear();
+  indices.clear();
+  int rings = segments;
+  int sectors = 2 * segments;
+  for (int i = 0; i <= rings; ++i) {
+    Real phi = M_PI * i / rings;
+    for (int j = 0; j < sectors; ++j) {
+      Real theta = 2 * M_PI * j / sectors;
+      vertices.emplace_back(std::sin(phi) * std::cos(theta), std::cos(phi),
+                            std::sin(phi) * std::sin(theta));
+    }
+  }
+  for (int i = 0; i < rings; ++i) {
+    for (int j = 0; j < sectors; ++j) {
+      int a = i * sectors + j;
+      int b = i * sectors + (j + 1) % sectors;
+      int c = a + sectors;
+      int d = b + sectors;
+      indices.insert(indices.end(), {a, b, d});
+      indices.insert(indices.end(), {d, c, a});
+    }
+  }
+}
+
+// Rays from a sphere of radius 3 * radius around the origin aimed at random
+// points of the ball of radius \p radius.
+std::vector<Ray> RandomRays(int n, Real radius = 1) {
+  std::mt19937 generator(1234);
+  std::uniform_real_distribution<Real> uniform(-1, 1);
+  auto random_in_ball = [&]() {
+    for (;;) {
+      Vec3 p(uniform(generator), uniform(generator), uniform(generator));
+      if (Length2(p) <= 1) return p;
+    }
+  };
+  std::vector<Ray> rays;
+  rays.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    auto origin = 3 * radius * Normalize(random_in_ball());
+    auto target = radius * random_in_ball();
+    rays.emplace_back(origin, Normalize(target - origin));
+  }
+  return rays;
+}
+
+// Photons on the walls of the box [-1, 1]^3, as if they had hit the walls
+// of a room.
+// @param positions filled with the position of each photon
+std::vector<Photon> RandomPhotons(int n, std::vector<Vec3f> &positions,
+                                  int seed = 1234) {
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<Real> uniform(-1, 1);
+  std::vector<Photon> photons;
+  photons.reserve(n);
+  positions.clear();
+  positions.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    Vec3 p(uniform(generator), uniform(generator), uniform(generator));
+    int wall = i % 6;
+    p[wall / 2] = wall % 2 ? 1 : -1;
+    Vec3 dir = -p;
+    dir[(wall / 2 + 1) % 3] += uniform(generator);
+    positions.emplace_back(p.x, p.y, p.z);
+    photons.emplace_back(Vec3(1E-6), Normalize(dir));
+  }
+  return photons;
+}
+
+void BenchMesh() {
+  auto rays = RandomRays(num_rays);
+  std::cout << std::setw(12) << "triangles" << std::setw(14) << "build (ms)"
+            << std::setw(12) << "nodes" << std::setw(10) << "SAH cost"
+            << std::setw(12) << "bvh (MB)" << std::setw(14) << "Mrays/s"
+            << std::setw(10) << "hits"
+            << "\n";
+  for (int segments = 8; segments <= 1024; segments *= 2) {
+    std::vector<Vec3> vertices;
+    std::vector<int> indices;
+    SphereMesh(segments, vertices, indices);
+    auto build_begin = Clock::now();
+    TriangleMesh mesh(Mat4(), vertices, indices);
+    auto build_end = Clock::now();
+    const auto &stats = mesh.bvh_stats();
+    int hits = 0;
+    auto trace_begin = Clock::now();
+    for (const auto &ray : rays) {
+      Real t;
+      SurfaceDiff surface;
+      hits += mesh.Intersect(ray, t, surface);
+    }
+    auto trace_end = Clock::now();
+    std::cout << std::setw(12) << indices.size() / 3 << std::setw(14)
+              << std::fixed << std::setprecision(2)
+              << 1000 * Seconds(build_begin, build_end) << std::setw(12)
+              << stats.num_nodes << std::setw(10) << stats.sah_cost
+              << std::setw(12) << mesh.data()->BvhMemoryUsage() / 1E6
+              << std::setw(14)
+              << rays.size() / Seconds(trace_begin, trace_end) / 1E6
+              << std::setw(10) << hits << "\n";
+  }
+}
+
+void BenchShadows() {
+  const Scene *scene = SceneFactory::GetInstance().GetScene(scene_name);
+  // rays towards random points of the lights from points of the box visited
+  // in scanline order, which makes consecutive rays coherent like the shadow
+  // rays of neighbouring pixels
+  std::mt19937 generator(1234);
+  std::uniform_real_distribution<Real> uniform(0, 1);
+  int side = std::max(1.0, std::cbrt(num_rays / scene->lights().size()));
+  std::vector<Ray> rays;
+  rays.reserve(num_rays);
+  for (int i = 0; rays.size() < num_rays; i = (i + 1) % (side * side * side)) {
+    Vec3 cell(i % side, i / side % side, i / (side * side));
+    for (const auto &light : scene->lights()) {
+      SurfaceDiff surface;
+      surface.p = (cell + Vec3(uniform(generator), uniform(generator),
+                               uniform(generator))) /
+                  side;
+      surface.p = Vec3(556, 548, 559) * surface.p;
+      SurfaceDiff surface_light;
+      Real pdf;
+      light->SampleLi(surface, surface_light, pdf);
+      rays.push_back(surface.SpawnRayTo(surface_light));
+    }
+  }
+  std::cout << std::setw(12) << "query" << std::setw(12) << "Mrays/s"
+            << std::setw(12) << "blocked"
+            << "\n";
+  // the best of a few runs to filter out the noise of other processes
+  int blocked;
+  auto best_rate = [&](std::function<bool(const Ray &)> query) {
+    double best = 0;
+    for (int run = 0; run < 3; ++run) {
+      blocked = 0;
+      auto begin = Clock::now();
+      for (const auto &ray : rays) {
+        blocked += query(ray);
+      }
+      auto end = Clock::now();
+      best = std::max(best, rays.size() / Seconds(begin, end) / 1E6);
+    }
+    return best;
+  };
+  double rate = best_rate([scene](const Ray &ray) {
+    SurfaceDiff surface;
+    return scene->Intersect(ray, surface);
+  });
+  std::cout << std::setw(12) << "closest" << std::setw(12) << std::fixed
+            << std::setprecision(2) << rate << std::setw(12) << blocked
+            << "\n";
+  rate = best_rate([scene](const Ray &ray) { return scene->Occluded(ray); });
+  std::cout << std::setw(12) << "occluded" << std::setw(12) << rate
+            << std::setw(12) << blocked << "\n";
+}
+
+void BenchAnimation() {
+  Scene *scene = SceneFactory::GetInstance().GetScene("cbox_spheres");
+  // the spheres are the last objects of the scene
+  int first_sphere = scene->objects().size() - 2;
+  std::vector<const Object *> spheres;
+  std::vector<Mat4> initial;
+  for (int i = first_sphere; i < scene->objects().size(); ++i) {
+    spheres.push_back(scene->objects()[i].get());
+    initial.push_back(scene->objects()[i]->shape().local_to_world());
+  }
+  // rays from random points of the box in random directions
+  std::mt19937 generator(1234);
+  std::uniform_real_distribution<Real> uniform(0, 1);
+  std::vector<Ray> rays;
+  int rays_per_frame = std::max(1, num_rays / num_frames);
+  for (int i = 0; i < rays_per_frame; ++i) {
+    Vec3 origin(556 * uniform(generator), 548 * uniform(generator),
+                559 * uniform(generator));
+    Real z = 1 - 2 * uniform(generator);
+    Real r = std::sqrt(std::max(Real(0), 1 - z * z));
+    Real phi = 2 * M_PI * uniform(generator);
+    rays.emplace_back(origin, Vec3(r * std::cos(phi), r * std::sin(phi), z));
+  }
+  std::cout << std::setw(12) << "update" << std::setw(14) << "ms/frame"
+            << std::setw(10) << "SAH cost" << std::setw(10) << "rebuilds"
+            << std::setw(12) << "Mrays/s" << std::setw(10) << "hits"
+            << "\n";
+  for (bool refit : {true, false}) {
+    int hits = 0;
+    double update_seconds = 0;
+    double trace_seconds = 0;
+    Real sah_cost = 0;
+    for (int frame = 0; frame < num_frames; ++frame) {
+      // the spheres circle the center of the box at different speeds
+      for (int i = 0; i < initial.size(); ++i) {
+        Real angle = 2 * M_PI * (i + 1) * frame / num_frames + M_PI * i;
+        Vec3 position(278 + 150 * std::cos(angle), initial[i][3][1],
+                      280 + 150 * std::sin(angle));
+        Mat4 transform(initial[i]);
+        transform[3] = Vec4(position, 1);
+        scene->SetObjectTransform(first_sphere + i, transform);
+      }
+      auto begin = Clock::now();
+      if (refit) {
+        scene->Update();
+      } else {
+        scene->Build();
+      }
+      auto end = Clock::now();
+      update_seconds += Seconds(begin, end);
+      sah_cost += scene->bvh_stats().sah_cost;
+      begin = Clock::now();
+      for (const auto &ray : rays) {
+        SurfaceDiff surface;
+        // count the hits on the spheres, every ray hits the box anyway
+        hits += scene->Intersect(ray, surface) &&
+                std::find(spheres.begin(), spheres.end(), surface.o) !=
+                    spheres.end();
+      }
+      end = Clock::now();
+      trace_seconds += Seconds(begin, end);
+    }
+    std::cout << std::setw(12) << (refit ? "refit" : "rebuild")
+              << std::setw(14) << std::fixed << std::setprecision(4)
+              << 1000 * update_seconds / num_frames << std::setw(10)
+              << std::setprecision(2) << sah_cost / num_frames
+              << std::setw(10) << scene->bvh_stats().num_rebuilds
+              << std::setw(12)
+              << rays.size() * num_frames / trace_seconds / 1E6
+              << std::setw(10) << hits << "\n";
+    for (int i = 0; i < initial.size(); ++i) {
+      scene->SetObjectTransform(first_sphere + i, initial[i]);
+    }
+    scene->Build();
+  }
+}
+
+void BenchInstances() {
+  std::vector<Vec3> vertices;
+  std::vector<int> indices;
+  SphereMesh(64, vertices, indices);
+  auto data = std::make_shared<TriangleMeshData>(vertices, indices);
+  std::size_t bytes_per_mesh = data->MemoryUsage();
+  std::cout << std::setw(12) << "instances" << std::setw(14) << "triangles"
+            << std::setw(14) << "build (ms)" << std::setw(14) << "shared (MB)"
+            << std::setw(14) << "copies (MB)" << std::setw(12) << "Mrays/s"
+            << std::setw(10) << "hits"
+            << "\n";
+  std::mt19937 generator(1234);
+  std::uniform_real_distribution<Real> uniform(0, 1);
+  for (int side = 1; side <= 16; side *= 2) {
+    // a cube of side^3 randomly rotated spheres 3 radii apart
+    auto build_begin = Clock::now();
+    Scene scene;
+    for (int i = 0; i < side * side * side; ++i) {
+      Vec3 position(i % side, i / side % side, i / (side * side));
+      position = 3 * position - 1.5 * (side - 1);
+      Vec3 axis = Normalize(
+          Vec3(uniform(generator), uniform(generator), uniform(generator)));
+      auto transform =
+          Rotate(Translate(Mat4(), position),
+                 Real(2 * M_PI * uniform(generator)), axis);
+      scene.AddObject(std::make_unique<Object>(
+          std::make_unique<TriangleMesh>(transform, data),
+          std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+    }
+    scene.Build();
+    auto build_end = Clock::now();
+    auto rays = RandomRays(num_rays, 1.5 * side);
+    int hits = 0;
+    auto trace_begin = Clock::now();
+    for (const auto &ray : rays) {
+      SurfaceDiff surface;
+      hits += scene.Intersect(ray, surface);
+    }
+    auto trace_end = Clock::now();
+    int instances = side * side * side;
+    // only the instances themselves grow when the geometry is shared
+    std::size_t shared = bytes_per_mesh + instances * (sizeof(Object) +
+                                                        sizeof(TriangleMesh));
+    std::size_t copies = instances * (bytes_per_mesh + sizeof(Object) +
+                                      sizeof(TriangleMesh));
+    std::cout << std::setw(12) << instances << std::setw(14)
+              << instances * indices.size() / 3 << std::setw(14) << std::fixed
+              << std::setprecision(2) << 1000 * Seconds(build_begin, build_end)
+              << std::setw(14) << shared / 1E6 << std::setw(14)
+              << copies / 1E6 << std::setw(12)
+              << rays.size() / Seconds(trace_begin, trace_end) / 1E6
+              << std::setw(10) << hits << "\n";
+  }
+}
+
+void BenchAccel() {
+  auto rays = RandomRays(num_rays);
+  std::cout << std::setw(12) << "spheres" << std::setw(10) << "accel"
+            << std::setw(14) << "build (ms)" << std::setw(12) << "Mrays/s"
+            << std::setw(10) << "hits"
+            << "\n";
+  std::mt19937 generator(1234);
+  std::uniform_real_distribution<Real> uniform(-1, 1);
+  for (int num_spheres = 1000; num_spheres <= 1000000; num_spheres *= 10) {
+    // spheres scattered in the unit ball like particles, covering about a
+    // tenth of its volume
+    Real radius = std::cbrt(0.1 / num_spheres);
+    std::vector<Vec3> centers;
+    while (centers.size() < num_spheres) {
+      Vec3 p(uniform(generator), uniform(generator), uniform(generator));
+      if (Length2(p) <= 1) centers.push_back(p);
+    }
+    Scene scene;
+    for (const auto &center : centers) {
+      scene.AddObject(std::make_unique<Object>(
+          std::make_unique<Sphere>(Translate(Mat4(), center), radius),
+          std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+    }
+    for (std::string name : {"bvh", "bvh4", "bvh8", "grid", "grid2"}) {
+      BvhOptions options = DefaultBvhOptions();
+      options.width = name == "bvh8" ? 8 : name == "bvh4" ? 4 : 2;
+      options.grid_levels = name == "grid2" ? 2 : name == "grid" ? 1 : 0;
+      auto build_begin = Clock::now();
+      scene.Build(options);
+      auto build_end = Clock::now();
+      int hits = 0;
+      auto trace_begin = Clock::now();
+      for (const auto &ray : rays) {
+        SurfaceDiff surface;
+        hits += scene.Intersect(ray, surface);
+      }
+      auto trace_end = Clock::now();
+      std::cout << std::setw(12) << num_spheres << std::setw(10) << name
+                << std::setw(14) << std::fixed << std::setprecision(2)
+                << 1000 * Seconds(build_begin, build_end) << std::setw(12)
+                << rays.size() / Seconds(trace_begin, trace_end) / 1E6
+                << std::setw(10) << hits << "\n";
+    }
+  }
+}
+
+void BenchParticles() {
+  auto rays = RandomRays(num_rays);
+  std::cout << std::setw(12) << "primitives" << std::setw(14) << "shapes"
+            << std::setw(14) << "build (ms)" << std::setw(12) << "Mrays/s"
+            << std::setw(10) << "hits"
+            << "\n";
+  std::mt19937 generator(1234);
+  std::uniform_real_distribution<Real> uniform(-1, 1);
+  auto trace = [&rays](int num_prims, const std::string &name,
+                       std::function<void(Scene &)> add_objects) {
+    auto build_begin = Clock::now();
+    Scene scene;
+    add_objects(scene);
+    scene.Build();
+    auto build_end = Clock::now();
+    int hits = 0;
+    auto trace_begin = Clock::now();
+    for (const auto &ray : rays) {
+      SurfaceDiff surface;
+      hits += scene.Intersect(ray, surface);
+    }
+    auto trace_end = Clock::now();
+    std::cout << std::setw(12) << num_prims << std::setw(14) << name
+              << std::setw(14) << std::fixed << std::setprecision(2)
+              << 1000 * Seconds(build_begin, build_end) << std::setw(12)
+              << rays.size() / Seconds(trace_begin, trace_end) / 1E6
+              << std::setw(10) << hits << "\n";
+  };
+  for (int num_prims = 1000; num_prims <= 1000000; num_prims *= 10) {
+    // primitives scattered in the unit ball like particles, the spheres
+    // covering about a tenth of its volume
+    Real radius = std::cbrt(0.1 / num_prims);
+    std::vector<Vec3> centers;
+    std::vector<Vec3> normals;
+    while (centers.size() < num_prims) {
+      Vec3 p(uniform(generator), uniform(generator), uniform(generator));
+      Vec3 n(uniform(generator), uniform(generator), uniform(generator));
+      if (Length2(p) <= 1 && Length2(n) > 0) {
+        centers.push_back(p);
+        normals.push_back(n);
+      }
+    }
+    std::vector<Real> radii(num_prims, radius);
+    trace(num_prims, "spheres", [&](Scene &scene) {
+      for (const auto &center : centers) {
+        scene.AddObject(std::make_unique<Object>(
+            std::make_unique<Sphere>(Translate(Mat4(), center), radius),
+            std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+      }
+    });
+    trace(num_prims, "sphere pool", [&](Scene &scene) {
+      scene.AddObject(std::make_unique<Object>(
+          std::make_unique<SpherePool>(Mat4(), centers, radii),
+          std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+    });
+    trace(num_prims, "disks", [&](Scene &scene) {
+      for (int i = 0; i < num_prims; ++i) {
+        // the disks lie on the plane y = 0 of their transform
+        auto y = Normalize(normals[i]);
+        auto x = Normalize(NormalTo(y));
+        auto z = Cross(x, y);
+        Mat4 local_to_world;
+        for (int j = 0; j < 3; ++j) {
+          local_to_world[0][j] = x[j];
+          local_to_world[1][j] = y[j];
+          local_to_world[2][j] = z[j];
+          local_to_world[3][j] = centers[i][j];
+        }
+        scene.AddObject(std::make_unique<Object>(
+            std::make_unique<Disk>(local_to_world, radius),
+            std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+      }
+    });
+    trace(num_prims, "disk pool", [&](Scene &scene) {
+      scene.AddObject(std::make_unique<Object>(
+          std::make_unique<DiskPool>(Mat4(), centers, normals, radii),
+          std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+    });
+  }
+}
+
+void BenchPackets() {
+  // the camera of ren, with 4 samples of 4 rays per pixel
+  const int kSize = 512;
+  Film film(0.025, 0.025, kSize, kSize, "packets");
+  PinholeCamera camera(Vec3(278, 273, -800), Vec3(278, 273, 0.0),
+                       Vec3(0.0, 1.0, 0.0), 0.035, film);
+  std::vector<std::vector<Ray>> pixels;
+  for (int i = 0; i < kSize; ++i) {
+    for (int j = 0; j < kSize; ++j) {
+      pixels.emplace_back();
+      for (int sample = 0; sample < 4; ++sample) {
+        auto rays = camera.GenRays(i, j);
+        pixels.back().insert(pixels.back().end(), rays.begin(), rays.end());
+      }
+    }
+  }
+  int num_rays = pixels.size() * pixels[0].size();
+
+  // a sphere of half a million triangles filling most of the image, where
+  // traversing the hierarchies dominates
+  std::vector<Vec3> vertices;
+  std::vector<int> indices;
+  SphereMesh(512, vertices, indices);
+  for (auto &vertex : vertices) {
+    vertex = Vec3(278, 273, 300) + 250 * vertex;
+  }
+  Scene mesh_scene;
+  mesh_scene.AddObject(std::make_unique<Object>(
+      std::make_unique<TriangleMesh>(Mat4(), vertices, indices),
+      std::make_unique<LambertianBrdf>(Vec3(0.8, 0.8, 0.8))));
+  mesh_scene.Build();
+
+  std::cout << std::setw(14) << "scene" << std::setw(10) << "tracing"
+            << std::setw(12) << "Mrays/s" << std::setw(12) << "hits"
+            << std::setw(16) << "distance"
+            << "\n";
+  auto trace = [&](const std::string &name, const Scene *scene) {
+    // the distances to the hits are summed to check both ways agree
+    int hits = 0;
+    Real distance = 0;
+    auto print = [&](const char *tracing, Clock::time_point begin,
+                     Clock::time_point end) {
+      std::cout << std::setw(14) << name << std::setw(10) << tracing
+                << std::setw(12) << std::fixed << std::setprecision(2)
+                << num_rays / Seconds(begin, end) / 1E6 << std::setw(12)
+                << hits << std::setw(16) << distance << "\n";
+    };
+    auto begin = Clock::now();
+    for (const auto &rays : pixels) {
+      for (const auto &ray : rays) {
+        SurfaceDiff surface;
+        if (scene->Intersect(ray, surface)) {
+          ++hits;
+          distance += Length(surface.p - ray.origin());
+        }
+      }
+    }
+    print("single", begin, Clock::now());
+    hits = 0;
+    distance = 0;
+    begin = Clock::now();
+    for (const auto &rays : pixels) {
+      RayPacket packet(rays.data(), rays.size());
+      SurfaceDiff surfaces[RayPacket::kMaxSize];
+      int mask = scene->Intersect(packet, surfaces);
+      for (int i = 0; i < packet.size(); ++i) {
+        if (mask >> i & 1) {
+          ++hits;
+          distance += Length(surfaces[i].p - packet[i].origin());
+        }
+      }
+    }
+    print("packet", begin, Clock::now());
+  };
+  trace(scene_name, SceneFactory::GetInstance().GetScene(scene_name));
+  trace("mesh", &mesh_scene);
+}
+
+// Interleave the bits of the 10 bit quantization of each coordinate of a
+// point of [-1, 1]^3.
+unsigned MortonCode(const Vec3 &p) {
+  unsigned code = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    auto x = static_cast<unsigned>(
+        std::min(std::max((p[axis] + 1) * 512, Real(0)), Real(1023)));
+    for (int bit = 0; bit < 10; ++bit) {
+      code |= (x >> bit & 1) << (3 * bit + axis);
+    }
+  }
+  return code;
+}
+
+void BenchOutOfCore() {
+  // a sphere of a million triangles split into clusters of 4K triangles
+  const std::string path = "ren_bench_out_of_core.mesh";
+  std::vector<Vec3> vertices;
+  std::vector<int> indices;
+  SphereMesh(512, vertices, indices);
+  OutOfCoreMesh::Write(path, vertices, indices);
+  // the rays in random order, and sorted by their origins so that
+  // consecutive rays reach the same clusters
+  auto random_rays = RandomRays(num_rays / 10);
+  auto sorted_rays = random_rays;
+  std::sort(sorted_rays.begin(), sorted_rays.end(),
+            [](const Ray &a, const Ray &b) {
+              return MortonCode(a.origin() / 3) < MortonCode(b.origin() / 3);
+            });
+  std::cout << std::setw(12) << "budget (%)" << std::setw(12) << "order"
+            << std::setw(12) << "Mrays/s" << std::setw(10) << "hits"
+            << std::setw(12) << "faults" << std::setw(14) << "hit rate (%)"
+            << std::setw(12) << "peak (MB)"
+            << "\n";
+  auto trace = [](Shape &mesh, const std::vector<Ray> &rays, int &hits) {
+    hits = 0;
+    auto begin = Clock::now();
+    for (const auto &ray : rays) {
+      Real t;
+      SurfaceDiff surface;
+      hits += mesh.Intersect(ray, t, surface);
+    }
+    return rays.size() / Seconds(begin, Clock::now()) / 1E6;
+  };
+  int hits;
+  {
+    TriangleMesh mesh(Mat4(), vertices, indices);
+    double mrays = trace(mesh, random_rays, hits);
+    std::cout << std::setw(12) << "in memory" << std::setw(12) << "random"
+              << std::setw(12) << std::fixed << std::setprecision(2) << mrays
+              << std::setw(10) << hits << "\n";
+  }
+  vertices = std::vector<Vec3>();
+  indices = std::vector<int>();
+  // the budgets are fractions of the size of all the clusters
+  auto total_bytes = OutOfCoreMesh(Mat4(), path, 0).total_bytes();
+  for (int percent : {100, 50, 25, 10, 5}) {
+    for (std::string order : {"random", "sorted"}) {
+      OutOfCoreMesh mesh(Mat4(), path, total_bytes * percent / 100);
+      double mrays =
+          trace(mesh, order == "random" ? random_rays : sorted_rays, hits);
+      auto stats = mesh.stats();
+      std::cout << std::setw(12) << percent << std::setw(12) << order
+                << std::setw(12) << mrays << std::setw(10) << hits
+                << std::setw(12) << stats.faults << std::setw(14)
+                << 100.0 * stats.hits / std::max(stats.requests, 1LL)
+                << std::setw(12) << stats.peak_resident_bytes / 1E6 << "\n";
+    }
+  }
+  std::remove(path.c_str());
+}
+
+void BenchCache() {
+  const std::string directory = "ren_bench_cache";
+  SceneCache cache(directory);
+  cache.Clear();
+  std::cout << std::setw(12) << "triangles" << std::setw(12) << "build (s)"
+            << std::setw(12) << "miss (s)" << std::setw(12) << "hit (s)"
+            << std::setw(12) << "speedup" << std::setw(12) << "file (MB)"
+            << "\n";
+  std::vector<Vec3> vertices;
+  std::vector<int> indices;
+  for (int segments : {64, 128, 256, 512}) {
+    SphereMesh(segments, vertices, indices);
+    auto begin = Clock::now();
+    {
+      TriangleMeshData data(vertices, indices);
+      data.BuildLevelsOfDetail();
+    }
+    double build = Seconds(begin, Clock::now());
+    auto bytes_written = cache.stats().bytes_written;
+    begin = Clock::now();
+    cache.Mesh(vertices, indices, true);
+    double miss = Seconds(begin, Clock::now());
+    begin = Clock::now();
+    cache.Mesh(vertices, indices, true);
+    double hit = Seconds(begin, Clock::now());
+    std::cout << std::setw(12) << indices.size() / 3 << std::setw(12)
+              << std::fixed << std::setprecision(3) << build << std::setw(12)
+              << miss << std::setw(12) << hit << std::setw(12)
+              << std::setprecision(1) << build / hit << std::setw(12)
+              << (cache.stats().bytes_written - bytes_written) / 1E6 << "\n";
+  }
+  cache.Clear();
+  std::remove(directory.c_str());
+}
+
+void BenchThreads() {
+  const int kSize = 128;
+  const std::string path = "ren_bench_threads";
+  auto scene = SceneFactory::GetInstance().GetScene(scene_name);
+  Film film(0.025, 0.025, kSize, kSize, path);
+  PinholeCamera camera(Vec3(278, 273, -800), Vec3(278, 273, 0.0),
+                       Vec3(0.0, 1.0, 0.0), 0.035, film);
+  auto pinning = affinity == "compact"   ? ThreadPool::kCompact
+                 : affinity == "scatter" ? ThreadPool::kScatter
+                                         : ThreadPool::kNone;
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> thread_counts;
+  for (int n = 1; n < max_threads; n *= 2) {
+    thread_counts.push_back(n);
+  }
+  thread_counts.push_back(max_threads);
+  std::cout << std::setw(10) << "threads" << std::setw(10) << "nodes"
+            << std::setw(12) << "time (s)" << std::setw(12) << "speedup"
+            << std::setw(16) << "efficiency (%)" << std::setw(12)
+            << "idle (%)"
+            << "\n";
+  double serial = 0;
+  for (int n : thread_counts) {
+    ThreadPool pool(n, pinning);
+    PathTracer renderer(scene, &camera, 4);
+    renderer.set_thread_pool(&pool);
+    auto begin = Clock::now();
+    renderer.Render();
+    double seconds = Seconds(begin, Clock::now());
+    if (n == 1) {
+      serial = seconds;
+    }
+    double idle_ms = 0;
+    for (const auto &stats : renderer.tile_stats()) {
+      idle_ms += stats.idle_ms;
+    }
+    std::cout << std::setw(10) << n << std::setw(10) << pool.num_nodes()
+              << std::setw(12) << std::fixed << std::setprecision(3)
+              << seconds << std::setw(12) << std::setprecision(2)
+              << serial / seconds << std::setw(16) << std::setprecision(1)
+              << 100 * serial / seconds / n << std::setw(12)
+              << idle_ms / 10 / seconds / n << "\n";
+  }
+  std::remove((path + ".ppm").c_str());
+}
+
+void BenchKdTree() {
+  std::cout << std::setw(12) << "photons" << std::setw(12) << "build (ms)"
+            << std::setw(14) << "ms/Mphotons" << std::setw(12) << "memory (MB)"
+            << "\n";
+  for (int n : {250000, 1000000, 4000000, 10000000}) {
+    std::vector<Vec3f> positions;
+    auto photons = RandomPhotons(n, positions);
+    auto begin = Clock::now();
+    PhotonMap map(std::move(positions), std::move(photons),
+                  *DefaultBvhOptions().thread_pool);
+    double ms = Seconds(begin, Clock::now()) * 1E3;
+    std::cout << std::setw(12) << n << std::setw(12) << std::fixed
+              << std::setprecision(1) << ms << std::setw(14) << ms * 1E6 / n
+              << std::setw(12) << map.MemoryUsage() / 1E6 << "\n";
+  }
+}
+
+void BenchKnn() {
+  std::vector<Vec3f> positions;
+  auto photons = RandomPhotons(1000000, positions);
+  PhotonMap map(std::move(positions), std::move(photons),
+                *DefaultBvhOptions().thread_pool);
+  // the queries are on the walls too, in batches of points close together
+  // like the hits of the camera rays of a tile
+  const int kBatchSize = 256;
+  int num_batches = std::max(1, num_rays / 10 / kBatchSize);
+  int num_queries = num_batches * kBatchSize;
+  std::vector<std::vector<Vec3>> batches(num_batches);
+  std::vector<Vec3f> centers;
+  RandomPhotons(num_batches, centers, 5678);
+  std::mt19937 generator(91011);
+  std::uniform_real_distribution<Real> uniform(-0.05, 0.05);
+  for (int b = 0; b < num_batches; ++b) {
+    Vec3 center(centers[b].x, centers[b].y, centers[b].z);
+    int wall = b % 6;
+    for (int i = 0; i < kBatchSize; ++i) {
+      Vec3 p = center + Vec3(uniform(generator), uniform(generator),
+                             uniform(generator));
+      p[wall / 2] = center[wall / 2];
+      batches[b].push_back(p);
+    }
+  }
+  std::cout << std::setw(8) << "k" << std::setw(16) << "single (q/s)"
+            << std::setw(16) << "batched (q/s)" << std::setw(10) << "speedup"
+            << std::setw(12) << "radius"
+            << "\n";
+  std::vector<PhotonMap::QueryResult> results;
+  std::vector<std::vector<PhotonMap::QueryResult>> batch_results;
+  for (int k : {50, 100, 500}) {
+    Real radius = 0;
+    auto begin = Clock::now();
+    for (const auto &batch : batches) {
+      for (const auto &query : batch) {
+        map.QueryNearest(query, k, results);
+        radius += std::sqrt(results.front().distance2);
+      }
+    }
+    double single = Seconds(begin, Clock::now());
+    begin = Clock::now();
+    for (const auto &batch : batches) {
+      map.QueryNearest(batch, k, batch_results);
+    }
+    double batched = Seconds(begin, Clock::now());
+    std::cout << std::setw(8) << k << std::setw(16) << std::fixed
+              << std::setprecision(0) << num_queries / single << std::setw(16)
+              << num_queries / batched << std::setw(10) << std::setprecision(2)
+              << single / batched << std::setw(12) << std::setprecision(4)
+              << radius / num_queries << "\n";
+  }
+}
+
+void GetValue(int argc, char *argv[], int &option, int &value) {
+  if (option + 1 < argc) {
+    try {
+      value = std::stoi(argv[option + 1]);
+      ++option;
+    } catch (const std::invalid_argument &) {
+      std::string s = "Value of option \"" + std::string(argv[option]) +
+                      "\" is not a number.";
+      throw std::invalid_argument(s);
+    }
+  } else {
+    std::string msg = "Option \"" + std::string(argv[option]) +
+                      "\" specified without a value.";
+    throw std::invalid_argument(msg);
+  }
+}
+
+void GetValue(int argc, char *argv[], int &option,
+              std::initializer_list<std::string> valid, std::string &value) {
+  if (option + 1 < argc) {
+    value = argv[option + 1];
+    ++option;
+    if (valid.size() != 0 &&
+        std::find(valid.begin(), valid.end(), value) == valid.end()) {
+      std::string msg =
+          "Unknown value for option \"" + std::string(argv[option]) + "\"";
+      throw std::invalid_argument(msg);
+    }
+  } else {
+    std::string msg = "Option \"" + std::string(argv[option]) +
+                      "\" specified without a value.";
+    throw std::invalid_argument(msg);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || strcmp(argv[1], "-h") == 0) {
+    std::cout << kUsage;
+    return 0;
+  }
+  std::string benchmark = argv[1];
+  auto &bvh_options = DefaultBvhOptions();
+  int build_threads = 0;
+  try {
+    for (int i = 2; i < argc; ++i) {
+      if (strcmp(argv[i], "-n") == 0) {
+        GetValue(argc, argv, i, num_rays);
+      } else if (strcmp(argv[i], "-frames") == 0) {
+        GetValue(argc, argv, i, num_frames);
+      } else if (strcmp(argv[i], "-s") == 0) {
+        GetValue(argc, argv, i,
+                 {"cbox_blocks", "cbox_spheres", "cbox_sphere_inside",
+                  "cbox_blocks_disk", "cbox_particles", "cbox_meshes"},
+                 scene_name);
+      } else if (strcmp(argv[i], "-accel") == 0) {
+        GetValue(argc, argv, i, {"bvh", "bvh4", "bvh8", "grid", "grid2"},
+                 accel);
+      } else if (strcmp(argv[i], "-affinity") == 0) {
+        GetValue(argc, argv, i, {"none", "compact", "scatter"}, affinity);
+      } else if (strcmp(argv[i], "-bvh") == 0) {
+        GetValue(argc, argv, i, {"sah", "middle"}, split_method);
+      } else if (strcmp(argv[i], "-leaf") == 0) {
+        GetValue(argc, argv, i, bvh_options.max_prims_in_node);
+      } else if (strcmp(argv[i], "-bins") == 0) {
+        GetValue(argc, argv, i, bvh_options.num_bins);
+      } else if (strcmp(argv[i], "-bt") == 0) {
+        GetValue(argc, argv, i, build_threads);
+      } else if (strcmp(argv[i], "-sbvh") == 0) {
+        bvh_options.spatial_splits = true;
+      } else if (strcmp(argv[i], "-qbvh") == 0) {
+        bvh_options.compressed = true;
+      } else if (strcmp(argv[i], "-bvh-stats") == 0) {
+        bvh_options.report = true;
+      } else {
+        std::string msg = "Unknown option \"" + std::string(argv[i]) + "\".";
+        throw std::invalid_argument(msg);
+      }
+    }
+  } catch (const std::invalid_argument &e) {
+    std::cerr << e.what();
+    std::cerr << "\nSee \"" + std::string(argv[0]) + " -h\" for help\n";
+    return -1;
+  }
+  bvh_options.split_method =
+      split_method == "sah" ? BvhOptions::kSah : BvhOptions::kMiddle;
+  bvh_options.width = accel == "bvh8" ? 8 : accel == "bvh4" ? 4 : 2;
+  bvh_options.grid_levels = accel == "grid2" ? 2 : accel == "grid" ? 1 : 0;
+  ThreadPool build_pool(build_threads);
+  bvh_options.thread_pool = &build_pool;
+  if (benchmark == "mesh") {
+    BenchMesh();
+  } else if (benchmark == "shadows") {
+    BenchShadows();
+  } else if (benchmark == "animation") {
+    BenchAnimation();
+  } else if (benchmark == "instances") {
+    BenchInstances();
+  } else if (benchmark == "accel") {
+    BenchAccel();
+  } else if (benchmark == "packets") {
+    BenchPackets();
+  } else if (benchmark == "particles") {
+    BenchParticles();
+  } else if (benchmark == "ooc") {
+    BenchOutOfCore();
+  } else if (benchmark == "cache") {
+    BenchCache();
+  } else if (benchmark == "threads") {
+    BenchThreads();
+  } else if (benchmark == "kdtree") {
+    BenchKdTree();
+  } else if (benchmark == "knn") {
+    BenchKnn();
+  } else {
+    std::cerr << "The benchmark \"" + benchmark + "\" doesn't exist\n";
+    return -1;
+  }
+  return 0;
+}
@@ -8,7 +8,7 @@ static const char kUsage[] =
     R"(Ren. A small path tracer and photon mapping renderer.
 
     Usage:
-      ren [-r <string>] [-spp <integer>] [-s <string>] [-o <string>] [-cp <integer>] [-ip <integer>] [-np <integer>]
+      ren [-r <string>] [-spp <integer>] [-s <string>] [-o <string>] [-cp <integer>] [-ip <integer>] [-np <integer>] [-accel <string>] [-bvh <string>] [-leaf <integer>] [-bins <integer>] [-sbvh] [-qbvh] [-bvh-stats] [-lod] [-cache <string>] [-tile <integer>] [-order <string>] [-tile-stats] [-threads <integer>] [-affinity <string>] [-numa-replicate]
       ren -h
 
     Options:
@@ -18,7 +18,7 @@ static const char kUsage[] =
       -o <name>     
            Path of the output image without the extensions. [default: output]
 
-      -s <cbox_blocks|cbox_spheres|cbox_sphere_inside|cbox_blocks_disk>     
+      -s <cbox_blocks|cbox_spheres|cbox_sphere_inside|cbox_blocks_disk|cbox_particles|cbox_meshes>     
            Name of the scene to render. [default: cbox_blocks]
 
       -r <pt|pm>    
@@ -34,6 +34,73 @@ static const char kUsage[] =
       -np <integer> 
            Number of neighbours photons to use during radiance estimation in photon mapping. [default: 100]
 
+      -accel <bvh|bvh4|bvh8|grid|grid2>
+           Acceleration structure of the scene and the meshes. Choose between
+           <bvh> (binary hierarchy), <bvh4> and <bvh8> (hierarchies with 4 or
+           8 children per node tested together with SIMD instructions), <grid>
+           (uniform grid) and <grid2> (grid whose cells are split by grids of
+           their own). Grids are faster to build but slower to trace, for
+           previews. [default: bvh]
+
+      -bvh <sah|middle>
+           Split method used to build the hierarchies. Choose between <sah>
+           (binned surface area heuristic) and <middle> (middle of the
+           centroids' extent). [default: sah]
+
+      -leaf <integer>
+           Maximum number of triangles in a leaf of the mesh hierarchies. [default: 4]
+
+      -bins <integer>
+           Number of bins per axis used by the SAH builder. [default: 16]
+
+      -sbvh
+           Build the mesh hierarchies with spatial splits, which duplicate
+           triangles straddling a split. Slower to build, faster to trace
+           meshes with long or overlapping triangles.
+
+      -qbvh
+           Store the mesh hierarchies with the bounds of the nodes quantized to
+           8 bits, which takes less than a third of the memory.
+
+      -bvh-stats
+           Print the build time, node count and SAH cost of every hierarchy.
+
+      -lod
+           Trace the rays scattered by diffuse and glossy surfaces, and the
+           photons, as cones so that the meshes with levels of detail, like
+           those of cbox_meshes, answer the wide ones with coarser triangles.
+
+      -cache <directory>
+           Keep the meshes and particles of the scenes, along with their
+           hierarchies, in files of this directory, so that loading the scene
+           again with the same settings maps them instead of building them.
+
+      -tile <integer>
+           Size in pixels of the square tiles the threads render. A thread
+           that runs out of tiles steals from the others. [default: 16]
+
+      -order <scanline|morton|hilbert>
+           Order of the tiles. Along the <morton> and <hilbert> curves the
+           tiles of a thread are close in the image. [default: hilbert]
+
+      -tile-stats
+           Print the tiles rendered, tiles stolen and busy and idle time of
+           every thread.
+
+      -threads <integer>
+           Number of threads rendering the image and building the
+           hierarchies, 0 for all the hardware threads. [default: 0]
+
+      -affinity <none|compact|scatter>
+           Pin the threads to CPUs. Choose between <none> (let the OS
+           place them), <compact> (fill the CPUs of a NUMA node before the
+           next) and <scatter> (spread them round robin over the nodes).
+           [default: none]
+
+      -numa-replicate
+           Give each NUMA node its own copy of the photon map, read by the
+           threads pinned to it. Needs -affinity.
+
       -h            
            Show this screen.
 )";
@@ -49,6 +116,16 @@ int num_neighbour_photons = 100;
 std::string o = "output";
 std::string s = "cbox_blocks";
 std::string r = "pt";
+std::string bvh = "sah";
+std::string accel = "bvh";
+bool lod = false;
+std::string cache;
+int tile_size = TileScheduler::kDefaultTileSize;
+std::string order = "hilbert";
+bool tile_stats = false;
+int num_threads = 0;
+std::string affinity = "none";
+bool numa_replicate = false;
 
 void GetValue(int argc, char *argv[], int &option, int &value) {
   if (option + 1 < argc) {
@@ -90,6 +167,7 @@ int main(int argc, char *argv[]) {
     std::cout << kUsage;
     return 0;
   }
+  auto &bvh_options = DefaultBvhOptions();
   try {
     for (int i = 1; i < argc; ++i) {
       // if (strcmp(argv[i], "-fw") == 0) {
@@ -115,6 +193,37 @@ int main(int argc, char *argv[]) {
         GetValue(argc, argv, i, {}, s);
       } else if (strcmp(argv[i], "-r") == 0) {
         GetValue(argc, argv, i, {"pt", "pm"}, r);
+      } else if (strcmp(argv[i], "-accel") == 0) {
+        GetValue(argc, argv, i, {"bvh", "bvh4", "bvh8", "grid", "grid2"},
+                 accel);
+      } else if (strcmp(argv[i], "-bvh") == 0) {
+        GetValue(argc, argv, i, {"sah", "middle"}, bvh);
+      } else if (strcmp(argv[i], "-leaf") == 0) {
+        GetValue(argc, argv, i, bvh_options.max_prims_in_node);
+      } else if (strcmp(argv[i], "-bins") == 0) {
+        GetValue(argc, argv, i, bvh_options.num_bins);
+      } else if (strcmp(argv[i], "-sbvh") == 0) {
+        bvh_options.spatial_splits = true;
+      } else if (strcmp(argv[i], "-qbvh") == 0) {
+        bvh_options.compressed = true;
+      } else if (strcmp(argv[i], "-bvh-stats") == 0) {
+        bvh_options.report = true;
+      } else if (strcmp(argv[i], "-lod") == 0) {
+        lod = true;
+      } else if (strcmp(argv[i], "-cache") == 0) {
+        GetValue(argc, argv, i, {}, cache);
+      } else if (strcmp(argv[i], "-tile") == 0) {
+        GetValue(argc, argv, i, tile_size);
+      } else if (strcmp(argv[i], "-order") == 0) {
+        GetValue(argc, argv, i, {"scanline", "morton", "hilbert"}, order);
+      } else if (strcmp(argv[i], "-tile-stats") == 0) {
+        tile_stats = true;
+      } else if (strcmp(argv[i], "-threads") == 0) {
+        GetValue(argc, argv, i, num_threads);
+      } else if (strcmp(argv[i], "-affinity") == 0) {
+        GetValue(argc, argv, i, {"none", "compact", "scatter"}, affinity);
+      } else if (strcmp(argv[i], "-numa-replicate") == 0) {
+        numa_replicate = true;
       } else {
         std::string msg = "Unknown option \"" + std::string(argv[i]) + "\".";
         throw std::invalid_argument(msg);
@@ -125,11 +234,32 @@ int main(int argc, char *argv[]) {
     std::cerr << "\nSee \"" + std::string(argv[0]) + " -h\" for help\n";
     return -1;
   }
-  auto scene = SceneFactory::GetInstance().GetScene(s);
+  bvh_options.split_method =
+      bvh == "sah" ? BvhOptions::kSah : BvhOptions::kMiddle;
+  bvh_options.width = accel == "bvh8" ? 8 : accel == "bvh4" ? 4 : 2;
+  bvh_options.grid_levels = accel == "grid2" ? 2 : accel == "grid" ? 1 : 0;
+  ThreadPool pool(num_threads, affinity == "compact"   ? ThreadPool::kCompact
+                               : affinity == "scatter" ? ThreadPool::kScatter
+                                                       : ThreadPool::kNone);
+  bvh_options.thread_pool = &pool;
+  auto &factory = SceneFactory::GetInstance();
+  Scene *scene;
+  try {
+    if (!cache.empty()) {
+      factory.set_cache_directory(cache);
+    }
+    scene = factory.GetScene(s);
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << "\n";
+    return -1;
+  }
   if (scene == nullptr) {
     std::cerr << "The scene \"" + s + "\" doesn't exist\n";
     return -1;
   }
+  if (factory.cache()) {
+    std::cout << "Scene cache: " << factory.cache()->stats() << "\n";
+  }
   Film film(fh, fw, ih, iw, o);
   PinholeCamera camera(Vec3(278, 273, -800), Vec3(278, 273, 0.0),
                        Vec3(0.0, 1.0, 0.0), 0.035, film);
@@ -141,6 +271,19 @@ int main(int argc, char *argv[]) {
         scene, &camera, spp, num_caustic_photons, num_indirect_photons,
         num_neighbour_photons);
   }
+  renderer->set_ray_cones(lod);
+  auto tile_order = order == "scanline" ? TileScheduler::kScanline
+                    : order == "morton"   ? TileScheduler::kMorton
+                                          : TileScheduler::kHilbert;
+  renderer->set_tiles(tile_size, tile_order);
+  renderer->set_thread_pool(&pool);
+  renderer->set_replicate(numa_replicate);
   renderer->Render();
+  if (tile_stats) {
+    const auto &stats = renderer->tile_stats();
+    for (int i = 0; i < stats.size(); ++i) {
+      std::cout << "Thread " << i << ": " << stats[i] << "\n";
+    }
+  }
   return 0;
 }